@@ -14,6 +14,10 @@
 #include <iostream>
 #include <math.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
 
 #include <vips/vips8>
 
@@ -22,6 +26,12 @@
 #include "nrutil.h"
 #include "computepoly.h"
 #include "writeptm.h"
+#include "writepyramid.h"
+#include "spill.h"
+#include "polykernel.h"
+#include "stackcache.h"
+#include "pinvcache.h"
+#include "accumulate.h"
 
 using namespace vips;
 
@@ -29,7 +39,7 @@ using namespace vips;
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
 
-LinearSystem::LinearSystem(Basis_e b, bool c, int crop_left, int crop_top, 
+LinearSystem::LinearSystem(Basis_e b, Cache_e c, int crop_left, int crop_top, 
 	int crop_width, int crop_height)
 {
   basis_m = b;
@@ -38,6 +48,25 @@ LinearSystem::LinearSystem(Basis_e b, bool c, int crop_left, int crop_top,
   crop_top_m = crop_top;
   crop_width_m = crop_width;
   crop_height_m = crop_height;
+  fast_quant = false;
+  stack_cache = false;
+  spill_dir = NULL;
+  image_dir = NULL;
+  accumulate = 0;
+  robust = false;
+  robust_shadow = 0;
+  robust_highlight = 255;
+  robust_rounds = 0;
+  positional = false;
+  plane_width = 0;
+  plane_height = 0;
+  tile = 256;
+  tile_px = 0;
+  rgb = false;
+  jpeg_quality = 0;
+  sequential = false;
+  output_fd = -1;
+  progress = true;
   colors = 0;
   Samples_m = 0;
 }
@@ -66,42 +95,178 @@ readLine (FILE * fp, char *buf, int limit)
   buf[i] = '\0';
 }
 
-// load the files from the filenames that were found in the .lp file
+// the file for input image i: the lp file may have full paths from the
+// machine that made it, so we just use the basename, in image_dir if set
+char *
+LinearSystem::ImageName (int i)
+{
+  char *basename = g_path_get_basename(Samples_m[i].filename); 
+
+  if (image_dir)
+    {
+      char *filename = g_build_filename(image_dir, basename, NULL);
+
+      g_free (basename);
+
+      return filename;
+    }
+
+  return basename;
+}
+
+// the margin we add to each side of the coefficient range we find in a 
+// -fast-quant preview, as a fraction of the range
+#define FAST_QUANT_MARGIN (0.1)
+
+// load the whole stack from the stack cache, building it if necessary, 
+// then shrink and crop
 int
-LinearSystem::LoadFiles ()
+LinearSystem::LoadStack (int shrink)
+{
+  int i;
+
+  // the cache file is memory mapped and random access, so we only need to
+  // open it once
+  if (!stack_full.get_image())
+    {
+      char **names = new char *[Images_m];
+
+      for (i = 0; i < Images_m; i++)
+	names[i] = ImageName (i);
+
+      char *filename = stack_cache_filename (Images_m, names);
+      if (stack_cache_fresh (Images_m, names))
+	printf ("Reading stack cache %s\n", filename);
+      else if (g_file_test (filename, G_FILE_TEST_EXISTS))
+	printf ("Rebuilding stale stack cache %s\n", filename);
+      else
+	printf ("Building stack cache %s\n", filename);
+      g_free (filename);
+
+      VipsImage *image;
+      int result = stack_cache_load (Images_m, names, &image);
+
+      for (i = 0; i < Images_m; i++)
+	g_free (names[i]);
+      delete [] names;
+
+      if (result)
+	{
+	  std::cerr << "Error loading stack cache\n";
+	  std::cerr << vips_error_buffer();
+	  return -1;
+	}
+
+      stack_full = VImage (image);
+    }
+
+  VImage im = stack_full;
+
+  if (shrink != 1)
+    im = im.shrink (shrink, shrink);
+
+  int left = crop_left_m / 1000.0 * im.width();
+  int top = crop_top_m / 1000.0 * im.height();
+  int width = crop_width_m / 1000.0 * im.width();
+  int height = crop_height_m / 1000.0 * im.height();
+
+  stack = im.extract_area (left, top, width, height);
+
+  for (i = 0; i < Images_m; i++)
+    {
+      Samples_m[i].xsize = stack.width();
+      Samples_m[i].ysize = stack.height();
+    }
+
+  return 1;
+}
+
+// the inputs for compute_polys: one image per light, or one big stack image
+std::vector<VImage>
+LinearSystem::Inputs ()
+{
+  std::vector<VImage> in;
+
+  if (stack_cache)
+    in.push_back(stack);
+  else
+    for (int i = 0; i < Images_m; i++)
+      in.push_back(Samples_m[i].im);
+
+  return in;
+}
+
+// open an input image, optionally shrinking by an integer factor, and crop
+VImage
+LinearSystem::LoadImage (const char *filename, int shrink)
+{
+  VImage im;
+
+  if (shrink == 1)
+    im = VImage::new_from_file(filename, 
+      VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+  else
+    {
+      const char *loader = vips_foreign_find_load(filename);
+
+      // libjpeg can shrink during decode for us, which is much faster
+      if (loader && strstr(loader, "Jpeg"))
+	im = VImage::new_from_file(filename, 
+	  VImage::option()->
+	    set("access", VIPS_ACCESS_SEQUENTIAL)->
+	    set("shrink", shrink));
+      else
+	im = VImage::new_from_file(filename, 
+	  VImage::option()->
+	    set("access", VIPS_ACCESS_SEQUENTIAL)).
+	  shrink(shrink, shrink);
+    }
+
+  int left = crop_left_m / 1000.0 * im.width();
+  int top = crop_top_m / 1000.0 * im.height();
+  int width = crop_width_m / 1000.0 * im.width();
+  int height = crop_height_m / 1000.0 * im.height();
+
+  return im.extract_area (left, top, width, height);
+}
+
+// load the files from the filenames that were found in the .lp file,
+// optionally shrinking by an integer factor
+int
+LinearSystem::LoadFiles (int shrink)
 {
   int stat = 1;
   int i;
 
+  if (stack_cache)
+    return LoadStack (shrink);
+
   /* Output images.  high images has r,g,b = A,B,C repectively */
   /* low images have r,g,b = D,E,F */
 
-  printf ("Reading images:");
+  if (progress)
+    printf ("Reading images:");
+  else
+    printf ("Reading %d images\n", Images_m);
 
   for (i = 0; i < Images_m; i++)
     {
       char buf[5];
 
-      sprintf (buf, "%3i", i + 1);
-      if (i)
-	printf ("\b\b\b");
-      printf ("%s", buf);
-      fflush (stdout);
-
-      char *basename = g_path_get_basename(Samples_m[i].filename); 
+      if (progress)
+	{
+	  sprintf (buf, "%3i", i + 1);
+	  if (i)
+	    printf ("\b\b\b");
+	  printf ("%s", buf);
+	  fflush (stdout);
+	}
 
-      VImage im = VImage::new_from_file(basename, 
-	VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+      char *basename = ImageName (i);
+      VImage im = LoadImage (basename, shrink);
 
       g_free( basename ); 
 
-      int left = crop_left_m / 1000.0 * im.width();
-      int top = crop_top_m / 1000.0 * im.height();
-      int width = crop_width_m / 1000.0 * im.width();
-      int height = crop_height_m / 1000.0 * im.height();
-
-      im = im.extract_area (left, top, width, height);
-
       Samples_m[i].im = im;
       Samples_m[i].xsize = im.width();
       Samples_m[i].ysize = im.height();
@@ -114,7 +279,8 @@ LinearSystem::LoadFiles ()
 	}
     }
 
-  printf ("\n");
+  if (progress)
+    printf ("\n");
 
   return stat;
 }
@@ -142,16 +308,35 @@ LinearSystem::InitFiles (char *lpfile)
     }
 
   Samples_m = new RGB_Image[Images_m];
+  positions.resize (3 * Images_m);
 
   for (int i = 0; i < Images_m; i++)
     {
       char inputLine[STRSIZE];
 
       readLine (infofp, inputLine, STRSIZE);
+
+      // an optional line before the images: "positional WIDTH HEIGHT" 
+      // means the lights are positions, in the units of the object plane
+      // the frame covers
+      if (i == 0 &&
+	  !positional &&
+	  sscanf (inputLine, "positional %lf %lf", 
+		  &plane_width, &plane_height) == 2)
+	{
+	  positional = true;
+	  i -= 1;
+	  continue;
+	}
+
       readargs = sscanf (inputLine, "%s %f %f %f", (char *) &filedesc,
 			 &(Samples_m[i].x), &(Samples_m[i].y),
 			 &(Samples_m[i].z));
 
+      positions[3 * i] = Samples_m[i].x;
+      positions[3 * i + 1] = Samples_m[i].y;
+      positions[3 * i + 2] = Samples_m[i].z;
+
       if (readargs != 4)
 	{
 	  printf
@@ -183,6 +368,19 @@ LinearSystem::InitFiles (char *lpfile)
 
   fclose (infofp);
 
+  if (positional)
+    {
+      if (plane_width <= 0 || 
+	  plane_height <= 0)
+	{
+	  fprintf (stderr, "Light Position file: bad object plane size\n");
+	  return -1;
+	}
+
+      printf ("positional lights over a %g x %g plane\n", 
+	      plane_width, plane_height);
+    }
+
   return 0;
 }
 
@@ -202,199 +400,880 @@ LinearSystem::FitPTM (char *lpfile)
   // then we call the solver to obtain the result
   // Afterwards scale and bias have to be computed and the PTM file has to 
   // be written
-  double **M;
-
-  stat = BuildMatrix (M);
-  if (stat == -1)
-    return stat;
-
-  stat = ComputePolynomials (M);
-  if (stat == -1)
-    return stat;
+  // the pseudo-inverse depends only on the lights and the basis, so fixed
+  // domes can skip the solve, see pinvcache.c
+  // positional lights have a pseudo-inverse for each tile, made for the
+  // size of the inputs before each pass, see TileInverse()
+  if (positional &&
+      (robust || accumulate > 0))
+    {
+      printf ("Error: positional lights can't be used with -robust or "
+	      "-accumulate\n");
+      return -1;
+    }
 
-  std::vector<VImage> in;
-  for (int i = 0; i < Images_m; i++)
-    in.push_back(Samples_m[i].im);
+  // RGB fits go through compute_polys, see polykernel_rgb.c
+  if (rgb &&
+      (robust || accumulate > 0))
+    {
+      printf ("Error: -rgb can't be used with -robust or -accumulate\n");
+      return -1;
+    }
 
-  VImage::call("compute_polys", VImage::option()->
-	set( "in", in )->
-	set( "out", &coeffs )->
-	set( "M", vipsM ) );
+  if (!positional &&
+      Inverse () == -1)
+    return -1;
 
-  /* With cache enabled, write to a huge memory buffer.
-   */
-  if( cache ) 
-	  coeffs = coeffs.write(VImage::new_memory());
+  // the int16 cache scale comes from the pseudo-inverse, which doesn't
+  // bound a weighted per-pixel fit
+  if (robust &&
+      cache == CACHE_SHORT)
+    {
+      printf ("Error: -robust can't be used with -cache=short\n");
+      return -1;
+    }
 
-  ComputeScaleAndBias ();
+  // the robust kernel solves for each pixel from the basis itself
+  if (robust &&
+      BuildBasis () == -1)
+    return -1;
 
-  printf ("computation done!\n");
+  double lummin[BASIS_MAX_TERMS], lummax[BASIS_MAX_TERMS];
+
+  // fixed-point kernels are checked against the double kernel during the
+  // range pass
+  bool check = polykernel_get()->fixed && !robust && !rgb;
+  std::vector<double> error;
+
+  // the largest rounding error from -cache=short
+  std::vector<double> cache_error;
+
+  if( fast_quant && 
+	cache != CACHE_NONE )
+    printf ("-fast-quant has no effect with -cache or -stream\n");
+
+  if( cache == CACHE_NONE ) {
+	  // a reduction-only pass to find the range of each coefficient: no 
+	  // output image and no RGB average ... for -fast-quant, run it on a
+	  // 1/8 preview
+	  if( fast_quant &&
+		LoadFiles (8) == -1 )
+	    return -1;
+
+	  if( positional &&
+		TileInverse (fast_quant ? 8 : 1) == -1 )
+	    return -1;
+
+	  std::vector<VImage> in = Inputs ();
+
+	  std::vector<double> min, max;
+	  VOption *options = VImage::option()->
+		set( "in", in )->
+		set( "min", &min )->
+		set( "max", &max );
+
+	  if( positional )
+	    options->
+		set( "M", vipsT )->
+		set( "tile", tile_px );
+	  else
+	    options->
+		set( "M", vipsM );
+
+	  if( check )
+	    options->
+		set( "check", true )->
+		set( "error", &error );
+
+	  if( rgb )
+	    options->
+		set( "rgb", true );
+
+	  if( robust )
+	    options->
+		set( "B", vipsB )->
+		set( "shadow", robust_shadow )->
+		set( "highlight", robust_highlight )->
+		set( "rounds", robust_rounds );
+
+	  VImage::call("compute_polys_range", options );
+
+	  int m = FoldRange (&min[0], &max[0], min.size(), lummin, lummax);
+
+	  // shrinking averages away the extremes, so widen the preview 
+	  // range ... writeptm will clip anything still outside
+	  if( fast_quant ) 
+	    for (int i = 0; i < m; i++)
+	      {
+		double margin = FAST_QUANT_MARGIN * (lummax[i] - lummin[i]);
+
+		lummin[i] -= margin;
+		lummax[i] += margin;
+	      }
 
-  // if we're not caching, we'll need to scan again for write
-  if( !cache ) {
 	  // we open our files in streaming mode, so after the pass where we 
 	  // calculate scale/bias, we need to reopen for the ptm write and 
-	  // regen coeffs
-
+	  // gen coeffs
 	  LoadFiles ();
+  }
+
+  if( accumulate > 0 ) {
+	  /* Image-major: read a few inputs at a time into running sums. The
+	   * result is already in memory.
+	   */
+	  std::vector<VipsImage *> in;
+	  VipsImage *out;
+
+	  printf ("Accumulating %d images, %d at a time\n", 
+		Images_m, VIPS_MIN (accumulate, Images_m));
 
-	  std::vector<VImage> in2;
 	  for (int i = 0; i < Images_m; i++)
-	    in2.push_back(Samples_m[i].im);
+	    in.push_back(Samples_m[i].im.get_image());
+
+	  if( accumulate_polys( &in[0], Images_m, vipsM.get_image(), 
+		accumulate, &out ) ) {
+		  std::cerr << "Error accumulating coefficients\n";
+		  std::cerr << vips_error_buffer();
+		  return -1;
+	  }
+	  coeffs = VImage( out );
+  }
+  else {
+	  if( positional &&
+		TileInverse (1) == -1 )
+	    return -1;
+
+	  std::vector<VImage> in = Inputs ();
+	  VOption *options = VImage::option()->
+		set( "in", in )->
+		set( "out", &coeffs );
+
+	  if( positional )
+	    options->
+		set( "M", vipsT )->
+		set( "tile", tile_px );
+	  else
+	    options->
+		set( "M", vipsM );
+
+	  if( robust )
+	    options->
+		set( "B", vipsB )->
+		set( "shadow", robust_shadow )->
+		set( "highlight", robust_highlight )->
+		set( "rounds", robust_rounds );
+
+	  if( rgb )
+	    options->
+		set( "rgb", true );
+
+	  VImage::call("compute_polys", options );
+  }
+
+  if( cache == CACHE_SPILL ) {
+	  /* Spill to a temp file, picking up the range on the way. This is
+	   * the only time we decode the inputs.
+	   */
+	  VipsImage *spilled;
+	  std::vector<double> min (coeffs.bands ()), max (coeffs.bands ());
+	  int first = rgb ? 0 : 3;
+
+	  if( spill_coeffs( coeffs.get_image(), spill_dir, 
+		&spilled, &min[0], &max[0] ) ) {
+		  std::cerr << "Error spilling coefficients\n";
+		  std::cerr << vips_error_buffer();
+		  return -1;
+	  }
+	  coeffs = VImage( spilled );
+
+	  FoldRange (&min[first], &max[first], coeffs.bands () - first, 
+		lummin, lummax);
+  }
+  else if( cache == CACHE_MEMORY ) {
+	  /* With cache enabled, write to a huge memory buffer.
+	   */
+	  if( accumulate == 0 )
+	    coeffs = coeffs.write(VImage::new_memory());
 
-	  VImage::call("compute_polys", VImage::option()->
-		set( "in", in2 )->
-		set( "out", &coeffs )->
-		set( "M", vipsM ) );
+	  CoeffRange (lummin, lummax);
+  }
+  else if( cache == CACHE_SHORT ) {
+	  /* Half the memory: cache as int16 with a provisional scale for 
+	   * each band, then read back as float. The final scale and bias 
+	   * come from the cached values, so the rounding here is at most 
+	   * half a provisional step.
+	   */
+	  std::vector<double> pscale = ProvisionalScale ();
+	  std::vector<double> inverse, zero;
+
+	  for (size_t i = 0; i < pscale.size(); i++)
+	    {
+	      inverse.push_back(1.0 / pscale[i]);
+	      zero.push_back(0.0);
+	    }
+
+	  coeffs = coeffs.linear(inverse, zero).
+		round(VIPS_OPERATION_ROUND_RINT).
+		cast(VIPS_FORMAT_SHORT).
+		write(VImage::new_memory()).
+		linear(pscale, zero);
+
+	  int m = CoeffRange (lummin, lummax);
+
+	  // the channels of an RGB fit share a provisional scale
+	  for (int i = 0; i < m; i++)
+	    cache_error.push_back(pscale[pscale.size() - m + i] / 2.0);
   }
 
-  int coldim;
+  ComputeScaleAndBias (lummin, lummax);
 
-  if (basis_m == QUADRATIC_BIVARIATE)
-    coldim = 6;
-  else if (basis_m == QUADRATIC_UNIVARIATE)
-    coldim = 3;
-  else
-    coldim = 6;			// use QUADRATIC_BIVARIATE as default
+  if( check &&
+	cache != CACHE_NONE )
+    printf ("fixed-point error is only measured without -cache or -stream\n");
 
-  free_dmatrix (M, 1, Images_m, 1, coldim);
+  // report the fixed-point error as a fraction of a quantisation step of 
+  // the final 8-bit coefficients
+  for (size_t i = 0; i < error.size(); i++)
+    {
+      double steps = error[i] / scale[i];
+
+      printf ("coefficient %d: fixed-point error %g (%.3f of a step)\n",
+	(int) i, error[i], steps);
+      if( steps >= 1.0 )
+	printf ("warning: coefficient %d error is a full quantisation step, "
+	  "use a floating-point kernel\n", (int) i);
+    }
+
+  // and the -cache=short rounding, as a fraction of a step
+  for (size_t i = 0; i < cache_error.size(); i++)
+    printf ("coefficient %d: 16-bit cache error at most %g "
+	"(%.3f of a step)\n",
+	(int) i, cache_error[i], cache_error[i] / scale[i]);
+
+  printf ("computation done!\n");
 
   return stat;
 }
 
+// how often -watch looks for new frames, in microseconds
+#define WATCH_POLL (250000)
+
+// how long -watch keeps watching once it has every frame, in case the last
+// one is retaken, in microseconds
+#define WATCH_SETTLE (5000000)
+
+// a frame we are watching for
+struct WatchFrame
+{
+  // as of the last poll, or -1 if the file wasn't there
+  gint64 size;
+  gint64 mtime;
+
+  // unchanged for a whole poll, so it's completely written
+  bool stable;
+
+  // in the sums
+  bool added;
+};
+
+// the pseudo-inverse for the lp file, from the cache if we can
 int
-LinearSystem::BuildMatrix (double **&M)
+LinearSystem::Inverse ()
 {
-  int coldim;
-  int stat = 1;
+  if (CachedInverse () == -1)
+    {
+      double **M;
 
-  if (basis_m == QUADRATIC_BIVARIATE)
-    coldim = 6;
-  else if (basis_m == QUADRATIC_UNIVARIATE)
-    coldim = 3;
-  else
-    coldim = 6;			// use QUADRATIC_BIVARIATE as default
+      if (BuildMatrix (M) == -1 ||
+	  ComputePolynomials (M) == -1)
+	return -1;
 
-  if (Images_m < coldim)
+      free_dmatrix (M, 1, Images_m, 1, vipsM.height ());
+    }
+
+  return 1;
+}
+
+// fit the frames of lpfile as they appear in dir, adding each to running
+// sums as soon as it's complete; a frame that changes after we've added it
+// is a retake, and we rebuild the sums ... unless preview_fname is NULL, 
+// write a provisional PTM there whenever a file called "preview" appears in
+// dir, and every preview frames if that's > 0
+int
+LinearSystem::WatchPTM (char *lpfile, const char *dir, 
+	char *preview_fname, int preview)
+{
+  if (InitFiles (lpfile) == -1)
+    return -1;
+
+  if (positional || rgb)
     {
-      printf ("Error: Not enough samples for fitting a PTM\n");
-      if (coldim == 6)
-	printf ("A Bivariate PTM requires 6 or more images\n");
-      else if (coldim == 3)
-	printf ("A Univariate PTM requires 3 or more images\n");
-      stat = -1;
+      printf ("Error: positional lights and -rgb can't be used with "
+	      "-watch\n");
+      return -1;
     }
 
-  M = dmatrix (1, Images_m, 1, coldim);
+  image_dir = dir;
 
-  if (basis_m == QUADRATIC_BIVARIATE)
+  if (Inverse () == -1)
+    return -1;
+
+  std::vector<WatchFrame> frames (Images_m);
+  int group = accumulate > 0 ? accumulate : 8;
+  Accumulator *acc = NULL;
+  int n_added = 0;
+  int since_preview = 0;
+  int settled = 0;
+  char *trigger = g_build_filename (dir, "preview", NULL);
+
+  for (int i = 0; i < Images_m; i++)
     {
-      for (int k = 1; k <= Images_m; k++)
-	{
-	  M[k][1] = 1.0;
-	  M[k][2] = Samples_m[k - 1].y;
-	  M[k][3] = Samples_m[k - 1].x;
-	  M[k][4] = M[k][2] * M[k][3];
-	  M[k][5] = M[k][2] * M[k][2];
-	  M[k][6] = M[k][3] * M[k][3];
-	}
+      frames[i].size = -1;
+      frames[i].mtime = -1;
+      frames[i].stable = false;
+      frames[i].added = false;
     }
-  else if (basis_m == QUADRATIC_UNIVARIATE)
+
+  printf ("Watching %s for %d frames\n", dir, Images_m);
+  fflush (stdout);
+
+  while (settled < WATCH_SETTLE / WATCH_POLL)
     {
-      for (int k = 1; k <= Images_m; k++)
+      bool retake = false;
+
+      for (int i = 0; i < Images_m; i++)
 	{
-	  M[k][1] = 1.0;
-	  M[k][2] = Samples_m[k - 1].x;
-	  M[k][3] = M[k][2] * M[k][2];
+	  char *filename = ImageName (i);
+	  GStatBuf st;
+	  gint64 size = -1;
+	  gint64 mtime = -1;
+
+	  if (!g_stat (filename, &st))
+	    {
+	      size = st.st_size;
+	      mtime = st.st_mtime;
+	    }
+	  g_free (filename);
+
+	  if (size != frames[i].size || 
+	      mtime != frames[i].mtime)
+	    {
+	      if (frames[i].added)
+		{
+		  printf ("frame %d retaken\n", i + 1);
+		  retake = true;
+		}
+
+	      frames[i].size = size;
+	      frames[i].mtime = mtime;
+	      frames[i].stable = false;
+	      frames[i].added = false;
+	    }
+	  else if (size != -1)
+	    frames[i].stable = true;
 	}
+
+      // max lum can't be taken out of the sums, so start again
+      if (retake && 
+	  acc)
+	{
+	  accumulator_reset (acc);
+	  for (int i = 0; i < Images_m; i++)
+	    frames[i].added = false;
+	  n_added = 0;
+	}
+
+      std::vector<int> ready;
+
+      for (int i = 0; i < Images_m; i++)
+	if (frames[i].stable && 
+	    !frames[i].added)
+	  ready.push_back (i);
+
+      for (size_t k = 0; k < ready.size(); k += group)
+	{
+	  int end = VIPS_MIN (k + group, ready.size());
+	  std::vector<VImage> images;
+	  std::vector<VipsImage *> in;
+	  std::vector<int> column;
+
+	  for (size_t j = k; j < (size_t) end; j++)
+	    {
+	      char *filename = ImageName (ready[j]);
+
+	      try
+		{
+		  images.push_back (LoadImage (filename, 1));
+		  in.push_back (images.back ().get_image ());
+		  column.push_back (ready[j]);
+		}
+	      catch (vips::VError &e)
+		{
+		  // most likely still being written, try again next time
+		  vips_error_clear ();
+		}
+	      g_free (filename);
+	    }
+
+	  int n = column.size();
+
+	  if (n == 0)
+	    continue;
+
+	  if (!acc &&
+	      !(acc = accumulator_new (vipsM.get_image (), 
+		images[0].width (), images[0].height ())))
+	    {
+	      std::cerr << vips_error_buffer();
+	      g_free (trigger);
+	      return -1;
+	    }
+
+	  if (accumulator_add (acc, &in[0], &column[0], n))
+	    {
+	      std::cerr << "Error adding frames\n";
+	      std::cerr << vips_error_buffer();
+	      accumulator_free (acc);
+	      g_free (trigger);
+	      return -1;
+	    }
+
+	  for (int j = 0; j < n; j++)
+	    frames[column[j]].added = true;
+	  n_added += n;
+	  since_preview += n;
+
+	  printf ("added %d frames, %d of %d\n", n, n_added, Images_m);
+	  fflush (stdout);
+	}
+
+      if (n_added < Images_m &&
+	  acc &&
+	  preview_fname &&
+	  ((preview > 0 && since_preview >= preview) ||
+	   g_file_test (trigger, G_FILE_TEST_EXISTS)))
+	{
+	  double lummin[BASIS_MAX_TERMS], lummax[BASIS_MAX_TERMS];
+	  VipsImage *out;
+
+	  g_unlink (trigger);
+	  since_preview = 0;
+
+	  if (accumulator_preview (acc, &out) == 0)
+	    {
+	      coeffs = VImage (out);
+	      CoeffRange (lummin, lummax);
+	      ComputeScaleAndBias (lummin, lummax);
+
+	      printf ("writing preview from %d of %d frames to %s\n", 
+		n_added, Images_m, preview_fname);
+	      WriteFileVersion1_2 (preview_fname);
+	      fflush (stdout);
+	    }
+	}
+
+      // a retake puts n_added back, so we wait again
+      if (n_added < Images_m)
+	settled = 0;
+      else
+	{
+	  if (settled == 0)
+	    {
+	      printf ("all %d frames added, writing in %ds unless one is "
+		"retaken\n", Images_m, WATCH_SETTLE / 1000000);
+	      fflush (stdout);
+	    }
+	  settled += 1;
+	}
+
+      if (settled < WATCH_SETTLE / WATCH_POLL)
+	g_usleep (WATCH_POLL);
     }
-  else
+
+  g_free (trigger);
+
+  VipsImage *out;
+  double lummin[BASIS_MAX_TERMS], lummax[BASIS_MAX_TERMS];
+
+  accumulator_finish (acc, &out);
+  coeffs = VImage (out);
+  CoeffRange (lummin, lummax);
+  ComputeScaleAndBias (lummin, lummax);
+
+  printf ("computation done!\n");
+
+  return 1;
+}
+
+// the cache key for the pseudo-inverse: the basis and the normalised lights
+// in order, so a different subset of the dome makes a different key
+char *
+LinearSystem::InverseKey ()
+{
+  std::vector<double> lights (3 * Images_m);
+
+  for (int k = 0; k < Images_m; k++)
+    {
+      lights[3 * k] = Samples_m[k].x;
+      lights[3 * k + 1] = Samples_m[k].y;
+      lights[3 * k + 2] = Samples_m[k].z;
+    }
+
+  return pinv_cache_key (basis_m, Images_m, &lights[0]);
+}
+
+// try to set vipsM from the pseudo-inverse cache, -1 for a miss
+int
+LinearSystem::CachedInverse ()
+{
+  int coldim = basis_get (basis_m)->terms;
+
+  if (Images_m < coldim)
+    return -1;
+
+  char *key = InverseKey ();
+  std::vector<double> sv (coldim);
+  double cond;
+
+  vipsM = VImage::new_matrix(Images_m, coldim);
+  if (pinv_cache_get (key, coldim, Images_m, 
+	VIPS_MATRIX( vipsM.get_image(), 0, 0 ), &sv[0], &cond))
     {
-      printf ("Basis not implemented\n");
+      g_free (key);
+      return -1;
+    }
+  g_free (key);
+
+  printf ("using cached pseudo-inverse, condition number %g\n", cond);
+
+  return 0;
+}
+
+// the basis for each light, from the lp file's light directions, or from
+// lights, x, y, z for each image, if it's set
+int
+LinearSystem::BuildMatrix (double **&M, const double *lights)
+{
+  const Basis *basis = basis_get (basis_m);
+  int coldim = basis->terms;
+  int stat = 1;
+
+  if (Images_m < coldim)
+    {
+      printf ("Error: Not enough samples for fitting a PTM\n");
+      printf ("A %s fit requires %d or more images\n", 
+	      basis->name, coldim);
       stat = -1;
     }
 
+  M = dmatrix (1, Images_m, 1, coldim);
+
+  // one row of basis functions per light ... dmatrix rows are contiguous
+  for (int k = 1; k <= Images_m; k++)
+    if (lights)
+      basis->row (lights[3 * (k - 1)], lights[3 * (k - 1) + 1], 
+		  lights[3 * (k - 1) + 2], &M[k][1]);
+    else
+      basis->row (Samples_m[k - 1].x, Samples_m[k - 1].y, 
+		  Samples_m[k - 1].z, &M[k][1]);
+
   return stat;
 }
 
+// the basis as a matrix image, one row per light and one column per
+// coefficient, for the robust kernel ... the pseudo-inverse may have come
+// from the cache, so we can't rely on BuildMatrix() having run
 int
-LinearSystem::ComputePolynomials (double **M)
+LinearSystem::BuildBasis ()
 {
-  // R is the right hand side and hence is crucial
+  double **M;
 
-  // FILE *fp = fopen("Matrix","w");
-  // fclose(fp);
+  if (BuildMatrix (M) == -1)
+    return -1;
 
-  int i, j, k, l;
-  int coldim;
+  int coldim = vipsM.height ();
 
-  if (basis_m == QUADRATIC_BIVARIATE)
-    coldim = 6;
-  else if (basis_m == QUADRATIC_UNIVARIATE)
-    coldim = 3;
-  else
-    coldim = 6;			// use QUADRATIC_BIVARIATE as default
+  vipsB = VImage::new_matrix(coldim, Images_m);
+  for (int k = 0; k < Images_m; k++)
+    for (int j = 0; j < coldim; j++)
+      *VIPS_MATRIX( vipsB.get_image(), j, k ) = M[k + 1][j + 1];
 
-  double *Diag = dvector (1, Images_m);
-  double *R = dvector (1, Images_m);
-  double **V = dmatrix (1, Images_m, 1, Images_m);
+  free_dmatrix (M, 1, Images_m, 1, coldim);
 
-  svdcmp (M, Images_m, coldim, Diag, V);
+  return 1;
+}
+
+// svdcmp() is not reentrant
+static GMutex svd_lock;
+
+// the pseudo-inverse of M, rows x coldim, into pinv, coldim x rows and 
+// row-major, with the singular values in sv ... M is overwritten, and we 
+// return -1 if it's singular
+static int
+pseudo_inverse (double **M, int rows, int coldim, double *pinv, double *sv)
+{
+  double *Diag = dvector (1, coldim);
+  double **V = dmatrix (1, coldim, 1, coldim);
+  int i, j, k, l;
+
+  // svd.c keeps state in statics, so only one fit can use it at a time
+  g_mutex_lock (&svd_lock);
+  svdcmp (M, rows, coldim, Diag, V);
+  g_mutex_unlock (&svd_lock);
 
   for (k = 1; k <= coldim; k++)
     if (fabs (Diag[k]) <= 1.0e-10)
       {
-	printf ("System can not be solved, not enough info to "
-		"compute coefficients!\n");
-	printf ("Most likely cause: sample locations are redundant; "
-		"e.g. are colinear\n");
-	free_dvector (Diag, 1, Images_m);
-	free_dvector (R, 1, Images_m);
-	free_dmatrix (V, 1, Images_m, 1, Images_m);
-	free_dmatrix (M, 1, Images_m, 1, coldim);
+	free_dvector (Diag, 1, coldim);
+	free_dmatrix (V, 1, coldim, 1, coldim);
 
 	return -1;
       }
 
-  double **UT = MatrixStyleTranspose (M, Images_m, coldim);
+  double **UT = MatrixStyleTranspose (M, rows, coldim);
 
   for (k = 1; k <= coldim; k++)
-    for (l = 1; l <= Images_m; l++)
+    for (l = 1; l <= rows; l++)
       UT[k][l] = UT[k][l] / Diag[k];
 
   double **InverseMatrix =
-    MatrixStyleMult (V, coldim, coldim, UT, coldim, Images_m);
+    MatrixStyleMult (V, coldim, coldim, UT, coldim, rows);
+
+  for (j = 0; j < coldim; j++)
+    {
+      sv[j] = Diag[j + 1];
+      for (i = 0; i < rows; i++)
+	pinv[j * rows + i] = InverseMatrix[j + 1][i + 1];
+    }
+
+  free_dvector (Diag, 1, coldim);
+  free_dmatrix (V, 1, coldim, 1, coldim);
+  free_dmatrix (UT, 1, coldim, 1, rows);
+  free_dmatrix (InverseMatrix, 1, coldim, 1, rows);
+
+  return 0;
+}
+
+int
+LinearSystem::ComputePolynomials (double **M)
+{
+  // R is the right hand side and hence is crucial
+
+  // FILE *fp = fopen("Matrix","w");
+  // fclose(fp);
+
+  int k;
+  int coldim = basis_get (basis_m)->terms;
+
+  std::vector<double> sv (coldim);
 
   // make the matrix image
   vipsM = VImage::new_matrix(Images_m, coldim);
-  for (j = 0; j < coldim; j++)
-    for (i = 0; i < Images_m; i++)
-	*VIPS_MATRIX( vipsM.get_image(), i, j ) = InverseMatrix[j + 1][i + 1];
+  if (pseudo_inverse (M, Images_m, coldim, 
+	VIPS_MATRIX( vipsM.get_image(), 0, 0 ), &sv[0]) == -1)
+    {
+      printf ("System can not be solved, not enough info to "
+	      "compute coefficients!\n");
+      printf ("Most likely cause: sample locations are redundant; "
+	      "e.g. are colinear\n");
+      free_dmatrix (M, 1, Images_m, 1, coldim);
+
+      return -1;
+    }
+
+  // save for the next fit with these lights
+  double dmin = fabs (sv[0]);
+  double dmax = fabs (sv[0]);
+
+  for (k = 1; k < coldim; k++)
+    {
+      dmin = VIPS_MIN (dmin, fabs (sv[k]));
+      dmax = VIPS_MAX (dmax, fabs (sv[k]));
+    }
+  printf ("pseudo-inverse condition number %g\n", dmax / dmin);
 
-  free_dvector (Diag, 1, Images_m);
-  free_dvector (R, 1, Images_m);
-  free_dmatrix (V, 1, Images_m, 1, Images_m);
-  free_dmatrix (UT, 1, coldim, 1, Images_m);
-  free_dmatrix (InverseMatrix, 1, coldim, 1, Images_m);
+  char *key = InverseKey ();
+
+  if (pinv_cache_put (key, coldim, Images_m, 
+	VIPS_MATRIX( vipsM.get_image(), 0, 0 ), &sv[0], dmax / dmin))
+    {
+      printf ("warning: unable to save pseudo-inverse\n");
+      std::cerr << vips_error_buffer();
+      vips_error_clear();
+    }
+  g_free (key);
 
   return 1;
 }
 
-void
-LinearSystem::ComputeScaleAndBias ()
+// the object plane point at the centre of tile tx, ty of a width x height
+// image, cropped from the frame as set on the command line
+static void
+tile_centre (int tx, int ty, int tile, int width, int height,
+	     int crop[4], double plane_width, double plane_height, 
+	     double *px, double *py)
 {
-  // First compute the minimum and maximum of each coefficient for each channel
-  int i;
-  int basedim;
+  double cx = (tx * tile + VIPS_MIN (width, (tx + 1) * tile)) / 2.0;
+  double cy = (ty * tile + VIPS_MIN (height, (ty + 1) * tile)) / 2.0;
 
-  printf ("computing scale and bias ... \n");
+  // as a fraction of the whole frame
+  double u = (crop[0] + crop[2] * cx / width) / 1000.0;
+  double v = (crop[1] + crop[3] * cy / height) / 1000.0;
 
-  if (basis_m == QUADRATIC_BIVARIATE)
-    basedim = 6;
-  else if (basis_m == QUADRATIC_UNIVARIATE)
-    basedim = 3;
-  else
-    basedim = 6;
+  // x is to the right and y up, like the light directions
+  *px = (u - 0.5) * plane_width;
+  *py = (0.5 - v) * plane_height;
+}
+
+// set vipsT to the pseudo-inverse for each tile of the current inputs, a 
+// stack of them, one per tile in row order, for positional lights ... shrink
+// is how much the inputs have been shrunk, so tiles cover the same part of
+// the frame for the -fast-quant preview
+int
+LinearSystem::TileInverse (int shrink)
+{
+  int width = Samples_m[0].xsize;
+  int height = Samples_m[0].ysize;
+  int coldim = basis_get (basis_m)->terms;
+  int crop[4] = { crop_left_m, crop_top_m, crop_width_m, crop_height_m };
+
+  tile_px = VIPS_MAX (1, tile / shrink);
+
+  int across = VIPS_ROUND_UP (width, tile_px) / tile_px;
+  int down = VIPS_ROUND_UP (height, tile_px) / tile_px;
+  int m = coldim * across * down;
+
+  // the pseudo-inverses depend on the light positions, the plane, the crop
+  // and the tiling
+  double geometry[] = { 
+    plane_width, plane_height, 
+    (double) crop[0], (double) crop[1], (double) crop[2], (double) crop[3],
+    (double) width, (double) height, (double) tile_px 
+  };
+  char *lights_key = pinv_cache_key (basis_m, Images_m, &positions[0]);
+  char *key = pinv_cache_key_tiled (lights_key, 
+	VIPS_NUMBER (geometry), geometry);
+  g_free (lights_key);
+
+  std::vector<double> sv (m);
+  double cond;
+
+  vipsT = VImage::new_matrix(Images_m, m);
+  if (pinv_cache_get (key, m, Images_m, 
+	VIPS_MATRIX( vipsT.get_image(), 0, 0 ), &sv[0], &cond) == 0)
+    {
+      printf ("using cached pseudo-inverses for %d x %d tiles, "
+	      "worst condition number %g\n", across, down, cond);
+      g_free (key);
+
+      return 1;
+    }
+
+  std::vector<double> lights (3 * Images_m);
+
+  cond = 0;
+  for (int ty = 0; ty < down; ty++)
+    for (int tx = 0; tx < across; tx++)
+      {
+	int t = ty * across + tx;
+	double px, py;
+
+	tile_centre (tx, ty, tile_px, width, height, crop,
+		     plane_width, plane_height, &px, &py);
+
+	// the direction from the centre of the tile to each light
+	for (int k = 0; k < Images_m; k++)
+	  {
+	    double x = positions[3 * k] - px;
+	    double y = positions[3 * k + 1] - py;
+	    double z = positions[3 * k + 2];
+	    double mag = sqrt (x * x + y * y + z * z);
+
+	    if (mag > 0)
+	      mag = 1.0 / mag;
+	    lights[3 * k] = x * mag;
+	    lights[3 * k + 1] = y * mag;
+	    lights[3 * k + 2] = z * mag;
+	  }
+
+	double **M;
+
+	if (BuildMatrix (M, &lights[0]) == -1)
+	  {
+	    free_dmatrix (M, 1, Images_m, 1, coldim);
+	    g_free (key);
+	    return -1;
+	  }
+
+	if (pseudo_inverse (M, Images_m, coldim, 
+	      VIPS_MATRIX( vipsT.get_image(), 0, t * coldim ), 
+	      &sv[t * coldim]) == -1)
+	  {
+	    printf ("System can not be solved for tile %d, %d\n", tx, ty);
+	    free_dmatrix (M, 1, Images_m, 1, coldim);
+	    g_free (key);
+	    return -1;
+	  }
+
+	free_dmatrix (M, 1, Images_m, 1, coldim);
+
+	double *tsv = &sv[t * coldim];
+	double dmin = fabs (tsv[0]);
+	double dmax = fabs (tsv[0]);
+
+	for (int k = 1; k < coldim; k++)
+	  {
+	    dmin = VIPS_MIN (dmin, fabs (tsv[k]));
+	    dmax = VIPS_MAX (dmax, fabs (tsv[k]));
+	  }
+	cond = VIPS_MAX (cond, dmax / dmin);
+      }
+
+  printf ("pseudo-inverses for %d x %d tiles, worst condition number %g\n", 
+	  across, down, cond);
+
+  if (pinv_cache_put (key, m, Images_m, 
+	VIPS_MATRIX( vipsT.get_image(), 0, 0 ), &sv[0], cond))
+    {
+      printf ("warning: unable to save pseudo-inverses\n");
+      std::cerr << vips_error_buffer();
+      vips_error_clear();
+    }
+  g_free (key);
+
+  return 1;
+}
+
+// fold the range of each coefficient band into the range of each 
+// coefficient, and return the number of coefficients ... an RGB fit has 
+// m bands for each of R, G and B, and they share a scale and bias
+int
+LinearSystem::FoldRange (const double *min, const double *max, int bands,
+			 double *lummin, double *lummax)
+{
+  int m = rgb ? bands / 3 : bands;
+
+  for (int i = 0; i < m; i++)
+    {
+      lummin[i] = min[i];
+      lummax[i] = max[i];
+    }
+
+  for (int i = m; i < bands; i++)
+    {
+      lummin[i % m] = VIPS_MIN (lummin[i % m], min[i]);
+      lummax[i % m] = VIPS_MAX (lummax[i % m], max[i]);
+    }
+
+  return m;
+}
+
+// find the min and max of each polynomial coefficient of the coefficient 
+// image, and return the number of coefficients
+int
+LinearSystem::CoeffRange (double *lummin, double *lummax)
+{
+  int i;
 
   VImage stats = coeffs.stats ();
 
@@ -402,17 +1281,65 @@ LinearSystem::ComputeScaleAndBias ()
   std::cout << stats;
 #endif /*DEBUG*/
 
-  // the first three channels are RGB, the subsequent 3 or 6 are the poly
-  // coeffs
+  // for LRGB, the first three channels are RGB, the subsequent 3 or 6 are 
+  // the poly coeffs ... for RGB, it's the poly coeffs for each channel
 
-  double lummin[6], lummax[6];
+  int first = rgb ? 0 : 3;
+  std::vector<double> min, max;
 
-  for (i = 0; i < basedim; i++)
+  for (i = first; i < coeffs.bands (); i++)
     {
-      lummin[i] = *VIPS_MATRIX( stats.get_image(), 0, i + 4);
-      lummax[i] = *VIPS_MATRIX( stats.get_image(), 1, i + 4);
+      min.push_back(*VIPS_MATRIX( stats.get_image(), 0, i + 1));
+      max.push_back(*VIPS_MATRIX( stats.get_image(), 1, i + 1));
     }
 
+  return FoldRange (&min[0], &max[0], min.size(), lummin, lummax);
+}
+
+// the provisional scale for each band of the int16 cache: the largest 
+// possible value of that band maps to 32767 ... RGB is 0 - 255, and the
+// luminance for each image is normalised to 0 - 1, so coefficient j can be
+// at most 255 * sum_i(|M[j][i]|) ... an RGB fit has no average colour, and
+// each channel is 0 - 255, so has the same bound ... with positional 
+// lights, take the largest over the tiles
+std::vector<double>
+LinearSystem::ProvisionalScale ()
+{
+  VImage M = positional ? vipsT : vipsM;
+  int m = basis_get (basis_m)->terms;
+  std::vector<double> bound (m, 0.0);
+  std::vector<double> pscale;
+
+  for (int j = 0; j < M.height(); j++)
+    {
+      double sum = 0.0;
+
+      for (int i = 0; i < M.width(); i++)
+	sum += fabs (*VIPS_MATRIX( M.get_image(), i, j ));
+
+      bound[j % m] = VIPS_MAX (bound[j % m], sum);
+    }
+
+  if (!rgb)
+    for (int j = 0; j < 3; j++)
+      pscale.push_back(255.0 / 32767.0);
+
+  for (int c = 0; c < (rgb ? 3 : 1); c++)
+    for (int j = 0; j < m; j++)
+      pscale.push_back(bound[j] > 0.0 ? 255.0 * bound[j] / 32767.0 : 1.0);
+
+  return pscale;
+}
+
+void
+LinearSystem::ComputeScaleAndBias (double *lummin, double *lummax)
+{
+  // scale and bias come from the minimum and maximum of each coefficient
+  int i;
+  int basedim = basis_get (basis_m)->terms;
+
+  printf ("computing scale and bias ... \n");
+
 #ifdef DEBUG
   printf( "min: " );
   for( i = 0; i < basedim; i++ )
@@ -425,7 +1352,7 @@ LinearSystem::ComputeScaleAndBias ()
   printf( "\n" );
 #endif /*DEBUG*/
 
-  int lumscale[6];
+  int lumscale[BASIS_MAX_TERMS];
 
   for (i = 0; i < basedim; i++)
     {
@@ -440,6 +1367,7 @@ LinearSystem::ComputeScaleAndBias ()
 
   for (i = 0; i < basedim; i++)
     {
+      bias[i] = 0;
       if (lummin[i] < 0)
 	bias[i] = (int) (0.0 - lummin[i] / scale[i] + 1);
 
@@ -463,13 +1391,118 @@ LinearSystem::ComputeScaleAndBias ()
 #endif /*DEBUG*/
 }
 
-void
+int
 LinearSystem::WriteFileVersion1_2 (char *fname)
 {
-	if( writeptm( coeffs.get_image (), fname, scale, bias ) )
+	WritePtmInfo info;
+
+	if( jpeg_quality > 0 )
+	{
+		// JPEG PTMs are only ever appended to, and quantise from
+		// coeffs in one pass, so they don't need the flip
+		int fd = output_fd;
+
+		if( fd == -1 &&
+			(fd = open( fname, O_WRONLY | O_CREAT | O_TRUNC, 0666 )) 
+				== -1 )
+		{
+			std::cerr << "Unable to open " << fname << "\n"; 
+			return -1;
+		}
+
+		int result = writeptm_jpeg( coeffs.get_image (), fd, 
+			basis_get (basis_m), scale, bias, jpeg_quality, &info );
+
+		if( fd != output_fd )
+			close( fd );
+
+		if( result )
+		{
+			std::cerr << "Error writing file\n"; 
+			std::cerr << vips_error_buffer();
+			return -1;
+		}
+	}
+	else if( sequential )
+	{
+		// PTMs are bottom row first, so flip and we can write in 
+		// order ... coeffs is cached, or computed from the stack 
+		// cache, so this is cheap
+		VImage flipped = coeffs.flip( VIPS_DIRECTION_VERTICAL );
+		int fd = output_fd;
+
+		if( fd == -1 &&
+			(fd = open( fname, O_WRONLY | O_CREAT | O_TRUNC, 0666 )) 
+				== -1 )
+		{
+			std::cerr << "Unable to open " << fname << "\n"; 
+			return -1;
+		}
+
+		int result = writeptm_sequential( flipped.get_image (), fd, 
+			basis_get (basis_m), scale, bias, &info );
+
+		if( fd != output_fd )
+			close( fd );
+
+		if( result )
+		{
+			std::cerr << "Error writing file\n"; 
+			std::cerr << vips_error_buffer();
+			return -1;
+		}
+	}
+	else if( writeptm( coeffs.get_image (), fname, basis_get (basis_m), 
+		scale, bias, &info ) )
 	{
 		std::cerr << "Error writing file\n"; 
+		return -1;
+	}
+
+	if( info.clipped > 0 ) 
+		printf ("%lu coefficients clipped to scale and bias range\n",
+			(unsigned long) info.clipped);
+
+	printf ("wrote %lu bytes of pixels in %lu writes and %lu seeks\n",
+		(unsigned long) info.bytes, 
+		(unsigned long) info.writes, 
+		(unsigned long) info.seeks);
+
+	if( jpeg_quality > 0 &&
+		info.bytes > 0 )
+		printf ("JPEG planes at Q %d: %lu bytes raw, %.1f:1, "
+			"encoded at %.1f MB/s\n",
+			jpeg_quality,
+			(unsigned long) info.raw_bytes,
+			(double) info.raw_bytes / info.bytes,
+			info.raw_bytes / 
+				(VIPS_MAX (info.encode_seconds, 1e-6) * 1e6));
+
+	return 0;
+}
+
+int
+LinearSystem::WritePyramid (const char *dirname, const char *suffix, 
+	int tile_size)
+{
+	WritePyramidInfo info;
+
+	if( writepyramid( coeffs.get_image (), dirname, basis_get (basis_m), 
+		scale, bias, suffix, tile_size, &info ) )
+	{
+		std::cerr << "Error writing pyramid\n"; 
+		std::cerr << vips_error_buffer();
+		return -1;
 	}
+
+	if( info.clipped > 0 ) 
+		printf ("%lu pyramid coefficients clipped to scale and bias "
+			"range\n", (unsigned long) info.clipped);
+
+	printf ("wrote %d levels, %lu tiles, to %s\n",
+		info.levels, (unsigned long) info.tiles, dirname);
+
+	return 0;
 }
 
 LinearSystem::~LinearSystem ()
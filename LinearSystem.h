@@ -5,28 +5,98 @@
 #ifndef LINEARSYSTEM_H
 #define LINEARSYSTEM_H
 
+#include <vector>
+
 #include "RGBImage.h"
+#include "basis.h"
 
-enum Basis_e {QUADRATIC_BIVARIATE, QUADRATIC_UNIVARIATE};
+// where computed coefficients are kept between the scale/bias pass and the
+// write: nowhere (so we decode and fit twice), in memory as float or as
+// int16 with a provisional scale, or spilled to a temp file
+enum Cache_e {CACHE_NONE, CACHE_MEMORY, CACHE_SHORT, CACHE_SPILL};
 
 #define STRSIZE 256
 
 class LinearSystem
 {
 	public:
-		LinearSystem(Basis_e b, bool c = false, 
+		LinearSystem(Basis_e b, Cache_e c = CACHE_NONE, 
 				int crop_left = 0, int crop_top = 0, 
 				int crop_width = 1000, int crop_height = 1000);
 		int FitPTM(char *lpfile);
+		int WatchPTM(char *lpfile, const char *dir, 
+				char *preview_fname, int preview);
 		virtual ~LinearSystem();
-		void WriteFileVersion1_2(char *filename);
+		int WriteFileVersion1_2(char *filename);
+
+		// write the coefficients as tile pyramids, see writepyramid.c
+		int WritePyramid(const char *dirname, const char *suffix, 
+				int tile_size);
+
+		// estimate scale and bias from a 1/8 preview of the inputs
+		void SetFastQuant(bool f) { fast_quant = f; }
+
+		// decode the inputs once to a pixel-major stack file and fit 
+		// from that
+		void SetStackCache(bool s) { stack_cache = s; }
+
+		// spill coefficients to this directory, NULL for $TMPDIR
+		void SetSpillDir(const char *d) { spill_dir = d; }
+
+		// fit group images at a time with accumulate_polys(), 0 to 
+		// fit all at once with compute_polys
+		void SetAccumulate(int group) { accumulate = group; }
+
+		// fit each pixel with its own weights, see 
+		// polykernel_robust.c: ignore lights outside shadow to 
+		// highlight, then reweight rounds times
+		void SetRobust(double shadow, double highlight, int rounds)
+			{ robust = true; robust_shadow = shadow; 
+			  robust_highlight = highlight; robust_rounds = rounds; }
+
+		// with positional lights, fit with a pseudo-inverse for each
+		// tile this many pixels across
+		void SetTile(int t) { tile = t; }
+
+		// write PTM_FORMAT_RGB, a polynomial for each channel, rather
+		// than PTM_FORMAT_LRGB
+		void SetRGB(bool r) { rgb = r; }
+
+		// write PTM_FORMAT_JPEG_LRGB or _RGB at this quality, 0 for a 
+		// raw PTM
+		void SetJPEG(int q) { jpeg_quality = q; }
+
+		// load input images from this directory, NULL for the current
+		// directory
+		void SetImageDir(const char *d) { image_dir = d; }
+
+		// write the PTM strictly by appending, to fd if it's not -1
+		void SetSequential(bool s, int fd = -1) 
+			{ sequential = s; output_fd = fd; }
+
+		// count images as they load ... turn it off when several 
+		// fits share the terminal
+		void SetProgress(bool p) { progress = p; }
 
 	private:
 		int InitFiles(char *lpfile);
-		int LoadFiles();
-		int BuildMatrix(double **  &M);
+		int LoadFiles(int shrink = 1);
+		int LoadStack(int shrink);
+		char *ImageName(int i);
+		std::vector<vips::VImage> Inputs();
+		vips::VImage LoadImage(const char *filename, int shrink);
+		int Inverse();
+		char *InverseKey();
+		int CachedInverse();
+		int BuildMatrix(double **  &M, const double *lights = NULL);
+		int BuildBasis();
 		int ComputePolynomials(double **M);
-		void ComputeScaleAndBias();
+		int TileInverse(int shrink);
+		int FoldRange(const double *min, const double *max, int bands,
+			double *lummin, double *lummax);
+		int CoeffRange(double *lummin, double *lummax);
+		std::vector<double> ProvisionalScale();
+		void ComputeScaleAndBias(double *lummin, double *lummax);
 		void ComputeQuantizedRGBPolynomials();
 		void ComputeQuantizedLumPolynomials();
 
@@ -36,8 +106,40 @@ class LinearSystem
 		// should be in 3D though.
 		Basis_e basis_m;
 
-		// keep a mem cache
-		bool cache;
+		// where the images named in the lp file are
+		const char *image_dir;
+
+		// keep a mem cache, or spill to disc
+		Cache_e cache;
+		const char *spill_dir;
+
+		// the accumulate_polys() group size, or 0
+		int accumulate;
+
+		// a robust fit, and its settings
+		bool robust;
+		double robust_shadow;
+		double robust_highlight;
+		int robust_rounds;
+
+		// estimate scale and bias from a preview, then fit just once
+		bool fast_quant;
+
+		// load from a stack cache file, see stackcache.c ... the whole
+		// file, and the shrunk and cropped stack we fit from
+		bool stack_cache;
+		vips::VImage stack_full;
+		vips::VImage stack;
+
+		// write the PTM in file order, see writeptm_sequential()
+		bool sequential;
+		int output_fd;
+
+		// the JPEG quality for a JPEG PTM, see writeptm_jpeg()
+		int jpeg_quality;
+
+		// a running count as images load
+		bool progress;
 
 		// only work on this part of the input images
 		// crop expressed as 10 x percent
@@ -49,11 +151,30 @@ class LinearSystem
 		// inverse matrix, as passed to compute_polys()
 		vips::VImage vipsM;
 
+		// the basis, one row per light, for a robust fit
+		vips::VImage vipsB;
+
+		// positional lights: the lp file gives light positions over 
+		// an object plane at z = 0, plane_width by plane_height and 
+		// centred on the origin, rather than directions ... we fit 
+		// with a pseudo-inverse for each tile, stacked in vipsT, 
+		// tile_px pixels across in the current inputs
+		bool positional;
+		double plane_width;
+		double plane_height;
+		std::vector<double> positions;
+		int tile;
+		int tile_px;
+		vips::VImage vipsT;
+
+		// fit each channel, for PTM_FORMAT_RGB
+		bool rgb;
+
 		// huge array of computed coefficients
 		vips::VImage coeffs;
 
-		double scale[6];
-		int bias[6];
+		double scale[BASIS_MAX_TERMS];
+		int bias[BASIS_MAX_TERMS];
 
 		RGB_Image *qredhigh ;
 		RGB_Image *qredlow;
@@ -0,0 +1,323 @@
+/* fit polynomials one group of images at a time
+ *
+ * compute_polys needs a region from all N inputs at once, so every worker 
+ * holds N decoders and N region buffers, and memory grows with the light 
+ * count. But the fit is a sum over the images:
+ *
+ *	coeff[j] = 255 * sum_i( lum_i * M[j][i] ) / max_i( lum_i )
+ *	rgb[c] = max_i( lum_i ) * sum_i( p_i[c] * lum_i ) / sum_i( lum_i^2 )
+ *
+ * so we can read the images in groups of a few at a time, add each group 
+ * into per-pixel running sums, and finish every pixel at the end. Only one
+ * group's decoders are ever open, and vips shuts them down when the sink 
+ * for each group ends.
+ *
+ * An Accumulator holds the sums: an image of 3 + m floats a pixel, the 3 
+ * colour sums then the m coefficient sums, plus a side buffer of sum( lum^2 )
+ * and max( lum ), so memory is about -cache plus 8 bytes a pixel, whatever 
+ * the number of lights. Images can be added in any order, since each brings
+ * the index of its column of the pseudo-inverse, and at any time the sums 
+ * so far can be finished into a preview. max( lum ) can't be subtracted, so
+ * to replace an image you must reset and add them all again.
+ *
+ * accumulator_finish() turns the sums into coefficients in place, 3 + m float
+ * bands exactly as compute_polys makes. Sums are float, so results match the
+ * float SIMD kernels rather than the double scalar kernel.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+#include "accumulate.h"
+
+struct _Accumulator {
+	/* The PolyMatrix is allocated on this.
+	 */
+	VipsImage *context;
+	PolyMatrix M;
+
+	/* The running sums, and the side buffer of sum( lum^2 ) and 
+	 * max( lum ) pairs.
+	 */
+	VipsImage *sums;
+	float *side;
+
+	/* The group we are adding, bandjoined, and the pseudo-inverse column
+	 * for each image in it.
+	 */
+	int *column;
+	int n_group;
+};
+
+/* Add the group to the sums for an area. Threads get disjoint areas, so 
+ * there's no locking.
+ */
+static int
+accumulator_scan( VipsRegion *region, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	Accumulator *acc = (Accumulator *) a;
+	VipsRect *r = &region->valid;
+	int m = acc->M.m;
+	int bands = 3 + m;
+
+	int x, y, i, j;
+
+	for( y = 0; y < r->height; y++ ) {
+		VipsPel * restrict p = 
+			VIPS_REGION_ADDR( region, r->left, r->top + y );
+		float * restrict q = (float *) 
+			VIPS_IMAGE_ADDR( acc->sums, r->left, r->top + y );
+		float * restrict side = acc->side + 
+			2 * ((size_t) (r->top + y) * acc->sums->Xsize + r->left);
+
+		for( x = 0; x < r->width; x++ ) {
+			for( i = 0; i < acc->n_group; i++ ) {
+				const float * restrict coeff = 
+					acc->M.coeffT + acc->column[i] * m;
+				float lum = 0.2125 * p[0] + 
+					0.7154 * p[1] + 
+					0.0721 * p[2];
+
+				for( j = 0; j < 3; j++ )
+					q[j] += p[j] * lum;
+				for( j = 0; j < m; j++ )
+					q[3 + j] += lum * coeff[j];
+				side[0] += lum * lum;
+				side[1] = VIPS_MAX( side[1], lum );
+
+				p += 3;
+			}
+
+			q += bands;
+			side += 2;
+		}
+	}
+
+	return( 0 );
+}
+
+/* Finish the sums into coefficients in @out, which can be the sums image.
+ */
+static void
+accumulator_finish_to( Accumulator *acc, VipsImage *out )
+{
+	int m = acc->M.m;
+	int bands = 3 + m;
+	size_t n_pels = (size_t) out->Xsize * out->Ysize;
+	float * restrict p = (float *) acc->sums->data;
+	float * restrict q = (float *) out->data;
+	float * restrict side = acc->side;
+
+	size_t k;
+	int j;
+
+	for( k = 0; k < n_pels; k++ ) {
+		float ss = side[0];
+		float maxl = side[1];
+		float f = ss > 0 ? maxl / ss : 0;
+		float scale = maxl > 0 ? 255.0f / maxl : 0;
+
+		for( j = 0; j < 3; j++ )
+			q[j] = VIPS_CLIP( 0, p[j] * f, 255 );
+		for( j = 0; j < m; j++ )
+			q[3 + j] = p[3 + j] * scale;
+
+		p += bands;
+		q += bands;
+		side += 2;
+	}
+}
+
+static VipsImage *
+accumulator_image( Accumulator *acc, int width, int height )
+{
+	VipsImage *image;
+
+	image = vips_image_new_memory();
+	vips_image_init_fields( image, width, height, 
+		3 + acc->M.m, VIPS_FORMAT_FLOAT, VIPS_CODING_NONE, 
+		VIPS_INTERPRETATION_MULTIBAND, 1.0, 1.0 );
+	if( vips_image_write_prepare( image ) ) {
+		g_object_unref( image );
+		return( NULL );
+	}
+
+	return( image );
+}
+
+void
+accumulator_free( Accumulator *acc )
+{
+	VIPS_FREEF( vips_tracked_free, acc->side );
+	VIPS_UNREF( acc->sums );
+	VIPS_UNREF( acc->context );
+	g_free( acc );
+}
+
+/* Zero the sums.
+ */
+void
+accumulator_reset( Accumulator *acc )
+{
+	memset( acc->sums->data, 0, 
+		VIPS_IMAGE_SIZEOF_IMAGE( acc->sums ) );
+	memset( acc->side, 0, 
+		2 * sizeof( float ) * 
+		(size_t) acc->sums->Xsize * acc->sums->Ysize );
+}
+
+/* Make an accumulator for images of @width x @height, fitting with the 
+ * pseudo-inverse @matrix.
+ */
+Accumulator *
+accumulator_new( VipsImage *matrix, int width, int height )
+{
+	Accumulator *acc;
+
+	acc = g_new0( Accumulator, 1 );
+	acc->context = vips_image_new();
+	if( polymatrix_init( &acc->M, VIPS_OBJECT( acc->context ), matrix ) ||
+		!(acc->sums = accumulator_image( acc, width, height )) ||
+		!(acc->side = (float *) vips_tracked_malloc( 
+			2 * sizeof( float ) * (size_t) width * height )) ) {
+		accumulator_free( acc );
+		return( NULL );
+	}
+
+	accumulator_reset( acc );
+
+	return( acc );
+}
+
+/* Add @n images to the sums, all at once. @column gives the column of the 
+ * pseudo-inverse for each.
+ */
+int
+accumulator_add( Accumulator *acc, VipsImage **in, int *column, int n )
+{
+	VipsImage *joined;
+	int i;
+
+	for( i = 0; i < n; i++ ) 
+		if( vips_check_uncoded( "accumulator_add", in[i] ) ||
+			vips_check_bands( "accumulator_add", in[i], 3 ) ||
+			vips_check_format( "accumulator_add", in[i], 
+				VIPS_FORMAT_UCHAR ) ||
+			vips_check_size_same( "accumulator_add", 
+				acc->sums, in[i] ) ) 
+			return( -1 );
+
+	for( i = 0; i < n; i++ ) 
+		if( column[i] < 0 ||
+			column[i] >= acc->M.n ) {
+			vips_error( "accumulator_add", 
+				"%s", _( "column out of range" ) );
+			return( -1 );
+		}
+
+#ifdef DEBUG
+	printf( "accumulator_add: %d images from column %d\n", n, column[0] );
+#endif /*DEBUG*/
+
+	if( vips_bandjoin( in, &joined, n, NULL ) )
+		return( -1 );
+
+	acc->column = column;
+	acc->n_group = n;
+	if( vips_sink( joined, 
+		NULL, accumulator_scan, NULL, acc, NULL ) ) {
+		g_object_unref( joined );
+		return( -1 );
+	}
+
+	/* Close the decoders.
+	 */
+	g_object_unref( joined );
+	for( i = 0; i < n; i++ )
+		vips_image_minimise_all( in[i] );
+
+	return( 0 );
+}
+
+/* Finish the sums so far into a new image, leaving the sums as they are.
+ */
+int
+accumulator_preview( Accumulator *acc, VipsImage **out )
+{
+	if( !(*out = accumulator_image( acc, 
+		acc->sums->Xsize, acc->sums->Ysize )) )
+		return( -1 );
+
+	accumulator_finish_to( acc, *out );
+
+	return( 0 );
+}
+
+/* Finish the sums in place and return them, freeing the accumulator.
+ */
+int
+accumulator_finish( Accumulator *acc, VipsImage **out )
+{
+	accumulator_finish_to( acc, acc->sums );
+
+	*out = acc->sums;
+	acc->sums = NULL;
+	accumulator_free( acc );
+
+	return( 0 );
+}
+
+/* Fit @n images with the pseudo-inverse @matrix, reading at most @group of
+ * them at once. @out is a memory image with the RGB average, then the
+ * coefficients, as compute_polys makes.
+ */
+int
+accumulate_polys( VipsImage **in, int n, VipsImage *matrix, int group,
+	VipsImage **out )
+{
+	Accumulator *acc;
+	int *column;
+	int i;
+
+	if( n < 1 ) {
+		vips_error( "accumulate_polys", "%s", _( "zero input images!" ) );
+		return( -1 );
+	}
+	if( n != matrix->Xsize ) {
+		vips_error( "accumulate_polys", "%s", _( "M width != n images" ) );
+		return( -1 );
+	}
+
+	if( !(acc = accumulator_new( matrix, in[0]->Xsize, in[0]->Ysize )) )
+		return( -1 );
+
+	column = g_new( int, n );
+	for( i = 0; i < n; i++ )
+		column[i] = i;
+
+	group = VIPS_CLIP( 1, group, n );
+	for( i = 0; i < n; i += group ) 
+		if( accumulator_add( acc, in + i, column + i, 
+			VIPS_MIN( group, n - i ) ) ) {
+			g_free( column );
+			accumulator_free( acc );
+			return( -1 );
+		}
+
+	g_free( column );
+
+	return( accumulator_finish( acc, out ) );
+}
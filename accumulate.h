@@ -0,0 +1,30 @@
+#ifndef ACCUMULATE_H
+#define ACCUMULATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+typedef struct _Accumulator Accumulator;
+
+Accumulator *accumulator_new( VipsImage *matrix, int width, int height );
+void accumulator_free( Accumulator *acc );
+void accumulator_reset( Accumulator *acc );
+int accumulator_add( Accumulator *acc, VipsImage **in, int *column, int n );
+int accumulator_preview( Accumulator *acc, VipsImage **out );
+int accumulator_finish( Accumulator *acc, VipsImage **out );
+
+int accumulate_polys( VipsImage **in, int n, VipsImage *matrix, int group, 
+	VipsImage **out );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*ACCUMULATE_H*/
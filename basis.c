@@ -0,0 +1,223 @@
+/* the bases we can fit luminance or colour with
+ *
+ * A basis is a set of functions of the light direction. Each light makes a
+ * row of the design matrix, LinearSystem takes its pseudo-inverse, and
+ * compute_polys multiplies each pixel through that, so whatever the basis,
+ * a fit is a single GEMV per pixel and runs with the same kernels. Only the
+ * number of terms changes.
+ *
+ * The polynomials are in the light's x and y, lowest order first, each
+ * order starting with the highest power of y. The quadratics keep the
+ * order they've always had, so cached pseudo-inverses still match. They
+ * can be written as standard PTMs, see writeptm.c, the others are written
+ * in the same layout with their own format name.
+ *
+ * The hemispherical harmonics (Gautron et al., 2004) are an orthonormal
+ * basis over the upper hemisphere, so they fit broad specular lobes better
+ * than a polynomial of the same size. Order n has n * n terms.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "basis.h"
+
+static void
+basis_univariate( double x, double y, double z, double *row )
+{
+	row[0] = 1.0;
+	row[1] = x;
+	row[2] = x * x;
+}
+
+static void
+basis_bivariate( double x, double y, double z, double *row )
+{
+	row[0] = 1.0;
+	row[1] = y;
+	row[2] = x;
+	row[3] = x * y;
+	row[4] = y * y;
+	row[5] = x * x;
+}
+
+static void
+basis_cubic( double x, double y, double z, double *row )
+{
+	basis_bivariate( x, y, z, row );
+	row[6] = x * y * y;
+	row[7] = x * x * y;
+	row[8] = y * y * y;
+	row[9] = x * x * x;
+}
+
+static void
+basis_quartic( double x, double y, double z, double *row )
+{
+	basis_cubic( x, y, z, row );
+	row[10] = x * y * y * y;
+	row[11] = x * x * y * y;
+	row[12] = x * x * x * y;
+	row[13] = y * y * y * y;
+	row[14] = x * x * x * x;
+}
+
+/* HSH up to order 3, ie. 9 terms. Lights below the horizon are clipped to
+ * it.
+ */
+static void
+basis_hsh_n( double x, double y, double z, double *row, int terms )
+{
+	double ct = VIPS_CLIP( 0.0, z, 1.0 );
+	double phi = atan2( y, x );
+	double st = sqrt( ct - ct * ct );
+
+	row[0] = 1.0 / sqrt( 2.0 * M_PI );
+	row[1] = sqrt( 6.0 / M_PI ) * cos( phi ) * st;
+	row[2] = sqrt( 3.0 / (2.0 * M_PI) ) * (2.0 * ct - 1.0);
+	row[3] = sqrt( 6.0 / M_PI ) * sin( phi ) * st;
+	if( terms == 4 )
+		return;
+
+	row[4] = sqrt( 30.0 / M_PI ) * cos( 2.0 * phi ) * (ct * ct - ct);
+	row[5] = sqrt( 30.0 / M_PI ) * cos( phi ) * (2.0 * ct - 1.0) * st;
+	row[6] = sqrt( 5.0 / (2.0 * M_PI) ) *
+		(6.0 * ct * ct - 6.0 * ct + 1.0);
+	row[7] = sqrt( 30.0 / M_PI ) * sin( phi ) * (2.0 * ct - 1.0) * st;
+	row[8] = sqrt( 30.0 / M_PI ) * sin( 2.0 * phi ) * (ct * ct - ct);
+}
+
+static void
+basis_hsh2( double x, double y, double z, double *row )
+{
+	basis_hsh_n( x, y, z, row, 4 );
+}
+
+static void
+basis_hsh3( double x, double y, double z, double *row )
+{
+	basis_hsh_n( x, y, z, row, 9 );
+}
+
+/* PTM coefficients are a0 u^2 + a1 v^2 + a2 uv + a3 u + a4 v + a5.
+ */
+static const int basis_bivariate_ptm[6] = { 5, 4, 3, 2, 1, 0 };
+static const int basis_univariate_ptm[6] = { 2, -1, -1, 1, -1, 0 };
+
+/* All the bases we have, in Basis_e order.
+ */
+static const Basis basis_registry[] = {
+	{ QUADRATIC_BIVARIATE, "bivariate",
+		"quadratic in x and y, a standard PTM",
+		6, basis_bivariate, basis_bivariate_ptm },
+	{ QUADRATIC_UNIVARIATE, "univariate",
+		"quadratic in x only",
+		3, basis_univariate, basis_univariate_ptm },
+	{ CUBIC_BIVARIATE, "cubic",
+		"cubic in x and y",
+		10, basis_cubic, NULL },
+	{ QUARTIC_BIVARIATE, "quartic",
+		"quartic in x and y",
+		15, basis_quartic, NULL },
+	{ HSH_2, "hsh2",
+		"hemispherical harmonics of order 2",
+		4, basis_hsh2, NULL },
+	{ HSH_3, "hsh3",
+		"hemispherical harmonics of order 3",
+		9, basis_hsh3, NULL }
+};
+
+const Basis *
+basis_get( Basis_e basis )
+{
+	g_assert( basis >= 0 &&
+		basis < VIPS_NUMBER( basis_registry ) );
+	g_assert( basis_registry[basis].basis == basis );
+
+	return( &basis_registry[basis] );
+}
+
+/* The coefficients we write for each pixel: set slot[i] to the term that
+ * goes in position i, -1 for zero, and return how many there are. That's
+ * a0 - a5 for a basis that makes a standard PTM, or all the terms in order.
+ */
+int
+basis_slots( const Basis *basis, int *slot )
+{
+	int i;
+
+	if( basis->ptm ) {
+		for( i = 0; i < 6; i++ )
+			slot[i] = basis->ptm[i];
+
+		return( 6 );
+	}
+
+	for( i = 0; i < basis->terms; i++ )
+		slot[i] = i;
+
+	return( basis->terms );
+}
+
+/* The PTM format name for a fit with one (LRGB) or three (RGB) channels of
+ * coefficients, eg. PTM_FORMAT_LRGB or PTM_FORMAT_HSH3_RGB. Free with 
+ * g_free().
+ */
+char *
+basis_format( const Basis *basis, int channels )
+{
+	const char *type = channels == 1 ? "LRGB" : "RGB";
+
+	char *name;
+	char *format;
+
+	if( basis->ptm )
+		return( g_strdup_printf( "PTM_FORMAT_%s", type ) );
+
+	name = g_ascii_strup( basis->name, -1 );
+	format = g_strdup_printf( "PTM_FORMAT_%s_%s", name, type );
+	g_free( name );
+
+	return( format );
+}
+
+/* Find a basis by name, ignoring case.
+ */
+const Basis *
+basis_lookup( const char *name )
+{
+	int i;
+
+	for( i = 0; i < VIPS_NUMBER( basis_registry ); i++ )
+		if( g_ascii_strcasecmp( name, basis_registry[i].name ) == 0 )
+			return( &basis_registry[i] );
+
+	vips_error( "basis", "unknown basis \"%s\"", name );
+
+	return( NULL );
+}
+
+/* For usage messages.
+ */
+int
+basis_n_bases( void )
+{
+	return( VIPS_NUMBER( basis_registry ) );
+}
+
+const Basis *
+basis_nth( int i )
+{
+	return( &basis_registry[i] );
+}
@@ -0,0 +1,61 @@
+#ifndef BASIS_H
+#define BASIS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+/* The bases we can fit. The value is part of the pseudo-inverse cache key,
+ * so only ever add to the end.
+ */
+typedef enum {
+	QUADRATIC_BIVARIATE,
+	QUADRATIC_UNIVARIATE,
+	CUBIC_BIVARIATE,
+	QUARTIC_BIVARIATE,
+	HSH_2,
+	HSH_3
+} Basis_e;
+
+/* The most terms any basis has, the most coefficients the SIMD kernels
+ * handle, see POLYKERNEL_MAX_COEFF.
+ */
+#define BASIS_MAX_TERMS (16)
+
+/* Fill row with the basis functions for a light in direction x, y, z, a
+ * unit vector with z towards the camera.
+ */
+typedef void (*BasisRowFn)( double x, double y, double z, double *row );
+
+/* An entry in the basis registry.
+ */
+typedef struct _Basis {
+	Basis_e basis;
+	const char *name;
+	const char *description;
+
+	/* The number of coefficients, so also the fewest lights we can fit
+	 * with.
+	 */
+	int terms;
+	BasisRowFn row;
+
+	/* The term for each of the six PTM coefficients a0 - a5, -1 for a
+	 * term this basis doesn't have, or NULL if it can't be written as a
+	 * standard PTM.
+	 */
+	const int *ptm;
+} Basis;
+
+const Basis *basis_get( Basis_e basis );
+int basis_slots( const Basis *basis, int *slot );
+char *basis_format( const Basis *basis, int channels );
+const Basis *basis_lookup( const char *name );
+int basis_n_bases( void );
+const Basis *basis_nth( int i );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*BASIS_H*/
@@ -3,7 +3,7 @@
 echo cleaning area of all configure files ...
 rm -f aclocal.m4
 rm -rf autom4te.cache
-rm -f configure depcomp install-sh missing
+rm -f configure depcomp install-sh missing test-driver
 rm -f Makefile Makefile.in
 rm -f config.log config.status config.h config.h.in
 
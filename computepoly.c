@@ -2,6 +2,19 @@
  *
  * 2/2/17
  * 	- rewrite as a vips8 class
+ * 	- add compute_polys_range, a reduction-only variant for the scale/bias
+ * 	  pass
+ * 	- fit a row at a time with the kernels in polykernel.c
+ * 	- pick a kernel specialised for the matrix size once in build
+ * 	- compute_polys_range can check the kernel against the scalar 
+ * 	  reference
+ * 	- the input can be a single 3N-band stack image, see stackcache.c
+ * 	- optional B, shadow, highlight and rounds for a robust per-pixel 
+ * 	  fit, see polykernel_robust.c
+ * 	- optional tile: M is a stack of matrices, one for each tile, for 
+ * 	  lights whose direction varies across the image
+ * 	- optional rgb: fit each channel, for PTM_FORMAT_RGB, see 
+ * 	  polykernel_rgb.c
  */
 
 /*
@@ -13,11 +26,109 @@
 #endif /*HAVE_CONFIG_H*/
 
 #include <stdlib.h>
+#include <float.h>
+#include <math.h>
 
 #include <vips/vips.h>
 #include <vips/debug.h>
 
 #include "computepoly.h"
+#include "polykernel.h"
+
+/* The matrix for each tile of the image, for positional lights, where the 
+ * light direction varies across the frame. Tiles are tile pixels square, in
+ * rows across tiles wide. With tile zero there's one matrix for everything.
+ * Set rgb for polykernel_rgb(), which makes 3 * m floats a pixel.
+ */
+typedef struct _PolyTiles {
+	int tile;
+	int across;
+	PolyMatrix *matrix;
+	gboolean rgb;
+} PolyTiles;
+
+/* Make the matrix for each tile from M, a stack of m x n matrices, one for 
+ * each tile of a width x height image, in row order.
+ */
+static int
+poly_tiles_init( PolyTiles *tiles, VipsObject *object, const char *domain,
+	VipsImage *M, int tile, int width, int height )
+{
+	int down;
+	int n_tiles;
+	int m;
+	int i;
+
+	tiles->tile = tile;
+	tiles->rgb = FALSE;
+
+	if( tile <= 0 ) {
+		tiles->across = 1;
+		if( !(tiles->matrix = VIPS_NEW( object, PolyMatrix )) ||
+			polymatrix_init( tiles->matrix, object, M ) )
+			return( -1 );
+
+		return( 0 );
+	}
+
+	tiles->across = VIPS_ROUND_UP( width, tile ) / tile;
+	down = VIPS_ROUND_UP( height, tile ) / tile;
+	n_tiles = tiles->across * down;
+	if( M->Ysize % n_tiles != 0 ) {
+		vips_error( domain, 
+			"%s", _( "M height is not a multiple of the tiles" ) );
+		return( -1 );
+	}
+	m = M->Ysize / n_tiles;
+
+	if( !(tiles->matrix = VIPS_ARRAY( object, n_tiles, PolyMatrix )) )
+		return( -1 );
+	for( i = 0; i < n_tiles; i++ )
+		if( polymatrix_init_area( &tiles->matrix[i], object, 
+			M, i * m, m ) )
+			return( -1 );
+
+	return( 0 );
+}
+
+/* Fit a row starting at x, y, a run of pixels at a time with the matrix for 
+ * each tile it crosses. We move row->p along and put it back at the end.
+ */
+static void
+poly_tiles_row( PolyTiles *tiles, PolyKernelFn kernel, 
+	PolyRow *row, int x, int y )
+{
+	const int n = tiles->matrix->n;
+	const int qstride = tiles->rgb ? 
+		3 * tiles->matrix->m : (row->rgb ? 3 : 0) + tiles->matrix->m;
+
+	PolyRow run;
+	int left, right;
+	int i;
+
+	if( tiles->tile <= 0 ) {
+		kernel( tiles->matrix, row );
+		return;
+	}
+
+	run = *row;
+	for( left = 0; left < row->width; left = right ) {
+		int tx = (x + left) / tiles->tile;
+		int ty = y / tiles->tile;
+
+		right = VIPS_MIN( row->width, (tx + 1) * tiles->tile - x );
+		run.width = right - left;
+		run.q = row->q + left * qstride;
+
+		kernel( &tiles->matrix[ty * tiles->across + tx], &run );
+
+		for( i = 0; i < n; i++ )
+			row->p[i] += run.width * row->stride;
+	}
+
+	for( i = 0; i < n; i++ )
+		row->p[i] -= row->width * row->stride;
+}
 
 typedef struct _ComputePolys {
 	VipsOperation parent_instance;
@@ -27,10 +138,26 @@ typedef struct _ComputePolys {
 	VipsArrayImage *in;
 	VipsImage *out;
 	VipsImage *M;
+	VipsImage *B;
+	double shadow;
+	double highlight;
+	int rounds;
+	int tile;
+	gboolean rgb;
 
 	VipsImage **arr;
 	int n;
 
+	/* Bytes between pixels: 3, or 3 * M->Xsize for a single stack image.
+	 */
+	int stride;
+
+	/* M ready for the kernel, and the kernel we picked, specialised for 
+	 * the size of M if we can.
+	 */
+	PolyTiles tiles;
+	PolyKernelFn kernel;
+
 } ComputePolys;
 
 typedef VipsOperationClass ComputePolysClass;
@@ -41,7 +168,7 @@ G_DEFINE_TYPE( ComputePolys, compute_polys, VIPS_TYPE_OPERATION );
  */
 typedef struct {
 	VipsRegion **ir;
-	VipsPel * restrict * restrict p;
+	VipsPel **p;
 	double * restrict R;	
 } ComputePolysSeq;
 
@@ -80,8 +207,9 @@ compute_polys_start( VipsImage *out, void *a, void *b )
 	/* Attach regions and arrays.
 	 */
 	seq->ir = VIPS_ARRAY( out, polys->n + 1, VipsRegion * );
-	seq->p = VIPS_ARRAY( out, polys->n + 1, VipsPel * );
-	seq->R = VIPS_ARRAY( out, polys->n, double );
+	seq->p = VIPS_ARRAY( out, polys->tiles.matrix->n + 1, VipsPel * );
+	seq->R = VIPS_ARRAY( out, 
+		polymatrix_scratch( polys->tiles.matrix ), double );
 	if( !seq->ir || 
 		!seq->p || 
 		!seq->R ) {
@@ -106,7 +234,7 @@ compute_polys_gen( VipsRegion *or, void *vseq, void *a, void *b, gboolean *stop
 	ComputePolys *polys = (ComputePolys *) b;
 	VipsRect *r = &or->valid;
 
-	int x, y, i, j;
+	int y, i;
 
 	/* 8.5 added this faster thing.
 	 */
@@ -121,125 +249,86 @@ compute_polys_gen( VipsRegion *or, void *vseq, void *a, void *b, gboolean *stop
 	VIPS_GATE_START( "compute_polys_gen: work" ); 
 
 	for( y = 0; y < r->height; y++ ) {
-		float * restrict q = (float * restrict) 
-			VIPS_REGION_ADDR( or, r->left, r->top + y );
-
-		for( i = 0; i < polys->n; i++ )
-			seq->p[i] = VIPS_REGION_ADDR( seq->ir[i], 
+		PolyRow row;
+
+		if( polys->stride == 3 )
+			for( i = 0; i < polys->n; i++ )
+				seq->p[i] = VIPS_REGION_ADDR( seq->ir[i], 
+					r->left, r->top + y );
+		else {
+			seq->p[0] = VIPS_REGION_ADDR( seq->ir[0], 
 				r->left, r->top + y );
+			for( i = 1; i < polys->tiles.matrix->n; i++ )
+				seq->p[i] = seq->p[0] + 3 * i;
+		}
 
-		for( x = 0; x < r->width; x++ ) {
-			double maxy;
-			double adoty[3];
-			double ydoty;
-
-#ifdef DEBUG
-			printf( "pix %d, %d: ", x + r->left, y + r->top );
-			for( i = 0; i < polys->n; i++ ) {
-				printf( "[" );
-				for( j = 0; j < 3; j++ )
-					printf( "%3d ", seq->p[i][j] );
-				printf( "] " );
-			}
-			printf( "\n" );
-#endif /*DEBUG*/
-
-			/* Find normalised luminance for the input images. 
-			 */
-
-			maxy = 0;
-			for( i = 0; i < polys->n; i++ ) {
-				seq->R[i] = 0.2125 * seq->p[i][0] + 
-					0.7154 * seq->p[i][1] +
-					0.0721 * seq->p[i][2];
-				seq->R[i] /= 255.0;
-
-				if( seq->R[i] > maxy )
-					maxy = seq->R[i];
-			}
-
-			if( maxy != 0 )
-				for( i = 0; i < polys->n; i++ ) 
-					seq->R[i] /= maxy;
-
-			/* Find average colour component of inputs.
-			 */
-
-			for( j = 0; j < 3; j++ )
-				adoty[j] = 0.0;
-			ydoty = 0.0;
-			for( i = 0; i < polys->n; i++ ) {
-				for( j = 0; j < 3; j++ )
-					adoty[j] += 
-						seq->p[i][j] / 255.0 * seq->R[i];
-				ydoty += seq->R[i] * seq->R[i];
-			}
-
-			for( i = 0; i < polys->n; i++ ) 
-				seq->p[i] += 3;
-
-			/* Write normalised RGB to the first three bands.
-			 */
-
-			for( j = 0; j < 3; j++ ) {
-				double av;
-
-				if( ydoty != 0 ) {
-					av = adoty[j] / ydoty;
-
-					if( av < 0.0 )
-						av = 0.0;
-					else if( av > 1.0 )
-						av = 1.0;
-				}
-				else
-					av = 0.0;
+		row.p = seq->p;
+		row.stride = polys->stride;
+		row.width = r->width;
+		row.q = (float *) VIPS_REGION_ADDR( or, r->left, r->top + y );
+		row.rgb = TRUE;
+		row.R = seq->R;
 
-				q[j] = av * 255.0;
-			}
+		poly_tiles_row( &polys->tiles, polys->kernel, 
+			&row, r->left, r->top + y );
 
 #ifdef DEBUG
-			printf( "RGB: " );
-			for( j = 0; j < 3; j++ )
-				printf( "%g ", q[j] );
-			printf( "\n" );
+		printf( "row %d: RGB: ", r->top + y );
+		for( i = 0; i < 3; i++ )
+			printf( "%g ", row.q[i] );
+		printf( "Lum poly: " );
+		for( i = 0; i < polys->tiles.matrix->m; i++ )
+			printf( "%g ", row.q[i + 3] );
+		printf( "\n" );
 #endif /*DEBUG*/
+	}
 
-			q += 3;
-			
-			/* Put the luminance signal through the matrix to get
-			 * the poly coefficients.
-			 */
+	VIPS_GATE_STOP( "compute_polys_gen: work" ); 
 
-			g_assert( polys->M->Xsize == polys->n );
-			g_assert( polys->M->Ysize == polys->out->Bands - 3 );
+	return( 0 );
+}
 
-			for( j = 0; j < polys->M->Ysize; j++ ) {
-				double sum;
-				double * restrict coeff = 
-					VIPS_MATRIX( polys->M, 0, 0 );
-				double * restrict M = 
-					coeff + j * polys->M->Xsize;
+/* Check the inputs are n 3-band uchar images all the same size, and that 
+ * the matrix has a column for each. Alternatively, a single uchar image 
+ * with 3 bands for each column of the matrix is a stack of images, pixel
+ * interleaved. Set stride to the number of bytes between pixels.
+ */
+static int
+compute_polys_check( const char *domain, 
+	VipsImage **arr, int n, VipsImage *M, int *stride )
+{
+	int i;
 
-				sum = 0.0; 
-				for( i = 0; i < polys->M->Xsize; i++ )
-					sum += seq->R[i] * M[i];
+	if( n < 1 ) {
+		vips_error( domain, "%s", _( "zero input images!" ) );
+		return( -1 );
+	}
 
-				q[j] = 255.0 * sum;
-			}
+	if( n == 1 &&
+		M->Xsize > 1 ) {
+		if( vips_check_uncoded( domain, arr[0] ) ||
+			vips_check_bands( domain, arr[0], 3 * M->Xsize ) ||
+			vips_check_format( domain, arr[0], VIPS_FORMAT_UCHAR ) )
+			return( -1 );
 
-#ifdef DEBUG
-			printf( "Lum poly: " );
-			for( j = 0; j < polys->M->Ysize; j++ )
-				printf( "%g ", q[j] );
-			printf( "\n" );
-#endif /*DEBUG*/
+		*stride = 3 * M->Xsize;
 
-			q += polys->M->Ysize; 
-		}
+		return( 0 );
 	}
 
-	VIPS_GATE_STOP( "vips_bandary_gen: work" ); 
+	if( n != M->Xsize ) {
+		vips_error( domain, "%s", _( "M width != n images" ) );
+		return( -1 );
+	}
+
+	for( i = 0; i < n; i++ ) 
+		if( vips_check_uncoded( domain, arr[i] ) ||
+			vips_check_size_same( domain, arr[0], arr[i] ) ||
+			vips_check_bands( domain, arr[i], 3 ) ||
+			vips_check_format( domain, arr[i], VIPS_FORMAT_UCHAR ) )
+			return( -1 );
+
+	*stride = 3;
 
 	return( 0 );
 }
@@ -249,30 +338,38 @@ compute_polys_build( VipsObject *object )
 {
 	ComputePolys *polys = (ComputePolys *) object;
 
-	int i;
-
 	if( VIPS_OBJECT_CLASS( compute_polys_parent_class )->build( object ) )
 		return( -1 );
 
 	polys->arr = vips_array_image_get( polys->in, &polys->n );
 
-	if( polys->n < 1 ) {
-		vips_error( "compute_polys", "%s", _( "zero input images!" ) );
+	if( compute_polys_check( "compute_polys", 
+		polys->arr, polys->n, polys->M, &polys->stride ) )
 		return( -1 );
-	}
-	if( polys->n != polys->M->Xsize ) {
-		vips_error( "compute_polys", "%s", _( "M width != n images" ) );
+
+	if( poly_tiles_init( &polys->tiles, object, "compute_polys", polys->M, 
+		polys->tile, polys->arr[0]->Xsize, polys->arr[0]->Ysize ) )
+		return( -1 );
+	if( polys->B &&
+		(polys->tile > 0 || polys->rgb) ) {
+		vips_error( "compute_polys", 
+			"%s", _( "robust fits can't use tiles or rgb" ) );
 		return( -1 );
 	}
-
-	for( i = 0; i < polys->n; i++ ) 
-		if( vips_check_uncoded( "compute_polys", polys->arr[0] ) ||
-			vips_check_size_same( "compute_polys", 
-				polys->arr[0], polys->arr[i] ) ||
-			vips_check_bands( "compute_polys", polys->arr[i], 3 ) ||
-			vips_check_format( "compute_polys", 
-				polys->arr[i], VIPS_FORMAT_UCHAR ) )
+	polys->tiles.rgb = polys->rgb;
+
+	if( polys->rgb )
+		polys->kernel = polykernel_get()->rgb;
+	else if( polys->B ) {
+		if( polymatrix_robust_init( polys->tiles.matrix, object, 
+			polys->B,
+			polys->shadow, polys->highlight, polys->rounds ) )
 			return( -1 );
+		polys->kernel = polykernel_get()->robust;
+	}
+	else
+		polys->kernel = polykernel_specialise( polykernel_get(), 
+			polys->tiles.matrix );
 
 	g_object_set( object, "out", vips_image_new(), NULL ); 
 
@@ -281,7 +378,11 @@ compute_polys_build( VipsObject *object )
 		return( -1 );
 
 	polys->out->BandFmt = VIPS_FORMAT_FLOAT;
-	polys->out->Bands = 3 + polys->M->Ysize;
+	polys->out->Bands = polys->rgb ? 
+		3 * polys->tiles.matrix->m : 3 + polys->tiles.matrix->m;
+
+	g_assert( polys->stride == 3 * polys->tiles.matrix->n ||
+		polys->tiles.matrix->n == polys->n );
 
 	if( vips_image_generate( polys->out,
 		compute_polys_start, compute_polys_gen, compute_polys_stop, 
@@ -325,10 +426,467 @@ compute_polys_class_init( ComputePolysClass *class )
 		VIPS_ARGUMENT_REQUIRED_INPUT,
 		G_STRUCT_OFFSET( ComputePolys, M ) );
 
-
+	VIPS_ARG_IMAGE( class, "B", 3, 
+		_( "B" ), 
+		_( "Basis matrix, for a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, B ) );
+
+	VIPS_ARG_DOUBLE( class, "shadow", 4, 
+		_( "Shadow" ), 
+		_( "Ignore lights darker than this in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, shadow ),
+		0, 255, 0 );
+
+	VIPS_ARG_DOUBLE( class, "highlight", 5, 
+		_( "Highlight" ), 
+		_( "Ignore lights brighter than this in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, highlight ),
+		0, 255, 255 );
+
+	VIPS_ARG_INT( class, "rounds", 6, 
+		_( "Rounds" ), 
+		_( "Rounds of reweighting in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, rounds ),
+		0, 100, 0 );
+
+	VIPS_ARG_INT( class, "tile", 7, 
+		_( "Tile" ), 
+		_( "M has a matrix for each tile this many pixels across" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, tile ),
+		0, 100000, 0 );
+
+	VIPS_ARG_BOOL( class, "rgb", 8, 
+		_( "RGB" ), 
+		_( "Fit each channel, making 3 * m bands and no average" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolys, rgb ),
+		FALSE );
 }
 
 static void
 compute_polys_init( ComputePolys *polys )
 {
+	polys->highlight = 255;
+}
+
+/* compute_polys_range: just find the min and max of each polynomial 
+ * coefficient, without making an output image. This is all the scale/bias
+ * pass needs, so we can skip the RGB average as well.
+ *
+ * Set check and every CHECK_EVERY'th row is fitted again with the scalar 
+ * double kernel, and the largest difference for each coefficient comes back
+ * in error. This is how we measure the fixed-point kernels.
+ */
+
+#define CHECK_EVERY (16)
+
+typedef struct _ComputePolysRange {
+	VipsOperation parent_instance;
+
+	/* Args.
+	 */
+	VipsArrayImage *in;
+	VipsImage *M;
+	VipsArrayDouble *min_array;
+	VipsArrayDouble *max_array;
+	gboolean check;
+	VipsArrayDouble *error_array;
+	VipsImage *B;
+	double shadow;
+	double highlight;
+	int rounds;
+	int tile;
+	gboolean rgb;
+
+	VipsImage **arr;
+	int n;
+	int stride;
+
+	PolyTiles tiles;
+	PolyKernelFn kernel;
+
+	/* Coefficients for each pixel: m, or 3 * m for an RGB fit.
+	 */
+	int bands;
+
+	/* Range of each coefficient, merged from all threads.
+	 */
+	double *min;
+	double *max;
+	double *error;
+
+} ComputePolysRange;
+
+typedef VipsOperationClass ComputePolysRangeClass;
+
+G_DEFINE_TYPE( ComputePolysRange, compute_polys_range, VIPS_TYPE_OPERATION );
+
+/* Per-thread state. We sink over the first input image, so we only need 
+ * regions on the others.
+ */
+typedef struct {
+	VipsRegion **ir;
+	VipsPel **p;
+	double * restrict R;	
+	float * restrict q;	
+	float * restrict qref;	
+
+	double *min;
+	double *max;
+	double *error;
+} ComputePolysRangeSeq;
+
+/* Merge a thread's range into the global range and free it. vips_sink
+ * runs stop functions one at a time, so we don't need a lock.
+ */
+static int
+compute_polys_range_stop( void *vseq, void *a, void *b )
+{
+	ComputePolysRangeSeq *seq = (ComputePolysRangeSeq *) vseq;
+	ComputePolysRange *range = (ComputePolysRange *) a;
+
+	int i;
+
+	if( seq->min &&
+		seq->max ) 
+		for( i = 0; i < range->bands; i++ ) {
+			range->min[i] = VIPS_MIN( range->min[i], seq->min[i] );
+			range->max[i] = VIPS_MAX( range->max[i], seq->max[i] );
+		}
+
+	if( seq->error ) 
+		for( i = 0; i < range->bands; i++ ) 
+			range->error[i] = 
+				VIPS_MAX( range->error[i], seq->error[i] );
+
+	if( seq->ir )
+		for( i = 0; i < range->n - 1; i++ ) 
+			VIPS_UNREF( seq->ir[i] );
+
+	VIPS_FREE( seq->ir );
+	VIPS_FREE( seq->p );
+	VIPS_FREE( seq->R );
+	VIPS_FREE( seq->q );
+	VIPS_FREE( seq->qref );
+	VIPS_FREE( seq->min );
+	VIPS_FREE( seq->max );
+	VIPS_FREE( seq->error );
+	VIPS_FREE( seq );
+
+	return( 0 );
+}
+
+static void *
+compute_polys_range_start( VipsImage *in, void *a, void *b )
+{
+	ComputePolysRange *range = (ComputePolysRange *) a;
+	int bands = range->bands;
+
+	ComputePolysRangeSeq *seq;
+	int i;
+
+	seq = g_new0( ComputePolysRangeSeq, 1 );
+	seq->ir = g_new0( VipsRegion *, range->n );
+	seq->p = g_new( VipsPel *, range->tiles.matrix->n );
+	seq->R = g_new( double, polymatrix_scratch( range->tiles.matrix ) );
+	seq->q = g_new( float, range->arr[0]->Xsize * bands );
+	seq->min = g_new( double, bands );
+	seq->max = g_new( double, bands );
+
+	for( i = 0; i < bands; i++ ) {
+		seq->min[i] = DBL_MAX;
+		seq->max[i] = -DBL_MAX;
+	}
+
+	if( range->check ) {
+		seq->qref = g_new( float, range->arr[0]->Xsize * bands );
+		seq->error = g_new0( double, bands );
+	}
+
+	for( i = 1; i < range->n; i++ )
+		if( !(seq->ir[i - 1] = vips_region_new( range->arr[i] )) ) {
+			compute_polys_range_stop( seq, a, b );
+			return( NULL );
+		}
+	seq->ir[i - 1] = NULL;
+
+	return( (void *) seq );
+}
+
+static int
+compute_polys_range_scan( VipsRegion *region, 
+	void *vseq, void *a, void *b, gboolean *stop )
+{
+	ComputePolysRangeSeq *seq = (ComputePolysRangeSeq *) vseq;
+	ComputePolysRange *range = (ComputePolysRange *) a;
+	VipsRect *r = &region->valid;
+	int bands = range->bands;
+	double * restrict min = seq->min;
+	double * restrict max = seq->max;
+
+	int x, y, i, j;
+
+	if( range->n > 1 &&
+		vips_region_prepare_many( seq->ir, r ) )
+		return( -1 );
+
+	VIPS_GATE_START( "compute_polys_range_scan: work" ); 
+
+	for( y = 0; y < r->height; y++ ) {
+		PolyRow row;
+		float * restrict q;
+
+		seq->p[0] = VIPS_REGION_ADDR( region, r->left, r->top + y );
+		if( range->stride == 3 )
+			for( i = 1; i < range->n; i++ )
+				seq->p[i] = VIPS_REGION_ADDR( seq->ir[i - 1], 
+					r->left, r->top + y );
+		else
+			for( i = 1; i < range->tiles.matrix->n; i++ )
+				seq->p[i] = seq->p[0] + 3 * i;
+
+		row.p = seq->p;
+		row.stride = range->stride;
+		row.width = r->width;
+		row.q = seq->q;
+		row.rgb = FALSE;
+		row.R = seq->R;
+
+		poly_tiles_row( &range->tiles, range->kernel, 
+			&row, r->left, r->top + y );
+
+		q = seq->q;
+		for( x = 0; x < r->width; x++ ) {
+			for( j = 0; j < bands; j++ ) {
+				if( q[j] < min[j] )
+					min[j] = q[j];
+				if( q[j] > max[j] )
+					max[j] = q[j];
+			}
+
+			q += bands;
+		}
+
+		if( seq->error &&
+			(r->top + y) % CHECK_EVERY == 0 ) {
+			float * restrict qref = seq->qref;
+
+			row.q = qref;
+			poly_tiles_row( &range->tiles, polykernel_scalar, 
+				&row, r->left, r->top + y );
+
+			q = seq->q;
+			for( x = 0; x < r->width * bands; x++ ) 
+				seq->error[x % bands] = 
+					VIPS_MAX( seq->error[x % bands], 
+						fabs( q[x] - qref[x] ) );
+		}
+	}
+
+	VIPS_GATE_STOP( "compute_polys_range_scan: work" ); 
+
+	return( 0 );
+}
+
+static int
+compute_polys_range_build( VipsObject *object )
+{
+	ComputePolysRange *range = (ComputePolysRange *) object;
+
+	VipsArrayDouble *array;
+	int i;
+
+	if( VIPS_OBJECT_CLASS( compute_polys_range_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	range->arr = vips_array_image_get( range->in, &range->n );
+
+	if( compute_polys_check( "compute_polys_range", 
+		range->arr, range->n, range->M, &range->stride ) )
+		return( -1 );
+
+	if( poly_tiles_init( &range->tiles, object, "compute_polys_range", 
+		range->M, range->tile, 
+		range->arr[0]->Xsize, range->arr[0]->Ysize ) )
+		return( -1 );
+	if( range->B &&
+		(range->tile > 0 || range->rgb) ) {
+		vips_error( "compute_polys_range", 
+			"%s", _( "robust fits can't use tiles or rgb" ) );
+		return( -1 );
+	}
+	if( range->check &&
+		range->rgb ) {
+		vips_error( "compute_polys_range", 
+			"%s", _( "can't check an rgb fit" ) );
+		return( -1 );
+	}
+	range->tiles.rgb = range->rgb;
+	range->bands = range->rgb ? 
+		3 * range->tiles.matrix->m : range->tiles.matrix->m;
+
+	if( range->rgb )
+		range->kernel = polykernel_get()->rgb;
+	else if( range->B ) {
+		if( polymatrix_robust_init( range->tiles.matrix, object, 
+			range->B,
+			range->shadow, range->highlight, range->rounds ) )
+			return( -1 );
+		range->kernel = polykernel_get()->robust;
+	}
+	else
+		range->kernel = polykernel_specialise( polykernel_get(), 
+			range->tiles.matrix );
+
+	range->min = VIPS_ARRAY( object, range->bands, double );
+	range->max = VIPS_ARRAY( object, range->bands, double );
+	if( !range->min ||
+		!range->max )
+		return( -1 );
+	for( i = 0; i < range->bands; i++ ) {
+		range->min[i] = DBL_MAX;
+		range->max[i] = -DBL_MAX;
+	}
+	if( range->check ) {
+		if( !(range->error = 
+			VIPS_ARRAY( object, range->bands, double )) )
+			return( -1 );
+		for( i = 0; i < range->bands; i++ ) 
+			range->error[i] = 0.0;
+	}
+
+	if( vips_sink( range->arr[0], 
+		compute_polys_range_start, 
+		compute_polys_range_scan, 
+		compute_polys_range_stop, 
+		range, NULL ) )
+		return( -1 );
+
+	array = vips_array_double_new( range->min, range->bands );
+	g_object_set( object, "min", array, NULL );
+	vips_area_unref( VIPS_AREA( array ) );
+
+	array = vips_array_double_new( range->max, range->bands );
+	g_object_set( object, "max", array, NULL );
+	vips_area_unref( VIPS_AREA( array ) );
+
+	if( range->check ) {
+		array = vips_array_double_new( range->error, 
+			range->bands );
+		g_object_set( object, "error", array, NULL );
+		vips_area_unref( VIPS_AREA( array ) );
+	}
+
+	return( 0 );
+}
+
+static void
+compute_polys_range_class_init( ComputePolysRangeClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *vobject_class = VIPS_OBJECT_CLASS( class );
+
+	VIPS_DEBUG_MSG( "compute_polys_range_class_init\n" );
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	vobject_class->nickname = "compute_polys_range";
+	vobject_class->description = 
+		_( "find the range of a set of polynomials" );
+	vobject_class->build = compute_polys_range_build;
+
+	VIPS_ARG_BOXED( class, "in", 0, 
+		_( "Input" ), 
+		_( "Array of input images" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, in ),
+		VIPS_TYPE_ARRAY_IMAGE );
+
+	VIPS_ARG_IMAGE( class, "M", 1, 
+		_( "M" ), 
+		_( "Coefficient array" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, M ) );
+
+	VIPS_ARG_BOXED( class, "min", 2, 
+		_( "Min" ), 
+		_( "Minimum of each coefficient" ),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, min_array ),
+		VIPS_TYPE_ARRAY_DOUBLE );
+
+	VIPS_ARG_BOXED( class, "max", 3, 
+		_( "Max" ), 
+		_( "Maximum of each coefficient" ),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, max_array ),
+		VIPS_TYPE_ARRAY_DOUBLE );
+
+	VIPS_ARG_BOOL( class, "check", 4, 
+		_( "Check" ), 
+		_( "Check the kernel against the scalar reference" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, check ),
+		FALSE );
+
+	VIPS_ARG_BOXED( class, "error", 5, 
+		_( "Error" ), 
+		_( "Largest difference from the reference for each coefficient" ),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, error_array ),
+		VIPS_TYPE_ARRAY_DOUBLE );
+
+	VIPS_ARG_IMAGE( class, "B", 6, 
+		_( "B" ), 
+		_( "Basis matrix, for a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, B ) );
+
+	VIPS_ARG_DOUBLE( class, "shadow", 7, 
+		_( "Shadow" ), 
+		_( "Ignore lights darker than this in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, shadow ),
+		0, 255, 0 );
+
+	VIPS_ARG_DOUBLE( class, "highlight", 8, 
+		_( "Highlight" ), 
+		_( "Ignore lights brighter than this in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, highlight ),
+		0, 255, 255 );
+
+	VIPS_ARG_INT( class, "rounds", 9, 
+		_( "Rounds" ), 
+		_( "Rounds of reweighting in a robust fit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, rounds ),
+		0, 100, 0 );
+
+	VIPS_ARG_INT( class, "tile", 10, 
+		_( "Tile" ), 
+		_( "M has a matrix for each tile this many pixels across" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, tile ),
+		0, 100000, 0 );
+
+	VIPS_ARG_BOOL( class, "rgb", 11, 
+		_( "RGB" ), 
+		_( "Fit each channel, giving a range for each of 3 * m bands" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( ComputePolysRange, rgb ),
+		FALSE );
+}
+
+static void
+compute_polys_range_init( ComputePolysRange *range )
+{
+	range->highlight = 255;
 }
@@ -10,6 +10,7 @@ extern "C" {
 #define _(S) (S)
 
 GType compute_polys_get_type( void );
+GType compute_polys_range_get_type( void );
 
 #ifdef __cplusplus
 }
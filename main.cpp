@@ -7,11 +7,16 @@
 #include <iostream>
 #include <math.h>
 #include <string.h>
+#include <unistd.h>
 
-#include <vips/vips.h>
+#include <vector>
+
+#include <vips/vips8>
 
 #include "computepoly.h"
+#include "polykernel.h"
 #include "LinearSystem.h"
+#include "serve.h"
 
 #define VERSION_NUMBER 1.02
 
@@ -21,7 +26,52 @@ char fname[STRSIZE];
 Basis_e base = QUADRATIC_BIVARIATE;
 
 bool outputfilegiven = false;
-bool cache = false;
+Cache_e cache = CACHE_NONE;
+bool fast_quant = false;
+bool stack_cache = false;
+bool sequential = false;
+int accumulate = 0;
+const char *spill_dir = NULL;
+
+// -robust: fit each pixel with its own weights, ignoring lights outside
+// shadow to highlight and reweighting rounds times
+bool robust = false;
+int rounds = 0;
+double shadow = 0;
+double highlight = 255;
+
+// -tile: with positional lights, the size of the tiles that get their own 
+// pseudo-inverse
+int tile = 256;
+
+// -rgb: fit R, G and B separately and write PTM_FORMAT_RGB
+bool rgb = false;
+
+// -jpeg: write PTM_FORMAT_JPEG_LRGB or _RGB at this quality, 0 for raw
+int jpeg = 0;
+
+const char *kernel = NULL;
+
+// -batch: a manifest of lp/ptm pairs, fitted jobs at a time with threads 
+// threads between them
+const char *manifest = NULL;
+int jobs = 0;
+int threads = 0;
+
+// -watch: fit frames as they arrive in a directory, writing a preview every
+// preview frames
+const char *watch_dir = NULL;
+int preview = 0;
+
+// -pyramid: also write the coefficients as tile pyramids for web viewers, 
+// see writepyramid.c
+const char *pyramid_dir = NULL;
+const char *pyramid_suffix = ".png";
+int pyramid_tile = 256;
+
+// -serve: run as a service on a spool directory, with a memory budget in MB
+const char *spool = NULL;
+int memory_mb = 4096;
 
 int crop_left = 0;
 int crop_top = 0;
@@ -44,11 +94,114 @@ void Usage(char *argv0)
 	printf("     Calculate a least squares fit of one independent variable:  -UNIVARIATE\n");
 	printf("                                   or two independent variables: -BIVARIATE\n");
 	printf("     (Default: BIVARIATE)\n\n");
+	printf("  -basis NAME\n");
+	printf("    Fit with this basis, one of:\n");
+	for (int i = 0; i < basis_n_bases(); i++)
+		printf("      %-11s %d terms, %s\n", basis_nth(i)->name,
+			basis_nth(i)->terms, basis_nth(i)->description);
+	printf("    Bases other than bivariate and univariate write a PTM\n");
+	printf("    with their own format, see README (Default: bivariate)\n\n");
+
+	printf("  -lrgb | -rgb\n");
+	printf("    Fit luminance and write PTM_FORMAT_LRGB, or fit each of R, G\n");
+	printf("    and B and write PTM_FORMAT_RGB, three times the size and\n");
+	printf("    about three times slower (Default: LRGB); with -sequential\n");
+	printf("    the G and B areas, two thirds of the file, are held in\n");
+	printf("    memory until the end\n\n");
+
+	printf("  -jpeg[=Q]\n");
+	printf("    Write PTM_FORMAT_JPEG_LRGB (or JPEG_RGB with -rgb), each\n");
+	printf("    plane a JPEG at quality Q (Default: 90), and report the\n");
+	printf("    compression ratio; needs the bivariate or univariate basis\n\n");
 
 	printf("  -crop LEFT TOP WIDTH HEIGHT\n");
 	printf("    Only process part of input frames, crops are 10 x percent\n\n");
-	printf("  -cache\n");
+	printf("  -cache, -cache=float\n");
 	printf("    Cache calculated coefficients (needs lots of mem)\n\n");
+	printf("  -cache=short\n");
+	printf("    Cache calculated coefficients as 16-bit ints, half the\n");
+	printf("    memory of -cache\n\n");
+	printf("  -stream, -cache=disk[:path]\n");
+	printf("    Spill calculated coefficients to a temp file in path, or\n");
+	printf("    $TMPDIR, so the input images are only decoded once (needs\n");
+	printf("    lots of disc)\n\n");
+	printf("  -fast-quant\n");
+	printf("    Estimate scale and bias from a 1/8 preview, so the input\n");
+	printf("    images are only decoded once at full size\n\n");
+	printf("  -sequential\n");
+	printf("    Write the PTM strictly in order, so it can go to a pipe;\n");
+	printf("    needs -cache, -stream or -stack-cache. The RGB area, a\n");
+	printf("    third of the PTM, is held in memory until the end. Implied\n");
+	printf("    by -o -, which writes the PTM to stdout\n\n");
+	printf("  -pyramid DIR\n");
+	printf("    Also write the coefficients to DIR as tile pyramids with a\n");
+	printf("    manifest.json, for web viewers; needs -cache, -stream or\n");
+	printf("    -stack-cache\n\n");
+	printf("  -pyramid-format SUFFIX\n");
+	printf("    The tile format and save options (Default: .png) ... JPEG\n");
+	printf("    codes the three planes of a tile as a colour, so use a high\n");
+	printf("    quality and no subsampling, eg. .jpg[Q=95,no_subsample]\n\n");
+	printf("  -pyramid-tile PX\n");
+	printf("    The pyramid tile size (Default: 256)\n\n");
+	printf("  -accumulate[=N]\n");
+	printf("    Fit N input images at a time (Default: 8) into running\n");
+	printf("    sums, so memory doesn't grow with the number of lights;\n");
+	printf("    implies -cache\n\n");
+	printf("  -robust[=ROUNDS]\n");
+	printf("    Fit each pixel with its own weights, ignoring lights outside\n");
+	printf("    -shadow to -highlight, then reweighting ROUNDS times to\n");
+	printf("    play down highlights and shadows that remain (Default: 2).\n");
+	printf("    Slower than the shared fit; implies -stream, unless\n");
+	printf("    there's -cache or -fast-quant, so it fits once\n\n");
+	printf("  -shadow LUM, -highlight LUM\n");
+	printf("    Ignore lights where the pixel is darker or brighter than\n");
+	printf("    LUM, 0 - 255 (Default: 0 and 255); without -robust, these\n");
+	printf("    imply -robust=0\n\n");
+	printf("  -tile PX\n");
+	printf("    If the lp file gives light positions (a line \"positional\n");
+	printf("    WIDTH HEIGHT\" before the images, the size of the object\n");
+	printf("    plane the frame covers), fit with a pseudo-inverse for each\n");
+	printf("    PX x PX tile (Default: 256)\n\n");
+	printf("  -watch DIR\n");
+	printf("    Fit the frames named in the lp file as they appear in DIR\n");
+	printf("    during capture, and write the PTM 5s after the last one.\n");
+	printf("    Frames can arrive in any order, and can be retaken until\n");
+	printf("    the PTM is written\n\n");
+	printf("  -preview N\n");
+	printf("    With -watch, write a provisional PTM next to the output,\n");
+	printf("    as NAME.preview.ptm, every N frames, and whenever a file\n");
+	printf("    called preview appears in DIR\n\n");
+	printf("  -stack-cache\n");
+	printf("    Decode the input images once to a pixel-major cache file in\n");
+	printf("    $TMPDIR and fit from that, reusing it on later runs\n\n");
+
+	printf("  -kernel NAME\n");
+	printf("    Fit with this kernel, one of auto, fixed");
+	for (int i = 0; i < polykernel_n_kernels(); i++)
+		printf(", %s", polykernel_nth_name(i));
+	printf("\n");
+	printf("    (Default: auto, the fastest this CPU supports; fixed is\n");
+	printf("    the fastest 8-bit fixed-point kernel)\n\n");
+
+	printf("  -batch MANIFEST\n");
+	printf("    Fit many datasets in one process: each line of MANIFEST is\n");
+	printf("    an lp file and an output PTM file, images are loaded from\n");
+	printf("    the lp file's directory, and blank lines and lines starting\n");
+	printf("    with # are skipped. Other options apply to every job\n\n");
+	printf("  -jobs N\n");
+	printf("    With -batch or -serve, fit N datasets at once\n");
+	printf("    (Default: a quarter of -threads)\n\n");
+	printf("  -threads N\n");
+	printf("    With -batch or -serve, the total number of worker threads,\n");
+	printf("    shared between the jobs (Default: the vips concurrency)\n\n");
+
+	printf("  -serve SPOOL\n");
+	printf("    Run as a service: fit each NAME.job file that appears in\n");
+	printf("    the directory SPOOL, with status in SPOOL/status, until\n");
+	printf("    SPOOL/stop is created. Uses -jobs and -threads\n\n");
+	printf("  -memory MB\n");
+	printf("    With -serve, only start jobs while their estimated memory\n");
+	printf("    use totals less than this (Default: 4096)\n\n");
 
 	printf("  -version\n");
 	printf("    Prints software version\n\n");
@@ -106,19 +259,225 @@ void Process_parameters(int argc, char **argv)
 				base = QUADRATIC_UNIVARIATE;
 		} else
 
+		if( strcmp( argv[i], "-basis") == 0)
+		{
+			const Basis *basis;
+
+			if( argc - i < 2 ) {
+				printf("no basis name given\n");
+				exit(-1);
+			}
+			if( !(basis = basis_lookup( argv[++i] )) ) {
+				std::cerr << vips_error_buffer();
+				exit(-1);
+			}
+			base = basis->basis;
+		} else
+
 		if( strcmp( argv[i], "-rgb") == 0)
 		{
-			// ignore this one, some other fitter
+			rgb = true;
 		} else
 
 		if( strcmp( argv[i], "-lrgb") == 0)
 		{
-			// ignore this one, some other fitter
+			rgb = false;
+		} else
+
+		if( strcmp( argv[i], "-jpeg") == 0)
+		{
+			jpeg = 90;
+		} else
+
+		if( strncmp( argv[i], "-jpeg=", 6) == 0)
+		{
+			jpeg = VIPS_CLIP(1, atoi( argv[i] + 6 ), 100);
+		} else
+
+		if( strcmp( argv[i], "-cache") == 0 ||
+			strcmp( argv[i], "-cache=float") == 0)
+		{
+			cache = CACHE_MEMORY;
+		} else
+
+		if( strcmp( argv[i], "-cache=short") == 0)
+		{
+			cache = CACHE_SHORT;
+		} else
+
+		if( strcmp( argv[i], "-stream") == 0 ||
+			strcmp( argv[i], "-cache=disk") == 0)
+		{
+			cache = CACHE_SPILL;
+		} else
+
+		if( strncmp( argv[i], "-cache=disk:", 12) == 0)
+		{
+			cache = CACHE_SPILL;
+			spill_dir = argv[i] + 12;
+		} else
+
+		if( strcmp( argv[i], "-fast-quant") == 0)
+		{
+			fast_quant = true;
+		} else
+
+		if( strcmp( argv[i], "-sequential") == 0)
+		{
+			sequential = true;
+		} else
+
+		if( strcmp( argv[i], "-accumulate") == 0)
+		{
+			accumulate = 8;
+		} else
+
+		if( strncmp( argv[i], "-accumulate=", 12) == 0)
+		{
+			accumulate = VIPS_MAX(1, atoi( argv[i] + 12 ));
+		} else
+
+		if( strcmp( argv[i], "-robust") == 0)
+		{
+			robust = true;
+			rounds = 2;
+		} else
+
+		if( strncmp( argv[i], "-robust=", 8) == 0)
+		{
+			robust = true;
+			rounds = VIPS_MAX(0, atoi( argv[i] + 8 ));
+		} else
+
+		if( strcmp( argv[i], "-shadow") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no shadow level given\n");
+				exit(-1);
+			}
+			shadow = atof( argv[++i] );
+		} else
+
+		if( strcmp( argv[i], "-highlight") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no highlight level given\n");
+				exit(-1);
+			}
+			highlight = atof( argv[++i] );
+		} else
+
+		if( strcmp( argv[i], "-tile") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no tile size given\n");
+				exit(-1);
+			}
+			tile = VIPS_MAX(1, atoi( argv[++i] ));
+		} else
+
+		if( strcmp( argv[i], "-pyramid") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no pyramid directory given\n");
+				exit(-1);
+			}
+			pyramid_dir = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-pyramid-format") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no pyramid format given\n");
+				exit(-1);
+			}
+			pyramid_suffix = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-pyramid-tile") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no pyramid tile size given\n");
+				exit(-1);
+			}
+			pyramid_tile = VIPS_MAX(1, atoi( argv[++i] ));
+		} else
+
+		if( strcmp( argv[i], "-watch") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no watch directory given\n");
+				exit(-1);
+			}
+			watch_dir = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-preview") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no preview interval given\n");
+				exit(-1);
+			}
+			preview = atoi( argv[++i] );
+		} else
+
+		if( strcmp( argv[i], "-stack-cache") == 0)
+		{
+			stack_cache = true;
+		} else
+
+		if( strcmp( argv[i], "-kernel") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no kernel name given\n");
+				exit(-1);
+			}
+			kernel = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-batch") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no manifest given\n");
+				exit(-1);
+			}
+			manifest = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-jobs") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no job count given\n");
+				exit(-1);
+			}
+			jobs = atoi( argv[++i] );
 		} else
 
-		if( strcmp( argv[i], "-cache") == 0)
+		if( strcmp( argv[i], "-threads") == 0)
 		{
-			cache = true;
+			if( argc - i < 2 ) {
+				printf("no thread count given\n");
+				exit(-1);
+			}
+			threads = atoi( argv[++i] );
+		} else
+
+		if( strcmp( argv[i], "-serve") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no spool directory given\n");
+				exit(-1);
+			}
+			spool = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-memory") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no memory budget given\n");
+				exit(-1);
+			}
+			memory_mb = atoi( argv[++i] );
 		} else
 
 		if( strcmp( argv[i], "-crop" ) == 0)
@@ -152,6 +511,121 @@ void Process_parameters(int argc, char **argv)
 		}
 	}
 
+	if (strcmp(fname, "-") == 0)
+		sequential = true;
+
+	if (sequential && 
+		cache == CACHE_NONE && 
+		!stack_cache)
+	{
+		printf("Error: -sequential needs -cache, -stream or -stack-cache\n");
+		exit(-1);
+	}
+
+	// accumulate_polys() makes a memory image
+	if (accumulate > 0)
+	{
+		if (stack_cache)
+		{
+			printf("Error: -accumulate can't be used with -stack-cache\n");
+			exit(-1);
+		}
+
+		if (cache != CACHE_NONE && 
+			cache != CACHE_MEMORY)
+			printf("-accumulate keeps coefficients in memory, ignoring -cache=short and -stream\n");
+		cache = CACHE_MEMORY;
+	}
+
+	// thresholds on their own are a robust fit with no reweighting
+	if (!robust &&
+		(shadow > 0 || highlight < 255))
+	{
+		robust = true;
+		rounds = 0;
+	}
+
+	// the robust kernel runs inside compute_polys
+	if (robust &&
+		(accumulate > 0 || watch_dir))
+	{
+		printf("Error: -robust can't be used with -accumulate or -watch\n");
+		exit(-1);
+	}
+
+	// robust coefficients aren't bounded by the pseudo-inverse, so they
+	// can overflow the int16 cache ... keep them as float
+	if (robust &&
+		cache == CACHE_SHORT)
+	{
+		printf("-robust keeps float coefficients, using -stream rather than -cache=short\n");
+		cache = CACHE_SPILL;
+	}
+
+	// without a cache the range pass is a whole second robust fit, so 
+	// spill the coefficients ... -fast-quant makes the range pass cheap
+	if (robust &&
+		cache == CACHE_NONE &&
+		!fast_quant)
+		cache = CACHE_SPILL;
+
+	// the rgb kernel also runs inside compute_polys, and has no weights
+	if (rgb &&
+		(accumulate > 0 || watch_dir || robust))
+	{
+		printf("Error: -rgb can't be used with -accumulate, -watch or -robust\n");
+		exit(-1);
+	}
+
+	// the JPEG formats are only defined for the six PTM coefficients
+	if (jpeg > 0 &&
+		!basis_get(base)->ptm)
+	{
+		printf("Error: -jpeg needs the bivariate or univariate basis\n");
+		exit(-1);
+	}
+
+	// the pyramid is a second pass over the coefficients, so they must 
+	// be cheap to read again
+	if (pyramid_dir &&
+		cache == CACHE_NONE &&
+		!stack_cache &&
+		!watch_dir)
+	{
+		printf("Error: -pyramid needs -cache, -stream or -stack-cache\n");
+		exit(-1);
+	}
+
+	if (watch_dir && 
+		(stack_cache || manifest || spool))
+	{
+		printf("Error: -watch can't be used with -stack-cache, -batch or -serve\n");
+		exit(-1);
+	}
+
+	if (manifest && spool)
+	{
+		printf("Error: use one of -batch and -serve\n");
+		exit(-1);
+	}
+
+	if (manifest || spool)
+	{
+		if (strlen(lpfile) > 0 || outputfilegiven)
+		{
+			printf("Error: -batch and -serve take files from their jobs, not -i and -o\n");
+			exit(-1);
+		}
+
+		if (sequential || pyramid_dir)
+		{
+			printf("Error: -sequential and -pyramid can't be used with -batch or -serve\n");
+			exit(-1);
+		}
+
+		return;
+	}
+
 	if (strlen(lpfile) == 0)
 	{
 
@@ -164,16 +638,218 @@ void Process_parameters(int argc, char **argv)
 }
 
 
-int
-main(int argc, char* argv[])
+// one line of a -batch manifest
+struct BatchJob
+{
+	int index;
+	char *lpfile;
+	char *fname;
+
+	// 0 for success, or the stage that failed
+	const char *failed;
+	// the vips error, if the stage threw
+	char *error;
+	double seconds;
+};
+
+// the jobs from a manifest, or false on error
+bool ReadManifest(const char *filename, std::vector<BatchJob> &batch)
+{
+	FILE *fp;
+	char line[2 * STRSIZE];
+	int n;
+
+	if (!(fp = fopen(filename, "r")))
+	{
+		printf("Error: unable to open manifest %s\n", filename);
+		return false;
+	}
+
+	for (n = 1; fgets(line, sizeof(line), fp); n++)
+	{
+		char **fields = g_strsplit_set(g_strstrip(line), " \t", -1);
+		std::vector<char *> names;
+
+		for (int i = 0; fields[i]; i++)
+			if (strlen(fields[i]) > 0)
+				names.push_back(fields[i]);
+
+		if (names.size() == 0 ||
+			names[0][0] == '#')
+		{
+			g_strfreev(fields);
+			continue;
+		}
+
+		if (names.size() != 2)
+		{
+			printf("Error: %s line %d: expected an lp file and a PTM file\n",
+				filename, n);
+			g_strfreev(fields);
+			fclose(fp);
+			return false;
+		}
+
+		BatchJob job;
+
+		job.index = batch.size() + 1;
+		job.lpfile = g_strdup(names[0]);
+		job.fname = g_strdup(names[1]);
+		job.failed = 0;
+		job.error = NULL;
+		job.seconds = 0.0;
+		batch.push_back(job);
+
+		g_strfreev(fields);
+	}
+
+	fclose(fp);
+
+	return true;
+}
+
+// fit and write one job ... this runs in the batch pool, so the vips
+// threads under it come from the budget we set in RunBatch()
+void RunJob(gpointer data, gpointer user_data)
+{
+	BatchJob *job = (BatchJob *) data;
+	int total = GPOINTER_TO_INT(user_data);
+	gint64 start = g_get_monotonic_time();
+
+	{
+		LinearSystem lin(base, cache, 
+			crop_left, crop_top, crop_width, crop_height);
+		char *dir = g_path_get_dirname(job->lpfile);
+
+		lin.SetFastQuant(fast_quant);
+		lin.SetStackCache(stack_cache);
+		lin.SetAccumulate(accumulate);
+		if (robust)
+			lin.SetRobust(shadow, highlight, rounds);
+		lin.SetTile(tile);
+		lin.SetRGB(rgb);
+		lin.SetJPEG(jpeg);
+		lin.SetSpillDir(spill_dir);
+		lin.SetImageDir(dir);
+		// jobs share the terminal, so no running counts
+		lin.SetProgress(jobs == 1);
+
+		// a missing or broken image throws from vips ... fail this job
+		// and let the others finish
+		const char *stage = "fit";
+
+		try
+		{
+			if (lin.FitPTM(job->lpfile) == -1)
+				job->failed = stage;
+			else
+			{
+				stage = "write";
+				if (lin.WriteFileVersion1_2(job->fname) == -1)
+					job->failed = stage;
+			}
+		}
+		catch (vips::VError &e)
+		{
+			job->failed = stage;
+			job->error = g_strstrip(g_strdup(e.what()));
+			vips_error_clear();
+		}
+
+		g_free(dir);
+	}
+
+	job->seconds = (g_get_monotonic_time() - start) / 1000000.0;
+
+	// one printf, so the error stays with its job
+	printf("[%d/%d] %s %s -> %s in %.2fs\n%s%s", 
+		job->index, total, 
+		job->failed ? "FAILED" : "done",
+		job->lpfile, job->fname, job->seconds,
+		job->error ? job->error : "",
+		job->error ? "\n" : "");
+	fflush(stdout);
+
+	vips_thread_shutdown();
+}
+
+// run every job in the manifest, several at once, and print a report
+int RunBatch()
+{
+	std::vector<BatchJob> batch;
+
+	if (!ReadManifest(manifest, batch))
+		return -1;
+
+	// vips concurrency is global, so split the budget evenly: each job 
+	// gets threads / jobs workers for its fit and write
+	if (threads <= 0)
+		threads = vips_concurrency_get();
+	if (jobs <= 0)
+		jobs = VIPS_MAX(1, threads / 4);
+	jobs = VIPS_CLIP(1, jobs, VIPS_MAX(1, (int) batch.size()));
+	vips_concurrency_set(VIPS_MAX(1, threads / jobs));
+
+	printf("Fitting %d datasets, %d at a time with %d threads each\n",
+		(int) batch.size(), jobs, VIPS_MAX(1, threads / jobs));
+
+	gint64 start = g_get_monotonic_time();
+	GThreadPool *pool = g_thread_pool_new(RunJob, 
+		GINT_TO_POINTER((int) batch.size()), jobs, TRUE, NULL);
+
+	for (size_t i = 0; i < batch.size(); i++)
+		g_thread_pool_push(pool, &batch[i], NULL);
+
+	// wait for the queue to drain
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	double elapsed = (g_get_monotonic_time() - start) / 1000000.0;
+	double busy = 0.0;
+	int n_failed = 0;
+
+	printf("\n%-6s %-8s %9s  %s\n", "job", "status", "seconds", "lp file");
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		BatchJob *job = &batch[i];
+
+		printf("%-6d %-8s %9.2f  %s\n", 
+			job->index, 
+			job->failed ? job->failed : "ok", 
+			job->seconds, 
+			job->lpfile);
+
+		if (job->failed)
+			n_failed += 1;
+		busy += job->seconds;
+
+		g_free(job->lpfile);
+		g_free(job->fname);
+		g_free(job->error);
+	}
+
+	printf("%d of %d datasets fitted in %.2fs (%.2fs of fitting)\n",
+		(int) batch.size() - n_failed, (int) batch.size(), 
+		elapsed, busy);
+
+	return n_failed > 0 ? -1 : 0;
+}
+
+void Banner()
 {
 	printf("Fast Polynomial Texture Map (PTM) Fitter\n");
 	printf("based on Hewlett-Packard Code from 2001\n");
-	
+}
+
+int
+main(int argc, char* argv[])
+{
 	//Gather user input
 
 	int stat;
 
+	// the fd we write the PTM to for -o -
+	int ptm_fd = -1;
+
 	if (VIPS_INIT(argv[0]))
 		{
 		vips_error_exit("unable to start VIPS");
@@ -181,17 +857,46 @@ main(int argc, char* argv[])
 		}
 
 	compute_polys_get_type();
+	compute_polys_range_get_type();
 
 	if(argc > 1)
 		// we have command line arguments, do not need to poll user
 	{
+		// with -o - the PTM goes to stdout, so everything we print,
+		// even errors in the arguments, must go to stderr ... look for
+		// it before we parse anything
+		for (int i = 1; i < argc - 1; i++)
+			if ((strcmp(argv[i], "-o") == 0 ||
+				strcmp(argv[i], "-PTM") == 0) &&
+				strcmp(argv[i + 1], "-") == 0)
+			{
+				fflush(stdout);
+				ptm_fd = dup(1);
+				dup2(2, 1);
+				break;
+			}
+
 		Process_parameters(argc, argv);
+
+		// a later -o won
+		if (ptm_fd != -1 &&
+			strcmp(fname, "-") != 0)
+		{
+			fflush(stdout);
+			dup2(ptm_fd, 1);
+			close(ptm_fd);
+			ptm_fd = -1;
+		}
+
+		Banner();
 	}
 	else
 	{							 //prompt user
 
 		int polybase;
 
+		Banner();
+
 		std::cout << "Enter filename for lp file (light positions file)" << "\n";
 		std::cin >> lpfile;
 
@@ -210,9 +915,74 @@ main(int argc, char* argv[])
 			base = QUADRATIC_UNIVARIATE;
 	}
 
-	LinearSystem lin(base, cache, crop_left, crop_top, crop_width, crop_height);
+	if (polykernel_select(kernel))
+	{
+		std::cerr << vips_error_buffer();
+		return(-1);
+	}
+	printf("Fitting with %s kernel\n", polykernel_get()->name);
 
-	stat = lin.FitPTM(lpfile);
+	if (manifest)
+		return(RunBatch());
+
+	if (spool)
+	{
+		ServeConfig config;
+
+		config.spool = spool;
+		config.jobs = jobs;
+		config.threads = threads;
+		config.memory = (size_t) VIPS_MAX(1, memory_mb) << 20;
+		config.cache = cache;
+		config.fast_quant = fast_quant;
+		config.stack_cache = stack_cache;
+		config.accumulate = accumulate;
+		config.robust = robust;
+		config.shadow = shadow;
+		config.highlight = highlight;
+		config.rounds = rounds;
+		config.tile = tile;
+		config.rgb = rgb;
+		config.jpeg = jpeg;
+		config.spill_dir = spill_dir;
+
+		return(Serve(&config));
+	}
+
+	LinearSystem lin(base, cache, crop_left, crop_top, crop_width, crop_height);
+	lin.SetFastQuant(fast_quant);
+	lin.SetStackCache(stack_cache);
+	lin.SetAccumulate(accumulate);
+	if (robust)
+		lin.SetRobust(shadow, highlight, rounds);
+	lin.SetTile(tile);
+	lin.SetRGB(rgb);
+	lin.SetJPEG(jpeg);
+	lin.SetSpillDir(spill_dir);
+	lin.SetSequential(sequential, ptm_fd);
+
+	if (watch_dir)
+	{
+		// the preview goes next to the output, as NAME.preview.ptm
+		char *stem = g_strdup(fname);
+		char *preview_fname;
+
+		if (g_str_has_suffix(stem, ".ptm"))
+			stem[strlen(stem) - 4] = '\0';
+		preview_fname = g_strdup_printf("%s.preview.ptm", stem);
+
+		// no previews if we don't have a file name yet, or we're
+		// writing to stdout
+		stat = lin.WatchPTM(lpfile, watch_dir, 
+			!outputfilegiven || strcmp(fname, "-") == 0 ? 
+				NULL : preview_fname, 
+			preview);
+
+		g_free(preview_fname);
+		g_free(stem);
+	}
+	else
+		stat = lin.FitPTM(lpfile);
 
 	if(stat == -1)
 	{
@@ -230,7 +1000,12 @@ main(int argc, char* argv[])
 	std::cout << "Writing file to : " << fname << "\n";
 	std::cout.flush();
 
-	lin.WriteFileVersion1_2(fname);
+	if (lin.WriteFileVersion1_2(fname) == -1)
+		return(-1);
+
+	if (pyramid_dir &&
+		lin.WritePyramid(pyramid_dir, pyramid_suffix, pyramid_tile) == -1)
+		return(-1);
 
 	return( 0 );
 }
@@ -0,0 +1,320 @@
+/* a cache of pseudo-inverses for fixed-geometry domes
+ *
+ * The pseudo-inverse depends only on the basis and the normalised light
+ * directions, and a dome has the same lights every time, so there's no need
+ * to run the SVD for each fit. We keep the m x n pseudo-inverse, its m
+ * singular values and its condition number, keyed on a hash of the basis and
+ * the light list.
+ *
+ * Entries are held in memory, so a process doing many fits solves each dome
+ * once, and in files under $XDG_CACHE_HOME/ptmfit, so later runs don't solve
+ * at all. -serve runs for a long time, so the memory copies are limited to
+ * PINV_CACHE_MAX_MEMORY, dropping the least recently used first; they're
+ * still on disc. Files are raw host-order doubles and not portable between 
+ * machines. Stale entries are never deleted: clear the directory by hand.
+ *
+ * Positional lights have a pseudo-inverse for each tile of the image. These
+ * are cached as a single entry, with the matrices and singular values 
+ * stacked, and the worst condition number.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+#include "pinvcache.h"
+
+/* Bump this if the layout or the fit changes.
+ */
+#define PINV_CACHE_MAGIC "ptmpinv1"
+
+/* The most memory the in-memory entries can take. A dome's entry is a few 
+ * kB, but a tiled one can be a few MB.
+ */
+#define PINV_CACHE_MAX_MEMORY (64 * 1024 * 1024)
+
+typedef struct _PinvCacheHeader {
+	char magic[8];
+	gint32 m;
+	gint32 n;
+} PinvCacheHeader;
+
+/* A cache entry. We keep it as the file image, so memory and disc entries 
+ * unpack the same way: a header, then cond, sv[m] and pinv[m * n].
+ */
+typedef struct _PinvCacheEntry {
+	char *data;
+	gsize length;
+
+	/* pinv_cache_clock when we last used it.
+	 */
+	guint64 used;
+} PinvCacheEntry;
+
+static GMutex pinv_cache_lock;
+static GHashTable *pinv_cache_table = NULL;
+static guint64 pinv_cache_clock = 0;
+static gsize pinv_cache_memory = 0;
+
+static void
+pinv_cache_entry_free( PinvCacheEntry *entry )
+{
+	g_free( entry->data );
+	g_free( entry );
+}
+
+/* Add an entry to the memory table, dropping the least recently used until
+ * we're under PINV_CACHE_MAX_MEMORY. Call with the lock held.
+ */
+static void
+pinv_cache_insert( const char *key, PinvCacheEntry *entry )
+{
+	PinvCacheEntry *old;
+
+	if( !pinv_cache_table ) 
+		pinv_cache_table = g_hash_table_new_full( 
+			g_str_hash, g_str_equal, 
+			g_free, (GDestroyNotify) pinv_cache_entry_free );
+
+	if( (old = g_hash_table_lookup( pinv_cache_table, key )) )
+		pinv_cache_memory -= old->length;
+	entry->used = ++pinv_cache_clock;
+	g_hash_table_replace( pinv_cache_table, g_strdup( key ), entry );
+	pinv_cache_memory += entry->length;
+
+	while( pinv_cache_memory > PINV_CACHE_MAX_MEMORY &&
+		g_hash_table_size( pinv_cache_table ) > 1 ) {
+		GHashTableIter iter;
+		gpointer k, v;
+		const char *oldest_key;
+		PinvCacheEntry *oldest;
+
+		oldest_key = NULL;
+		oldest = NULL;
+		g_hash_table_iter_init( &iter, pinv_cache_table );
+		while( g_hash_table_iter_next( &iter, &k, &v ) ) {
+			PinvCacheEntry *e = (PinvCacheEntry *) v;
+
+			if( e != entry &&
+				(!oldest || 
+				 e->used < oldest->used) ) {
+				oldest_key = (const char *) k;
+				oldest = e;
+			}
+		}
+
+#ifdef DEBUG
+		printf( "pinv_cache_insert: dropping \"%s\"\n", oldest_key );
+#endif /*DEBUG*/
+
+		pinv_cache_memory -= oldest->length;
+		g_hash_table_remove( pinv_cache_table, oldest_key );
+	}
+}
+
+static gsize
+pinv_cache_length( int m, int n )
+{
+	return( sizeof( PinvCacheHeader ) + 
+		(1 + m + (gsize) m * n) * sizeof( double ) );
+}
+
+/* The hash of a fit. @lights is @n normalised light vectors as x, y, z.
+ * Free the result with g_free().
+ */
+char *
+pinv_cache_key( int basis, int n, const double *lights )
+{
+	GChecksum *checksum;
+	gint32 header[2];
+	char *key;
+
+	checksum = g_checksum_new( G_CHECKSUM_SHA1 );
+
+	header[0] = basis;
+	header[1] = n;
+	g_checksum_update( checksum, (guchar *) header, sizeof( header ) );
+	g_checksum_update( checksum, (guchar *) lights, 
+		3 * n * sizeof( double ) );
+
+	key = g_strdup( g_checksum_get_string( checksum ) );
+	g_checksum_free( checksum );
+
+	return( key );
+}
+
+/* The hash of a tiled fit: @key is pinv_cache_key() of the light positions,
+ * @geometry is @n numbers describing the object plane and the tiles. Free 
+ * the result with g_free().
+ */
+char *
+pinv_cache_key_tiled( const char *key, int n, const double *geometry )
+{
+	GChecksum *checksum;
+	char *tiled;
+
+	checksum = g_checksum_new( G_CHECKSUM_SHA1 );
+
+	g_checksum_update( checksum, (guchar *) "tiled", 5 );
+	g_checksum_update( checksum, (guchar *) key, strlen( key ) );
+	g_checksum_update( checksum, (guchar *) geometry, 
+		n * sizeof( double ) );
+
+	tiled = g_strdup( g_checksum_get_string( checksum ) );
+	g_checksum_free( checksum );
+
+	return( tiled );
+}
+
+static char *
+pinv_cache_filename( const char *key )
+{
+	char *name;
+	char *filename;
+
+	name = g_strdup_printf( "pinv-%s", key );
+	filename = g_build_filename( g_get_user_cache_dir(), 
+		"ptmfit", name, NULL );
+	g_free( name );
+
+	return( filename );
+}
+
+static PinvCacheEntry *
+pinv_cache_entry_load( const char *key, int m, int n )
+{
+	char *filename;
+	PinvCacheEntry *entry;
+	PinvCacheHeader *header;
+
+	filename = pinv_cache_filename( key );
+	entry = g_new( PinvCacheEntry, 1 );
+	if( !g_file_get_contents( filename, 
+		&entry->data, &entry->length, NULL ) ) {
+		g_free( entry );
+		g_free( filename );
+		return( NULL );
+	}
+
+#ifdef DEBUG
+	printf( "pinv_cache_entry_load: loaded \"%s\"\n", filename );
+#endif /*DEBUG*/
+
+	g_free( filename );
+
+	/* Sanity-check, since a truncated or foreign file would give a
+	 * garbage fit.
+	 */
+	header = (PinvCacheHeader *) entry->data;
+	if( entry->length != pinv_cache_length( m, n ) ||
+		memcmp( header->magic, PINV_CACHE_MAGIC, 8 ) != 0 ||
+		header->m != m ||
+		header->n != n ) {
+		pinv_cache_entry_free( entry );
+		return( NULL );
+	}
+
+	return( entry );
+}
+
+/* Look up the pseudo-inverse for @key, first in memory, then on disc. The
+ * caller gives the size it expects. @pinv is m x n, row-major, @sv is m
+ * singular values. Return 0 on a hit, -1 on a miss.
+ */
+int
+pinv_cache_get( const char *key, int m, int n, 
+	double *pinv, double *sv, double *cond )
+{
+	PinvCacheEntry *entry;
+	double *p;
+
+	g_mutex_lock( &pinv_cache_lock );
+
+	if( pinv_cache_table &&
+		(entry = g_hash_table_lookup( pinv_cache_table, key )) )
+		entry->used = ++pinv_cache_clock;
+	else if( (entry = pinv_cache_entry_load( key, m, n )) ) 
+		pinv_cache_insert( key, entry );
+
+	if( !entry ||
+		entry->length != pinv_cache_length( m, n ) ) {
+		g_mutex_unlock( &pinv_cache_lock );
+		return( -1 );
+	}
+
+	p = (double *) (entry->data + sizeof( PinvCacheHeader ));
+	*cond = p[0];
+	memcpy( sv, p + 1, m * sizeof( double ) );
+	memcpy( pinv, p + 1 + m, (gsize) m * n * sizeof( double ) );
+
+	g_mutex_unlock( &pinv_cache_lock );
+
+	return( 0 );
+}
+
+/* Add a pseudo-inverse to the cache. It always goes into memory; if we can't
+ * write the disc copy we set an error and return -1, but the fit can carry
+ * on. g_file_set_contents() writes to a temp file and renames, so other 
+ * processes never see half an entry.
+ */
+int
+pinv_cache_put( const char *key, int m, int n, 
+	const double *pinv, const double *sv, double cond )
+{
+	PinvCacheEntry *entry;
+	PinvCacheHeader *header;
+	double *p;
+	char *filename;
+	char *dirname;
+	GError *error = NULL;
+
+	entry = g_new( PinvCacheEntry, 1 );
+	entry->length = pinv_cache_length( m, n );
+	entry->data = g_malloc0( entry->length );
+
+	header = (PinvCacheHeader *) entry->data;
+	memcpy( header->magic, PINV_CACHE_MAGIC, 8 );
+	header->m = m;
+	header->n = n;
+	p = (double *) (entry->data + sizeof( PinvCacheHeader ));
+	p[0] = cond;
+	memcpy( p + 1, sv, m * sizeof( double ) );
+	memcpy( p + 1 + m, pinv, (gsize) m * n * sizeof( double ) );
+
+	g_mutex_lock( &pinv_cache_lock );
+
+	pinv_cache_insert( key, entry );
+
+	filename = pinv_cache_filename( key );
+	dirname = g_path_get_dirname( filename );
+	if( g_mkdir_with_parents( dirname, 0700 ) ||
+		!g_file_set_contents( filename, 
+			entry->data, entry->length, &error ) ) {
+		vips_error( "pinv_cache", 
+			_( "unable to write \"%s\"" ), filename );
+		if( error )
+			g_error_free( error );
+		g_free( dirname );
+		g_free( filename );
+		g_mutex_unlock( &pinv_cache_lock );
+		return( -1 );
+	}
+	g_free( dirname );
+	g_free( filename );
+
+	g_mutex_unlock( &pinv_cache_lock );
+
+	return( 0 );
+}
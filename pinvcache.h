@@ -0,0 +1,25 @@
+#ifndef PINVCACHE_H
+#define PINVCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+char *pinv_cache_key( int basis, int n, const double *lights );
+char *pinv_cache_key_tiled( const char *key, int n, const double *geometry );
+int pinv_cache_get( const char *key, int m, int n, 
+	double *pinv, double *sv, double *cond );
+int pinv_cache_put( const char *key, int m, int n, 
+	const double *pinv, const double *sv, double cond );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*PINVCACHE_H*/
@@ -0,0 +1,447 @@
+/* per-row fitting kernels for compute_polys
+ *
+ * The scalar kernel here is the reference: it's the original per-pixel
+ * double code from compute_polys_gen. The SIMD kernels in
+ * polykernel_sse4.c, polykernel_avx2.c and polykernel_avx512.c must match
+ * it to float precision.
+ *
+ * The fixed-point kernels do the luminance and matrix multiply in int16 with
+ * int32 accumulators. polykernel_scalar_fixed is their reference, and 
+ * compute_polys_range can measure them against the double kernel.
+ *
+ * The SIMD kernels are inline functions of the matrix size, and each file 
+ * also makes versions with the size fixed for our common bases and domes, see
+ * POLYKERNEL_FOR_SIZES. polykernel_specialise() picks one.
+ *
+ * The registry lets us pick a kernel at startup, either the fastest this
+ * CPU supports or one named with -kernel, so a single binary runs well
+ * everywhere and kernels can be compared on one machine. Each entry also
+ * has the robust and RGB kernels built for the same instruction set, see
+ * polykernel_robust.c and polykernel_rgb.c.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+/* Make a PolyMatrix from @m rows of a vips matrix image, starting at @top, 
+ * allocating on @parent.
+ */
+int
+polymatrix_init_area( PolyMatrix *M, VipsObject *parent, 
+	VipsImage *matrix, int top, int m )
+{
+	int i, j;
+
+	M->m = m;
+	M->n = matrix->Xsize;
+	M->basis = NULL;
+	M->outer = NULL;
+	M->gram = NULL;
+	M->shadow = 0.0;
+	M->highlight = 255.0;
+	M->rounds = 0;
+	if( !(M->coeff = VIPS_ARRAY( parent, M->m * M->n, double )) ||
+		!(M->coeffT = VIPS_ARRAY( parent, M->m * M->n, float )) )
+		return( -1 );
+
+	for( j = 0; j < M->m; j++ )
+		for( i = 0; i < M->n; i++ ) {
+			double v = *VIPS_MATRIX( matrix, i, top + j );
+
+			M->coeff[j * M->n + i] = v;
+			M->coeffT[i * M->m + j] = v;
+		}
+
+	if( !(M->coeffS = VIPS_ARRAY( parent, 
+			(M->n + 1) / 2 * M->m * 2, gint16 )) ||
+		!(M->scaleS = VIPS_ARRAY( parent, M->m, double )) )
+		return( -1 );
+	memset( M->coeffS, 0, (M->n + 1) / 2 * M->m * 2 * sizeof( gint16 ) );
+
+	for( j = 0; j < M->m; j++ ) {
+		double *row = M->coeff + j * M->n;
+		double max;
+		double sum;
+		double s;
+
+		max = 0.0;
+		sum = 0.0;
+		for( i = 0; i < M->n; i++ ) {
+			max = VIPS_MAX( max, fabs( row[i] ) );
+			sum += fabs( row[i] );
+		}
+
+		/* Each element must fit in an int16, and the sum of 
+		 * lum * coeff over all the images must fit in an int32 even 
+		 * when every lum is at its max. Leave room for rounding.
+		 */
+		s = 1.0;
+		if( max > 0.0 ) {
+			s = 32767.0 / max;
+			s = VIPS_MIN( s, 
+				(G_MAXINT / POLYKERNEL_FIXED_LUM_MAX - M->n) / 
+					sum );
+		}
+		M->scaleS[j] = s;
+
+		for( i = 0; i < M->n; i++ )
+			M->coeffS[((i / 2) * M->m + j) * 2 + (i & 1)] = 
+				VIPS_RINT( row[i] * s );
+	}
+
+	return( 0 );
+}
+
+/* Make a PolyMatrix from a whole vips matrix image.
+ */
+int
+polymatrix_init( PolyMatrix *M, VipsObject *parent, VipsImage *matrix )
+{
+	return( polymatrix_init_area( M, parent, matrix, 0, matrix->Ysize ) );
+}
+
+/* Fit pixels x to the end of the row.
+ */
+void
+polykernel_scalar_tail( const PolyMatrix *M, PolyRow *row, int x )
+{
+	int m = M->m;
+	int n = M->n;
+	int qstride = (row->rgb ? 3 : 0) + m;
+	double * restrict R = row->R;
+	float * restrict q = row->q + x * qstride;
+
+	int i, j;
+
+	for( ; x < row->width; x++ ) {
+		int offset = x * row->stride;
+		double maxy;
+
+		/* Find normalised luminance for the input images.
+		 */
+
+		maxy = 0;
+		for( i = 0; i < n; i++ ) {
+			VipsPel * restrict p = row->p[i] + offset;
+
+			R[i] = 0.2125 * p[0] +
+				0.7154 * p[1] +
+				0.0721 * p[2];
+			R[i] /= 255.0;
+
+			if( R[i] > maxy )
+				maxy = R[i];
+		}
+
+		if( maxy != 0 )
+			for( i = 0; i < n; i++ )
+				R[i] /= maxy;
+
+		/* Find average colour component of inputs and write
+		 * normalised RGB to the first three bands.
+		 */
+
+		if( row->rgb ) {
+			double adoty[3];
+			double ydoty;
+
+			for( j = 0; j < 3; j++ )
+				adoty[j] = 0.0;
+			ydoty = 0.0;
+			for( i = 0; i < n; i++ ) {
+				VipsPel * restrict p = row->p[i] + offset;
+
+				for( j = 0; j < 3; j++ )
+					adoty[j] += p[j] / 255.0 * R[i];
+				ydoty += R[i] * R[i];
+			}
+
+			for( j = 0; j < 3; j++ ) {
+				double av;
+
+				if( ydoty != 0 ) {
+					av = adoty[j] / ydoty;
+
+					if( av < 0.0 )
+						av = 0.0;
+					else if( av > 1.0 )
+						av = 1.0;
+				}
+				else
+					av = 0.0;
+
+				q[j] = av * 255.0;
+			}
+
+			q += 3;
+		}
+
+		/* Put the luminance signal through the matrix to get
+		 * the poly coefficients.
+		 */
+
+		for( j = 0; j < m; j++ ) {
+			double * restrict coeff = M->coeff + j * n;
+			double sum;
+
+			sum = 0.0;
+			for( i = 0; i < n; i++ )
+				sum += R[i] * coeff[i];
+
+			q[j] = 255.0 * sum;
+		}
+
+		q += m;
+	}
+}
+
+void
+polykernel_scalar( const PolyMatrix *M, PolyRow *row )
+{
+	polykernel_scalar_tail( M, row, 0 );
+}
+
+/* Fixed-point fit of pixels x to the end of the row. This is the reference
+ * for the SIMD fixed-point kernels and must match them exactly for the
+ * coefficients.
+ */
+void
+polykernel_scalar_fixed_tail( const PolyMatrix *M, PolyRow *row, int x )
+{
+	int m = M->m;
+	int n = M->n;
+	int qstride = (row->rgb ? 3 : 0) + m;
+	float * restrict q = row->q + x * qstride;
+
+	int i, j;
+
+	for( ; x < row->width; x++ ) {
+		int offset = x * row->stride;
+
+		gint32 acc[POLYKERNEL_MAX_COEFF];
+		gint32 maxl;
+		float sum[3];
+		float ss;
+		float scale;
+
+		for( j = 0; j < m; j++ )
+			acc[j] = 0;
+		for( j = 0; j < 3; j++ )
+			sum[j] = 0.0;
+		maxl = 0;
+		ss = 0.0;
+
+		for( i = 0; i < n; i++ ) {
+			VipsPel * restrict p = row->p[i] + offset;
+			gint16 * restrict coeff = M->coeffS + (i / 2) * m * 2;
+			gint32 lum = POLYKERNEL_FIXED_LUM( p[0], p[1], p[2] );
+
+			maxl = VIPS_MAX( maxl, lum );
+
+			if( row->rgb ) {
+				ss += (float) lum * lum;
+				for( j = 0; j < 3; j++ )
+					sum[j] += (float) p[j] * lum;
+			}
+
+			for( j = 0; j < m; j++ )
+				acc[j] += lum * coeff[j * 2 + (i & 1)];
+		}
+
+		if( row->rgb ) {
+			float f = ss > 0 ? maxl / ss : 0;
+
+			for( j = 0; j < 3; j++ )
+				q[j] = VIPS_CLIP( 0, sum[j] * f, 255 );
+
+			q += 3;
+		}
+
+		scale = maxl > 0 ? 255.0f / maxl : 0;
+		for( j = 0; j < m; j++ )
+			q[j] = (float) acc[j] * 
+				(float) (1.0 / M->scaleS[j]) * scale;
+
+		q += m;
+	}
+}
+
+void
+polykernel_scalar_fixed( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m > POLYKERNEL_MAX_COEFF )
+		polykernel_scalar( M, row );
+	else
+		polykernel_scalar_fixed_tail( M, row, 0 );
+}
+
+#ifdef POLYKERNEL_X86
+static gboolean
+polykernel_has_sse4( void )
+{
+	return( __builtin_cpu_supports( "sse4.1" ) );
+}
+
+static gboolean
+polykernel_has_avx2( void )
+{
+	return( __builtin_cpu_supports( "avx2" ) &&
+		__builtin_cpu_supports( "fma" ) );
+}
+
+static gboolean
+polykernel_has_avx512( void )
+{
+	return( __builtin_cpu_supports( "avx512f" ) &&
+		__builtin_cpu_supports( "avx512bw" ) );
+}
+#endif /*POLYKERNEL_X86*/
+
+/* All the kernels we have, fastest first, floating point then fixed point.
+ * A NULL supported() means any CPU can run it.
+ */
+static PolyKernel polykernel_registry[] = {
+#ifdef POLYKERNEL_X86
+	{ "avx512", polykernel_avx512, polykernel_has_avx512, FALSE,
+		polykernel_avx512_specialise,
+		polykernel_robust_avx512, polykernel_rgb_avx512 },
+	{ "avx2", polykernel_avx2, polykernel_has_avx2, FALSE,
+		polykernel_avx2_specialise,
+		polykernel_robust_avx2, polykernel_rgb_avx2 },
+	{ "sse4", polykernel_sse4, polykernel_has_sse4, FALSE,
+		polykernel_sse4_specialise,
+		polykernel_robust, polykernel_rgb },
+#endif /*POLYKERNEL_X86*/
+	{ "scalar", polykernel_scalar, NULL, FALSE, NULL,
+		polykernel_robust, polykernel_rgb },
+#ifdef POLYKERNEL_X86
+	{ "avx2-fixed", polykernel_avx2_fixed, polykernel_has_avx2, TRUE,
+		polykernel_avx2_fixed_specialise,
+		polykernel_robust_avx2, polykernel_rgb_avx2 },
+#endif /*POLYKERNEL_X86*/
+	{ "scalar-fixed", polykernel_scalar_fixed, NULL, TRUE, NULL,
+		polykernel_robust, polykernel_rgb }
+};
+
+/* The kernel we've picked.
+ */
+static PolyKernel *polykernel_selected = NULL;
+
+static gboolean
+polykernel_supported( PolyKernel *kernel )
+{
+#ifdef POLYKERNEL_X86
+	__builtin_cpu_init();
+#endif /*POLYKERNEL_X86*/
+
+	return( !kernel->supported ||
+		kernel->supported() );
+}
+
+/* Select a kernel by name. NULL or "auto" picks the fastest floating 
+ * point kernel this CPU can run, "fixed" the fastest fixed-point one. Call 
+ * this once at startup, before any fitting.
+ */
+int
+polykernel_select( const char *name )
+{
+	int i;
+
+	for( i = 0; i < VIPS_NUMBER( polykernel_registry ); i++ ) {
+		PolyKernel *kernel = &polykernel_registry[i];
+
+		if( !name ||
+			strcmp( name, "auto" ) == 0 ||
+			strcmp( name, "fixed" ) == 0 ) {
+			gboolean fixed = name && strcmp( name, "fixed" ) == 0;
+
+			if( kernel->fixed == fixed &&
+				polykernel_supported( kernel ) ) {
+				polykernel_selected = kernel;
+				return( 0 );
+			}
+		}
+		else if( strcmp( name, kernel->name ) == 0 ) {
+			if( !polykernel_supported( kernel ) ) {
+				vips_error( "polykernel",
+					"kernel \"%s\" not supported "
+					"on this CPU", name );
+				return( -1 );
+			}
+
+			polykernel_selected = kernel;
+			return( 0 );
+		}
+	}
+
+	vips_error( "polykernel", "unknown kernel \"%s\"", name );
+
+	return( -1 );
+}
+
+/* Get the selected kernel, picking the fastest if there's been no
+ * selection.
+ */
+PolyKernel *
+polykernel_get( void )
+{
+	if( !polykernel_selected )
+		(void) polykernel_select( NULL );
+
+	return( polykernel_selected );
+}
+
+/* Search a table of specialised kernels, falling back to the generic one.
+ */
+PolyKernelFn
+polykernel_find_size( const PolyKernelSize *sizes, int n_sizes,
+	int m, int n, PolyKernelFn generic )
+{
+	int i;
+
+	for( i = 0; i < n_sizes; i++ )
+		if( sizes[i].m == m &&
+			sizes[i].n == n )
+			return( sizes[i].fn );
+
+	return( generic );
+}
+
+/* The best version of a kernel for a matrix. Call this once when you 
+ * build, not per row.
+ */
+PolyKernelFn
+polykernel_specialise( PolyKernel *kernel, const PolyMatrix *M )
+{
+	if( kernel->specialise )
+		return( kernel->specialise( M->m, M->n ) );
+
+	return( kernel->fn );
+}
+
+/* Kernel names, for usage messages.
+ */
+int
+polykernel_n_kernels( void )
+{
+	return( VIPS_NUMBER( polykernel_registry ) );
+}
+
+const char *
+polykernel_nth_name( int i )
+{
+	return( polykernel_registry[i].name );
+}
@@ -0,0 +1,177 @@
+#ifndef POLYKERNEL_H
+#define POLYKERNEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+/* The SIMD kernels need gcc or clang on x86.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define POLYKERNEL_X86
+#endif
+
+/* The most coefficients the SIMD kernels handle. Larger fits use the scalar
+ * kernel.
+ */
+#define POLYKERNEL_MAX_COEFF (16)
+
+/* The pseudo-inverse, ready for the kernels. There are m rows, one for each
+ * polynomial coefficient, and n columns, one for each input image.
+ */
+typedef struct _PolyMatrix {
+	int m;
+	int n;
+
+	/* As doubles, m x n, for the scalar reference kernel.
+	 */
+	double *coeff;
+
+	/* As floats and transposed, n x m, so the SIMD kernels can walk the
+	 * images and broadcast each column.
+	 */
+	float *coeffT;
+
+	/* For the fixed-point kernels: each row scaled by scaleS[j] and
+	 * rounded to int16. Images are taken in pairs for pmaddwd, so this
+	 * is (n + 1) / 2 x m x 2, with column n zero if n is odd.
+	 */
+	gint16 *coeffS;
+	double *scaleS;
+
+	/* For polykernel_robust(), see polymatrix_robust_init(): the basis, 
+	 * n x m, the outer product of each row of it, n x m(m + 1)/2, their
+	 * sum, and the weighting. NULL for a plain fit.
+	 */
+	float *basis;
+	float *outer;
+	float *gram;
+	float shadow;
+	float highlight;
+	int rounds;
+} PolyMatrix;
+
+/* Luminance weights for the fixed-point kernels, scaled by 2^15. Luminance
+ * is then rounded to lum * 128, so it fits in an int16.
+ */
+#define POLYKERNEL_FIXED_WR (6963)
+#define POLYKERNEL_FIXED_WG (23442)
+#define POLYKERNEL_FIXED_WB (2363)
+#define POLYKERNEL_FIXED_LUM(R, G, B) \
+	(((R) * POLYKERNEL_FIXED_WR + \
+	  (G) * POLYKERNEL_FIXED_WG + \
+	  (B) * POLYKERNEL_FIXED_WB + 128) >> 8)
+#define POLYKERNEL_FIXED_LUM_MAX (32640)
+
+/* A row of pixels to fit.
+ */
+typedef struct _PolyRow {
+	/* n pointers to the first pixel of the row in each input image,
+	 * and the number of bytes between pixels.
+	 */
+	VipsPel **p;
+	int stride;
+
+	int width;
+
+	/* Output. With rgb set we write the 3 band average colour first,
+	 * so each pixel is 3 + m floats, otherwise it's just m floats.
+	 */
+	float *q;
+	gboolean rgb;
+
+	/* polymatrix_scratch() doubles of scratch for the scalar and robust
+	 * kernels.
+	 */
+	double *R;
+} PolyRow;
+
+typedef void (*PolyKernelFn)( const PolyMatrix *M, PolyRow *row );
+
+/* The matrix sizes we make specialised kernels for: the univariate and 
+ * bivariate bases against our common dome light counts. Use as
+ * POLYKERNEL_FOR_SIZES( F ) to expand F( m, n ) for each one.
+ */
+#define POLYKERNEL_FOR_SIZES( F ) \
+	F( 3, 24 ) F( 3, 36 ) F( 3, 48 ) F( 3, 64 ) F( 3, 76 ) \
+	F( 6, 24 ) F( 6, 36 ) F( 6, 48 ) F( 6, 64 ) F( 6, 76 ) 
+
+/* A kernel specialised for one matrix size.
+ */
+typedef struct _PolyKernelSize {
+	int m;
+	int n;
+	PolyKernelFn fn;
+} PolyKernelSize;
+
+/* An entry in the kernel registry.
+ */
+typedef struct _PolyKernel {
+	const char *name;
+	PolyKernelFn fn;
+
+	/* Test if this CPU can run the kernel, NULL for any CPU.
+	 */
+	gboolean (*supported)( void );
+
+	/* A fixed-point kernel. These are never picked automatically.
+	 */
+	gboolean fixed;
+
+	/* Find a version of fn specialised for this matrix size, NULL if
+	 * there are none.
+	 */
+	PolyKernelFn (*specialise)( int m, int n );
+
+	/* The robust and RGB kernels built for the same CPU.
+	 */
+	PolyKernelFn robust;
+	PolyKernelFn rgb;
+} PolyKernel;
+
+int polymatrix_init_area( PolyMatrix *M, VipsObject *parent, 
+	VipsImage *matrix, int top, int m );
+int polymatrix_init( PolyMatrix *M, VipsObject *parent, VipsImage *matrix );
+int polymatrix_robust_init( PolyMatrix *M, VipsObject *parent, 
+	VipsImage *basis, double shadow, double highlight, int rounds );
+int polymatrix_scratch( const PolyMatrix *M );
+
+void polykernel_scalar( const PolyMatrix *M, PolyRow *row );
+void polykernel_scalar_tail( const PolyMatrix *M, PolyRow *row, int x );
+void polykernel_scalar_fixed( const PolyMatrix *M, PolyRow *row );
+void polykernel_scalar_fixed_tail( const PolyMatrix *M, PolyRow *row, int x );
+
+void polykernel_robust( const PolyMatrix *M, PolyRow *row );
+void polykernel_rgb( const PolyMatrix *M, PolyRow *row );
+
+PolyKernelFn polykernel_find_size( const PolyKernelSize *sizes, int n_sizes,
+	int m, int n, PolyKernelFn generic );
+
+#ifdef POLYKERNEL_X86
+void polykernel_sse4( const PolyMatrix *M, PolyRow *row );
+PolyKernelFn polykernel_sse4_specialise( int m, int n );
+void polykernel_avx2( const PolyMatrix *M, PolyRow *row );
+PolyKernelFn polykernel_avx2_specialise( int m, int n );
+void polykernel_avx2_fixed( const PolyMatrix *M, PolyRow *row );
+PolyKernelFn polykernel_avx2_fixed_specialise( int m, int n );
+void polykernel_avx512( const PolyMatrix *M, PolyRow *row );
+PolyKernelFn polykernel_avx512_specialise( int m, int n );
+void polykernel_robust_avx2( const PolyMatrix *M, PolyRow *row );
+void polykernel_robust_avx512( const PolyMatrix *M, PolyRow *row );
+void polykernel_rgb_avx2( const PolyMatrix *M, PolyRow *row );
+void polykernel_rgb_avx512( const PolyMatrix *M, PolyRow *row );
+#endif /*POLYKERNEL_X86*/
+
+int polykernel_select( const char *name );
+PolyKernel *polykernel_get( void );
+PolyKernelFn polykernel_specialise( PolyKernel *kernel, const PolyMatrix *M );
+int polykernel_n_kernels( void );
+const char *polykernel_nth_name( int i );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*POLYKERNEL_H*/
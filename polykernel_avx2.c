@@ -0,0 +1,431 @@
+/* AVX2 fitting kernel for compute_polys
+ *
+ * We fit 8 pixels at once in float32 lanes. Rather than normalise the
+ * luminance by the brightest input first, as the scalar kernel does, we
+ * make a single pass over the input images and accumulate unnormalised
+ * sums, then divide by the max at the end. The maths is the same:
+ *
+ * 	coeff[j] = 255 * sum_i(M[j][i] * lum[i]) / max(lum)
+ * 	rgb[c] = max(lum) * sum_i(p[i][c] * lum[i]) / sum_i(lum[i]^2)
+ *
+ * with lum in 0 - 255.
+ *
+ * There's also a fixed-point variant which does the luminance and the 
+ * matrix multiply in int16 with int32 accumulators.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+#ifdef POLYKERNEL_X86
+
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target( "avx2,fma" )))
+#define AVX2_INLINE static inline __attribute__((always_inline)) AVX2_TARGET
+
+/* pshufb masks to pull R, G and B for 8 pixels out of 24 bytes, loaded
+ * as 16 bytes and then 8 bytes.
+ */
+static const gint8 avx2_deinterleave[3][2][16]
+	__attribute__((aligned( 16 ))) = {
+	{
+		{  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1,  2,  5, -1, -1, -1, -1, -1, -1, -1, -1 }
+	},
+	{
+		{  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  0,  3,  6, -1, -1, -1, -1, -1, -1, -1, -1 }
+	},
+	{
+		{  2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  1,  4,  7, -1, -1, -1, -1, -1, -1, -1, -1 }
+	}
+};
+
+/* Load 8 pixels as three int32 vectors. Packed RGB is deinterleaved with
+ * shuffles, anything else is gathered. Gathers read 4 bytes per pixel, so
+ * the caller must make sure there's a byte to spare after the last one.
+ */
+AVX2_INLINE void
+avx2_load_rgb_epi32( const VipsPel *p, int stride,
+	__m128i mask[3][2], __m256i index, __m256i rgb[3] )
+{
+	int c;
+
+	if( stride == 3 ) {
+		__m128i lo = _mm_loadu_si128( (const __m128i *) p );
+		__m128i hi = _mm_loadl_epi64( (const __m128i *) (p + 16) );
+
+		for( c = 0; c < 3; c++ ) {
+			__m128i v = _mm_or_si128(
+				_mm_shuffle_epi8( lo, mask[c][0] ),
+				_mm_shuffle_epi8( hi, mask[c][1] ) );
+
+			rgb[c] = _mm256_cvtepu8_epi32( v );
+		}
+	}
+	else {
+		__m256i v = _mm256_i32gather_epi32( (const int *) p, index, 1 );
+		__m256i ff = _mm256_set1_epi32( 0xff );
+
+		for( c = 0; c < 3; c++ )
+			rgb[c] = _mm256_and_si256(
+				_mm256_srli_epi32( v, 8 * c ), ff );
+	}
+}
+
+/* Load 8 pixels as three float vectors.
+ */
+AVX2_INLINE void
+avx2_load_rgb( const VipsPel *p, int stride,
+	__m128i mask[3][2], __m256i index, __m256 rgb[3] )
+{
+	__m256i v[3];
+	int c;
+
+	avx2_load_rgb_epi32( p, stride, mask, index, v );
+	for( c = 0; c < 3; c++ )
+		rgb[c] = _mm256_cvtepi32_ps( v[c] );
+}
+
+/* Fit a row. m and n are the matrix size: pass constants and the compiler
+ * can unroll the loops over them.
+ */
+AVX2_INLINE void
+avx2_fit( const PolyMatrix *M, PolyRow *row, const int m, const int n )
+{
+	const int qstride = (row->rgb ? 3 : 0) + m;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 c255 = _mm256_set1_ps( 255.0 );
+	const __m256 wr = _mm256_set1_ps( 0.2125 );
+	const __m256 wg = _mm256_set1_ps( 0.7154 );
+	const __m256 wb = _mm256_set1_ps( 0.0721 );
+	const __m256i index = _mm256_mullo_epi32(
+		_mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ),
+		_mm256_set1_epi32( row->stride ) );
+
+	/* Gathers read one byte past each pixel, so stop one pixel early.
+	 */
+	const int last = row->width - (row->stride == 3 ? 8 : 9);
+
+	__m128i mask[3][2];
+	int x, i, j, k, c;
+
+	for( c = 0; c < 3; c++ )
+		for( k = 0; k < 2; k++ )
+			mask[c][k] = _mm_load_si128(
+				(const __m128i *) avx2_deinterleave[c][k] );
+
+	for( x = 0; x <= last; x += 8 ) {
+		const int offset = x * row->stride;
+		float * restrict q = row->q + x * qstride;
+
+		__m256 acc[POLYKERNEL_MAX_COEFF];
+		__m256 sum[3];
+		__m256 maxl;
+		__m256 ss;
+		float out[3 + POLYKERNEL_MAX_COEFF][8]
+			__attribute__((aligned( 32 )));
+		__m256 scale;
+
+		for( j = 0; j < m; j++ )
+			acc[j] = zero;
+		for( c = 0; c < 3; c++ )
+			sum[c] = zero;
+		maxl = zero;
+		ss = zero;
+
+		for( i = 0; i < n; i++ ) {
+			const float * restrict coeff = M->coeffT + i * m;
+
+			__m256 rgb[3];
+			__m256 lum;
+
+			avx2_load_rgb( row->p[i] + offset, row->stride,
+				mask, index, rgb );
+
+			lum = _mm256_fmadd_ps( rgb[2], wb,
+				_mm256_fmadd_ps( rgb[1], wg,
+					_mm256_mul_ps( rgb[0], wr ) ) );
+			maxl = _mm256_max_ps( maxl, lum );
+
+			if( row->rgb ) {
+				ss = _mm256_fmadd_ps( lum, lum, ss );
+				for( c = 0; c < 3; c++ )
+					sum[c] = _mm256_fmadd_ps( rgb[c], lum,
+						sum[c] );
+			}
+
+			for( j = 0; j < m; j++ )
+				acc[j] = _mm256_fmadd_ps( lum,
+					_mm256_broadcast_ss( coeff + j ),
+					acc[j] );
+		}
+
+		/* Black pixels (max == 0) come out as zero.
+		 */
+		k = 0;
+		if( row->rgb ) {
+			__m256 f = _mm256_and_ps(
+				_mm256_cmp_ps( ss, zero, _CMP_GT_OQ ),
+				_mm256_div_ps( maxl, ss ) );
+
+			for( c = 0; c < 3; c++ ) {
+				__m256 v = _mm256_mul_ps( sum[c], f );
+
+				v = _mm256_min_ps( _mm256_max_ps( v, zero ), c255 );
+				_mm256_store_ps( out[k++], v );
+			}
+		}
+
+		scale = _mm256_and_ps(
+			_mm256_cmp_ps( maxl, zero, _CMP_GT_OQ ),
+			_mm256_div_ps( c255, maxl ) );
+		for( j = 0; j < m; j++ )
+			_mm256_store_ps( out[k++],
+				_mm256_mul_ps( acc[j], scale ) );
+
+		/* And back to band-interleaved.
+		 */
+		for( i = 0; i < 8; i++ )
+			for( k = 0; k < qstride; k++ )
+				q[i * qstride + k] = out[k][i];
+	}
+
+	polykernel_scalar_tail( M, row, x );
+}
+
+/* Fixed-point luminance for 8 pixels, see POLYKERNEL_FIXED_LUM. R and G
+ * share a pmaddwd, B takes another.
+ */
+AVX2_INLINE __m256i
+avx2_fixed_lum( __m256i rgb[3], __m256i wrg, __m256i wb, __m256i round )
+{
+	__m256i rg = _mm256_or_si256( rgb[0], _mm256_slli_epi32( rgb[1], 16 ) );
+
+	return( _mm256_srai_epi32(
+		_mm256_add_epi32(
+			_mm256_add_epi32(
+				_mm256_madd_epi16( rg, wrg ),
+				_mm256_madd_epi16( rgb[2], wb ) ),
+			round ),
+		8 ) );
+}
+
+/* Fit a row in fixed point. Luminance is int16, the matrix rows are
+ * pre-scaled to int16, and we take the images in pairs so one pmaddwd 
+ * does two multiply-adds per pixel into an int32 accumulator. polymatrix_init
+ * picks the scale so the accumulators can't overflow. We only go to float 
+ * at the end, to undo the scale and normalise by the max.
+ *
+ * The RGB average is a small part of the work and needs the range, so it 
+ * stays in float. 
+ */
+AVX2_INLINE void
+avx2_fit_fixed( const PolyMatrix *M, PolyRow *row, const int m, const int n )
+{
+	const int qstride = (row->rgb ? 3 : 0) + m;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 c255 = _mm256_set1_ps( 255.0 );
+	const __m256i zeroi = _mm256_setzero_si256();
+	const __m256i wrg = _mm256_set1_epi32( 
+		POLYKERNEL_FIXED_WR | (POLYKERNEL_FIXED_WG << 16) );
+	const __m256i wb = _mm256_set1_epi32( POLYKERNEL_FIXED_WB );
+	const __m256i round = _mm256_set1_epi32( 128 );
+	const __m256i index = _mm256_mullo_epi32(
+		_mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ),
+		_mm256_set1_epi32( row->stride ) );
+	const int last = row->width - (row->stride == 3 ? 8 : 9);
+
+	__m128i mask[3][2];
+	__m256 unscale[POLYKERNEL_MAX_COEFF];
+	int x, i, j, k, c;
+
+	for( c = 0; c < 3; c++ )
+		for( k = 0; k < 2; k++ )
+			mask[c][k] = _mm_load_si128(
+				(const __m128i *) avx2_deinterleave[c][k] );
+	for( j = 0; j < m; j++ )
+		unscale[j] = _mm256_set1_ps( (float) (1.0 / M->scaleS[j]) );
+
+	for( x = 0; x <= last; x += 8 ) {
+		const int offset = x * row->stride;
+		float * restrict q = row->q + x * qstride;
+
+		__m256i acc[POLYKERNEL_MAX_COEFF];
+		__m256 sum[3];
+		__m256i maxl;
+		__m256 ss;
+		float out[3 + POLYKERNEL_MAX_COEFF][8]
+			__attribute__((aligned( 32 )));
+		__m256 maxf;
+		__m256 scale;
+
+		for( j = 0; j < m; j++ )
+			acc[j] = zeroi;
+		for( c = 0; c < 3; c++ )
+			sum[c] = zero;
+		maxl = zeroi;
+		ss = zero;
+
+		for( i = 0; i < n; i += 2 ) {
+			const gint16 * restrict coeff = M->coeffS + i * m;
+
+			__m256i lum[2];
+			__m256i pair;
+
+			for( k = 0; k < 2; k++ ) {
+				__m256i rgb[3];
+
+				if( i + k >= n ) {
+					lum[k] = zeroi;
+					break;
+				}
+
+				avx2_load_rgb_epi32( row->p[i + k] + offset, 
+					row->stride, mask, index, rgb );
+				lum[k] = avx2_fixed_lum( rgb, wrg, wb, round );
+				maxl = _mm256_max_epi32( maxl, lum[k] );
+
+				if( row->rgb ) {
+					__m256 lumf = _mm256_cvtepi32_ps( lum[k] );
+
+					ss = _mm256_fmadd_ps( lumf, lumf, ss );
+					for( c = 0; c < 3; c++ )
+						sum[c] = _mm256_fmadd_ps( 
+							_mm256_cvtepi32_ps( rgb[c] ),
+							lumf, sum[c] );
+				}
+			}
+
+			/* Both lums are positive and fit in 15 bits.
+			 */
+			pair = _mm256_or_si256( lum[0], 
+				_mm256_slli_epi32( lum[1], 16 ) );
+
+			for( j = 0; j < m; j++ ) {
+				gint32 c2;
+
+				memcpy( &c2, coeff + j * 2, 4 );
+				acc[j] = _mm256_add_epi32( acc[j], 
+					_mm256_madd_epi16( pair, 
+						_mm256_set1_epi32( c2 ) ) );
+			}
+		}
+
+		maxf = _mm256_cvtepi32_ps( maxl );
+
+		k = 0;
+		if( row->rgb ) {
+			__m256 f = _mm256_and_ps(
+				_mm256_cmp_ps( ss, zero, _CMP_GT_OQ ),
+				_mm256_div_ps( maxf, ss ) );
+
+			for( c = 0; c < 3; c++ ) {
+				__m256 v = _mm256_mul_ps( sum[c], f );
+
+				v = _mm256_min_ps( _mm256_max_ps( v, zero ), c255 );
+				_mm256_store_ps( out[k++], v );
+			}
+		}
+
+		scale = _mm256_and_ps(
+			_mm256_cmp_ps( maxf, zero, _CMP_GT_OQ ),
+			_mm256_div_ps( c255, maxf ) );
+		for( j = 0; j < m; j++ )
+			_mm256_store_ps( out[k++],
+				_mm256_mul_ps( 
+					_mm256_mul_ps( 
+						_mm256_cvtepi32_ps( acc[j] ), 
+						unscale[j] ),
+					scale ) );
+
+		for( i = 0; i < 8; i++ )
+			for( k = 0; k < qstride; k++ )
+				q[i * qstride + k] = out[k][i];
+	}
+
+	polykernel_scalar_fixed_tail( M, row, x );
+}
+
+AVX2_TARGET void
+polykernel_avx2_fixed( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m > POLYKERNEL_MAX_COEFF )
+		polykernel_scalar( M, row );
+	else
+		avx2_fit_fixed( M, row, M->m, M->n );
+}
+
+AVX2_TARGET void
+polykernel_avx2( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m > POLYKERNEL_MAX_COEFF )
+		polykernel_scalar( M, row );
+	else
+		avx2_fit( M, row, M->m, M->n );
+}
+
+/* Versions of avx2_fit() with the matrix size fixed.
+ */
+#define AVX2_SIZE( M, N ) \
+static AVX2_TARGET void \
+avx2_fit_ ## M ## _ ## N( const PolyMatrix *matrix, PolyRow *row ) \
+{ \
+	avx2_fit( matrix, row, M, N ); \
+}
+
+POLYKERNEL_FOR_SIZES( AVX2_SIZE )
+
+#define AVX2_ENTRY( M, N ) { M, N, avx2_fit_ ## M ## _ ## N },
+
+static const PolyKernelSize avx2_sizes[] = {
+	POLYKERNEL_FOR_SIZES( AVX2_ENTRY )
+};
+
+PolyKernelFn
+polykernel_avx2_specialise( int m, int n )
+{
+	return( polykernel_find_size( avx2_sizes, 
+		VIPS_NUMBER( avx2_sizes ), m, n, polykernel_avx2 ) );
+}
+
+/* Versions of avx2_fit_fixed() with the matrix size fixed.
+ */
+#define AVX2_FIXED_SIZE( M, N ) \
+static AVX2_TARGET void \
+avx2_fit_fixed_ ## M ## _ ## N( const PolyMatrix *matrix, PolyRow *row ) \
+{ \
+	avx2_fit_fixed( matrix, row, M, N ); \
+}
+
+POLYKERNEL_FOR_SIZES( AVX2_FIXED_SIZE )
+
+#define AVX2_FIXED_ENTRY( M, N ) { M, N, avx2_fit_fixed_ ## M ## _ ## N },
+
+static const PolyKernelSize avx2_fixed_sizes[] = {
+	POLYKERNEL_FOR_SIZES( AVX2_FIXED_ENTRY )
+};
+
+PolyKernelFn
+polykernel_avx2_fixed_specialise( int m, int n )
+{
+	return( polykernel_find_size( avx2_fixed_sizes, 
+		VIPS_NUMBER( avx2_fixed_sizes ), m, n, 
+		polykernel_avx2_fixed ) );
+}
+
+#endif /*POLYKERNEL_X86*/
@@ -0,0 +1,215 @@
+/* AVX-512 fitting kernel for compute_polys
+ *
+ * As polykernel_avx2.c, but 16 pixels at a time.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+#ifdef POLYKERNEL_X86
+
+#include <immintrin.h>
+
+#define AVX512_TARGET __attribute__((target( "avx512f,avx512bw,avx2,fma" )))
+#define AVX512_INLINE static inline __attribute__((always_inline)) AVX512_TARGET
+
+/* pshufb masks to pull R, G and B for 16 pixels out of 48 bytes, loaded
+ * as three lots of 16 bytes.
+ */
+static const gint8 avx512_deinterleave[3][3][16]
+	__attribute__((aligned( 16 ))) = {
+	{
+		{  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13 }
+	},
+	{
+		{  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14 }
+	},
+	{
+		{  2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1 },
+		{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15 }
+	}
+};
+
+/* Load 16 pixels as three float vectors. As with AVX2, gathers need a
+ * byte to spare after the last pixel.
+ */
+AVX512_INLINE void
+avx512_load_rgb( const VipsPel *p, int stride,
+	__m128i mask[3][3], __m512i index, __m512 rgb[3] )
+{
+	int c;
+
+	if( stride == 3 ) {
+		__m128i in[3];
+
+		in[0] = _mm_loadu_si128( (const __m128i *) p );
+		in[1] = _mm_loadu_si128( (const __m128i *) (p + 16) );
+		in[2] = _mm_loadu_si128( (const __m128i *) (p + 32) );
+
+		for( c = 0; c < 3; c++ ) {
+			__m128i v = _mm_or_si128(
+				_mm_or_si128(
+					_mm_shuffle_epi8( in[0], mask[c][0] ),
+					_mm_shuffle_epi8( in[1], mask[c][1] ) ),
+				_mm_shuffle_epi8( in[2], mask[c][2] ) );
+
+			rgb[c] = _mm512_cvtepi32_ps( _mm512_cvtepu8_epi32( v ) );
+		}
+	}
+	else {
+		__m512i v = _mm512_i32gather_epi32( index, p, 1 );
+		__m512i ff = _mm512_set1_epi32( 0xff );
+
+		for( c = 0; c < 3; c++ )
+			rgb[c] = _mm512_cvtepi32_ps( _mm512_and_si512(
+				_mm512_srli_epi32( v, 8 * c ), ff ) );
+	}
+}
+
+AVX512_INLINE void
+avx512_fit( const PolyMatrix *M, PolyRow *row, const int m, const int n )
+{
+	const int qstride = (row->rgb ? 3 : 0) + m;
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 c255 = _mm512_set1_ps( 255.0 );
+	const __m512 wr = _mm512_set1_ps( 0.2125 );
+	const __m512 wg = _mm512_set1_ps( 0.7154 );
+	const __m512 wb = _mm512_set1_ps( 0.0721 );
+	const __m512i index = _mm512_mullo_epi32(
+		_mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7,
+			8, 9, 10, 11, 12, 13, 14, 15 ),
+		_mm512_set1_epi32( row->stride ) );
+	const int last = row->width - (row->stride == 3 ? 16 : 17);
+
+	__m128i mask[3][3];
+	int x, i, j, k, c;
+
+	for( c = 0; c < 3; c++ )
+		for( k = 0; k < 3; k++ )
+			mask[c][k] = _mm_load_si128(
+				(const __m128i *) avx512_deinterleave[c][k] );
+
+	for( x = 0; x <= last; x += 16 ) {
+		const int offset = x * row->stride;
+		float * restrict q = row->q + x * qstride;
+
+		__m512 acc[POLYKERNEL_MAX_COEFF];
+		__m512 sum[3];
+		__m512 maxl;
+		__m512 ss;
+		float out[3 + POLYKERNEL_MAX_COEFF][16]
+			__attribute__((aligned( 64 )));
+		__m512 scale;
+
+		for( j = 0; j < m; j++ )
+			acc[j] = zero;
+		for( c = 0; c < 3; c++ )
+			sum[c] = zero;
+		maxl = zero;
+		ss = zero;
+
+		for( i = 0; i < n; i++ ) {
+			const float * restrict coeff = M->coeffT + i * m;
+
+			__m512 rgb[3];
+			__m512 lum;
+
+			avx512_load_rgb( row->p[i] + offset, row->stride,
+				mask, index, rgb );
+
+			lum = _mm512_fmadd_ps( rgb[2], wb,
+				_mm512_fmadd_ps( rgb[1], wg,
+					_mm512_mul_ps( rgb[0], wr ) ) );
+			maxl = _mm512_max_ps( maxl, lum );
+
+			if( row->rgb ) {
+				ss = _mm512_fmadd_ps( lum, lum, ss );
+				for( c = 0; c < 3; c++ )
+					sum[c] = _mm512_fmadd_ps( rgb[c], lum,
+						sum[c] );
+			}
+
+			for( j = 0; j < m; j++ )
+				acc[j] = _mm512_fmadd_ps( lum,
+					_mm512_set1_ps( coeff[j] ), acc[j] );
+		}
+
+		k = 0;
+		if( row->rgb ) {
+			__m512 f = _mm512_maskz_div_ps(
+				_mm512_cmp_ps_mask( ss, zero, _CMP_GT_OQ ),
+				maxl, ss );
+
+			for( c = 0; c < 3; c++ ) {
+				__m512 v = _mm512_mul_ps( sum[c], f );
+
+				v = _mm512_min_ps( _mm512_max_ps( v, zero ), c255 );
+				_mm512_store_ps( out[k++], v );
+			}
+		}
+
+		scale = _mm512_maskz_div_ps(
+			_mm512_cmp_ps_mask( maxl, zero, _CMP_GT_OQ ),
+			c255, maxl );
+		for( j = 0; j < m; j++ )
+			_mm512_store_ps( out[k++],
+				_mm512_mul_ps( acc[j], scale ) );
+
+		for( i = 0; i < 16; i++ )
+			for( k = 0; k < qstride; k++ )
+				q[i * qstride + k] = out[k][i];
+	}
+
+	polykernel_scalar_tail( M, row, x );
+}
+
+AVX512_TARGET void
+polykernel_avx512( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m > POLYKERNEL_MAX_COEFF )
+		polykernel_scalar( M, row );
+	else
+		avx512_fit( M, row, M->m, M->n );
+}
+
+/* Versions of avx512_fit() with the matrix size fixed.
+ */
+#define AVX512_SIZE( M, N ) \
+static AVX512_TARGET void \
+avx512_fit_ ## M ## _ ## N( const PolyMatrix *matrix, PolyRow *row ) \
+{ \
+	avx512_fit( matrix, row, M, N ); \
+}
+
+POLYKERNEL_FOR_SIZES( AVX512_SIZE )
+
+#define AVX512_ENTRY( M, N ) { M, N, avx512_fit_ ## M ## _ ## N },
+
+static const PolyKernelSize avx512_sizes[] = {
+	POLYKERNEL_FOR_SIZES( AVX512_ENTRY )
+};
+
+PolyKernelFn
+polykernel_avx512_specialise( int m, int n )
+{
+	return( polykernel_find_size( avx512_sizes, 
+		VIPS_NUMBER( avx512_sizes ), m, n, polykernel_avx512 ) );
+}
+
+#endif /*POLYKERNEL_X86*/
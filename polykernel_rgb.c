@@ -0,0 +1,153 @@
+/* RGB fitting kernel for compute_polys
+ *
+ * For PTM_FORMAT_RGB we fit each channel of each pixel with its own
+ * polynomial, but they all go through the same pseudo-inverse. A row of
+ * width pixels is therefore just 3 x width independent samples, and a
+ * single pass over the images can fit all of them: for each image, load
+ * RGB_BATCH samples and add that column of M into RGB_BATCH accumulators.
+ * There's no luminance and no normalisation, so it's a plain GEMV.
+ *
+ * Sample s is pixel s / 3, channel s % 3, and its m coefficients go to
+ * q[s * m], so each pixel is R's m coefficients, then G's, then B's.
+ *
+ * We use gcc vector types, and build the kernel once for the compile flags
+ * and again for AVX2 and AVX-512, so the kernel registry can pick a version
+ * with the CPU, see polykernel.c.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+/* Samples per batch, the lanes in a vector. That's one register with
+ * AVX-512 and two with AVX2, which keeps two independent sums in flight.
+ */
+#define RGB_BATCH (16)
+
+typedef float v16sf __attribute__((vector_size( 64 )));
+
+#define rgb_splat( F ) ((v16sf) { F, F, F, F, F, F, F, F, \
+	F, F, F, F, F, F, F, F })
+
+/* Everything is inlined into the target-attributed entry points at the 
+ * end, so it's compiled for their instruction set.
+ */
+#define RGB_INLINE static inline __attribute__((always_inline))
+
+/* Fit a row, with m a constant if we can, so the accumulators stay in
+ * registers.
+ */
+RGB_INLINE void
+polykernel_rgb_m( const PolyMatrix *M, PolyRow *row, const int m )
+{
+	const int n = M->n;
+	const int samples = 3 * row->width;
+
+	int s, i, j, l;
+
+	for( s = 0; s < samples; s += RGB_BATCH ) {
+		const int lanes = VIPS_MIN( RGB_BATCH, samples - s );
+		float * restrict q = row->q + (size_t) s * m;
+
+		int offset[RGB_BATCH];
+		v16sf acc[POLYKERNEL_MAX_COEFF];
+
+		/* Where each sample is in a row, repeating the last one past
+		 * the end. For separate images this is just s + l, for a
+		 * stack image we skip the other images between pixels.
+		 */
+		for( l = 0; l < RGB_BATCH; l++ ) {
+			int t = s + VIPS_MIN( l, lanes - 1 );
+
+			offset[l] = t / 3 * row->stride + t % 3;
+		}
+
+		for( j = 0; j < m; j++ )
+			acc[j] = rgb_splat( 0.0 );
+
+		/* Separate images and a whole batch: the samples are 
+		 * contiguous, and gcc can make this a single load and convert.
+		 */
+		if( row->stride == 3 &&
+			lanes == RGB_BATCH ) 
+			for( i = 0; i < n; i++ ) {
+				const VipsPel * restrict p = row->p[i] + s;
+				const float * restrict coeffT = 
+					M->coeffT + i * m;
+
+				v16sf v = { p[0], p[1], p[2], p[3], 
+					p[4], p[5], p[6], p[7],
+					p[8], p[9], p[10], p[11],
+					p[12], p[13], p[14], p[15] };
+
+				for( j = 0; j < m; j++ )
+					acc[j] += v * rgb_splat( coeffT[j] );
+			}
+		else
+			for( i = 0; i < n; i++ ) {
+				const VipsPel * restrict p = row->p[i];
+				const float * restrict coeffT = 
+					M->coeffT + i * m;
+
+				v16sf v = { p[offset[0]], p[offset[1]], 
+					p[offset[2]], p[offset[3]],
+					p[offset[4]], p[offset[5]],
+					p[offset[6]], p[offset[7]],
+					p[offset[8]], p[offset[9]],
+					p[offset[10]], p[offset[11]],
+					p[offset[12]], p[offset[13]],
+					p[offset[14]], p[offset[15]] };
+
+				for( j = 0; j < m; j++ )
+					acc[j] += v * rgb_splat( coeffT[j] );
+			}
+
+		for( l = 0; l < lanes; l++ )
+			for( j = 0; j < m; j++ )
+				q[l * m + j] = acc[j][l];
+	}
+}
+
+RGB_INLINE void
+polykernel_rgb_row( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m == 6 )
+		polykernel_rgb_m( M, row, 6 );
+	else if( M->m == 3 )
+		polykernel_rgb_m( M, row, 3 );
+	else
+		polykernel_rgb_m( M, row, M->m );
+}
+
+/* row->rgb is ignored: there's no average colour in an RGB fit, so each
+ * pixel is always 3 * m floats.
+ */
+void
+polykernel_rgb( const PolyMatrix *M, PolyRow *row )
+{
+	polykernel_rgb_row( M, row );
+}
+
+#ifdef POLYKERNEL_X86
+#define RGB_VARIANT( NAME, TARGET ) \
+__attribute__((target( TARGET ))) void \
+polykernel_rgb_ ## NAME( const PolyMatrix *M, PolyRow *row ) \
+{ \
+	polykernel_rgb_row( M, row ); \
+}
+
+RGB_VARIANT( avx2, "avx2,fma" )
+RGB_VARIANT( avx512, "avx512f,avx512bw,avx2,fma" )
+#endif /*POLYKERNEL_X86*/
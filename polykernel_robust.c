@@ -0,0 +1,466 @@
+/* robust per-pixel fitting kernel for compute_polys
+ *
+ * The other kernels share one pseudo-inverse between all pixels, so 
+ * shadows and specular highlights go straight into the fit. Here each pixel
+ * gets its own weight for each light, and so its own normal equations:
+ *
+ *	(B^T W B) c = B^T W R
+ *
+ * where B is the n x m basis, W the weights and R the normalised luminance.
+ * Lights darker than shadow or brighter than highlight get weight zero, then
+ * each of rounds rounds of iteratively reweighted least squares refits with 
+ * Huber weights from the last residuals.
+ *
+ * To make this fast we do ROBUST_BATCH pixels at once, with gcc vector 
+ * types, one pixel per lane, and solve with LDL^T, so there are no square
+ * roots. The vector code is generic, so we build it once for the compile
+ * flags and again for AVX2 and AVX-512, and the kernel registry picks a
+ * version with the CPU, see polykernel.c. The AVX-512 version keeps 8 lanes:
+ * 16 lanes helps IRLS there a little, but with AVX2 the solve no longer 
+ * fits in registers and runs at half speed.
+ *
+ * Most lights keep weight 1 in most pixels, so rather than sum the 
+ * normal equations from scratch we start from B^T B and B^T R and subtract
+ * (1 - w) times each light's part, skipping lights that have weight 1 in 
+ * every lane. polymatrix_robust_init() makes B^T B and the outer products of 
+ * the rows of B once. Pixels with too few usable lights, or a singular 
+ * system, fall back to the plain fit.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+/* Pixels per batch, the lanes in a vector.
+ */
+#define ROBUST_BATCH (8)
+
+typedef float v8sf __attribute__((vector_size( 32 )));
+typedef gint32 v8si __attribute__((vector_size( 32 )));
+typedef guint64 v4du __attribute__((vector_size( 32 )));
+
+/* Huber's constant, for 95% efficiency on normal errors.
+ */
+#define ROBUST_HUBER (1.345)
+
+/* Pivots smaller than this, relative to the diagonal, mean we can't solve.
+ */
+#define ROBUST_EPSILON (1e-5)
+
+/* Elements in the lower triangle of an m x m matrix.
+ */
+#define ROBUST_TRI( M ) ((M) * ((M) + 1) / 2)
+
+/* Macros rather than functions, so no vectors cross a call.
+ */
+#define robust_splat( F ) ((v8sf) { F, F, F, F, F, F, F, F })
+#define robust_select( MASK, A, B ) \
+	((v8sf) (((MASK) & (v8si) (A)) | (~(MASK) & (v8si) (B))))
+#define robust_abs( A ) ((v8sf) ((v8si) (A) & 0x7fffffff))
+
+/* Everything is inlined into the target-attributed entry points at the 
+ * end, so it's compiled for their instruction set.
+ */
+#define ROBUST_INLINE static inline __attribute__((always_inline))
+
+/* Add the basis, the outer products of its rows and their sum to a 
+ * PolyMatrix, and set the weighting. @basis is a matrix image, m wide and 
+ * n high. 
+ */
+int
+polymatrix_robust_init( PolyMatrix *M, VipsObject *parent, 
+	VipsImage *basis, double shadow, double highlight, int rounds )
+{
+	int m = M->m;
+	int n = M->n;
+	int tri = ROBUST_TRI( m );
+
+	int i, j, k, t;
+
+	if( basis->Xsize != m ||
+		basis->Ysize != n ) {
+		vips_error( "polykernel_robust", 
+			"%s", "basis is not the size of the fit" );
+		return( -1 );
+	}
+	if( m > POLYKERNEL_MAX_COEFF ) {
+		vips_error( "polykernel_robust", 
+			"%s", "too many coefficients for a robust fit" );
+		return( -1 );
+	}
+
+	if( !(M->basis = VIPS_ARRAY( parent, n * m, float )) ||
+		!(M->outer = VIPS_ARRAY( parent, n * tri, float )) ||
+		!(M->gram = VIPS_ARRAY( parent, tri, float )) )
+		return( -1 );
+
+	for( t = 0; t < tri; t++ )
+		M->gram[t] = 0.0;
+
+	for( i = 0; i < n; i++ ) {
+		float *b = M->basis + i * m;
+
+		for( j = 0; j < m; j++ )
+			b[j] = *VIPS_MATRIX( basis, j, i );
+
+		t = 0;
+		for( j = 0; j < m; j++ )
+			for( k = 0; k <= j; k++ ) {
+				M->outer[i * tri + t] = b[j] * b[k];
+				M->gram[t] += b[j] * b[k];
+				t += 1;
+			}
+	}
+
+	M->shadow = shadow;
+	M->highlight = highlight;
+	M->rounds = rounds;
+
+	return( 0 );
+}
+
+/* Doubles of scratch each kernel needs in PolyRow.R: for the robust kernel,
+ * the luminance and weight of each light for a batch, plus room to align.
+ */
+int
+polymatrix_scratch( const PolyMatrix *M )
+{
+	if( M->outer )
+		return( M->n * ROBUST_BATCH + 4 );
+	else
+		return( M->n );
+}
+
+/* Is any lane of a mask set.
+ */
+ROBUST_INLINE gboolean
+robust_any( v8si mask )
+{
+	v4du u = (v4du) mask;
+
+	return( (u[0] | u[1] | u[2] | u[3]) != 0 );
+}
+
+/* Solve (B^T W B) c = B^T W R for a batch, given B^T R. Lanes we can't 
+ * solve are left alone.
+ */
+ROBUST_INLINE void
+robust_solve( const PolyMatrix *M, 
+	const v8sf *lum, const v8sf *w, const v8sf *btr, const v8sf *scale, 
+	v8sf *c, const int m )
+{
+	const int tri = ROBUST_TRI( m );
+	const v8sf zero = robust_splat( 0.0 );
+	const v8sf one = robust_splat( 1.0 );
+
+	v8sf A[ROBUST_TRI( POLYKERNEL_MAX_COEFF )];
+	v8sf rhs[POLYKERNEL_MAX_COEFF];
+	v8sf d[POLYKERNEL_MAX_COEFF];
+	v8si ok;
+	int i, j, k, t;
+
+	/* The normal equations, taking away the down-weighted part of each
+	 * light.
+	 */
+	for( t = 0; t < tri; t++ )
+		A[t] = robust_splat( M->gram[t] );
+	for( j = 0; j < m; j++ )
+		rhs[j] = btr[j];
+
+	for( i = 0; i < M->n; i++ ) {
+		const float * restrict outer = M->outer + i * tri;
+		const float * restrict b = M->basis + i * m;
+		v8sf drop = one - w[i];
+		v8sf dl;
+
+		if( !robust_any( drop != zero ) )
+			continue;
+
+		dl = drop * lum[i];
+		for( t = 0; t < tri; t++ )
+			A[t] -= drop * outer[t];
+		for( j = 0; j < m; j++ )
+			rhs[j] -= dl * b[j];
+	}
+
+	for( j = 0; j < m; j++ )
+		rhs[j] *= *scale;
+
+	/* LDL^T in place: L below the diagonal of A, D in d.
+	 */
+	ok = zero == zero;
+	for( j = 0; j < m; j++ ) {
+		v8sf *Aj = A + ROBUST_TRI( j );
+
+		d[j] = Aj[j];
+		for( k = 0; k < j; k++ ) 
+			d[j] -= Aj[k] * Aj[k] * d[k];
+		ok &= d[j] > robust_splat( ROBUST_EPSILON ) * Aj[j];
+
+		for( i = j + 1; i < m; i++ ) {
+			v8sf *Ai = A + ROBUST_TRI( i );
+
+			for( k = 0; k < j; k++ ) 
+				Ai[j] -= Ai[k] * Aj[k] * d[k];
+			Ai[j] /= d[j];
+		}
+	}
+
+	/* Forward, diagonal and back substitution.
+	 */
+	for( i = 0; i < m; i++ ) {
+		v8sf *Ai = A + ROBUST_TRI( i );
+
+		for( k = 0; k < i; k++ )
+			rhs[i] -= Ai[k] * rhs[k];
+	}
+	for( i = 0; i < m; i++ )
+		rhs[i] /= d[i];
+	for( i = m - 1; i >= 0; i-- ) 
+		for( k = i + 1; k < m; k++ )
+			rhs[i] -= A[ROBUST_TRI( k ) + i] * rhs[k];
+
+	for( j = 0; j < m; j++ )
+		c[j] = robust_select( ok, rhs[j], c[j] );
+}
+
+/* Load RGB for a batch of pixels from one image, with O the offset of each
+ * lane. Building the vectors in registers and converting them in one go is
+ * much quicker than setting lanes in memory, which stalls the vector loads
+ * that follow.
+ */
+#define ROBUST_LOAD( P, O, RGB ) { \
+	int c_; \
+	\
+	for( c_ = 0; c_ < 3; c_++ ) { \
+		const VipsPel *p_ = (P) + c_; \
+		v8si v_ = { p_[O[0]], p_[O[1]], p_[O[2]], p_[O[3]], \
+			p_[O[4]], p_[O[5]], p_[O[6]], p_[O[7]] }; \
+		\
+		RGB[c_] = __builtin_convertvector( v_, v8sf ); \
+	} \
+}
+
+/* Fit a row, with m a constant if we can, so the sums stay in registers.
+ */
+ROBUST_INLINE void
+robust_fit( const PolyMatrix *M, PolyRow *row, const int m )
+{
+	const int n = M->n;
+	const int qstride = (row->rgb ? 3 : 0) + m;
+	const v8sf zero = robust_splat( 0.0 );
+	const v8sf one = robust_splat( 1.0 );
+	const v8sf c255 = robust_splat( 255.0 );
+	const v8sf wr = robust_splat( 0.2125 );
+	const v8sf wg = robust_splat( 0.7154 );
+	const v8sf wb = robust_splat( 0.0721 );
+	const gboolean threshold = M->shadow > 0 || M->highlight < 255;
+
+	/* Luminance and weight for each light, for the batch.
+	 */
+	v8sf *lum = (v8sf *) VIPS_ROUND_UP( (guintptr) row->R, 32 );
+	v8sf *w = lum + n;
+
+	int x, i, j, k, l, c;
+
+	for( x = 0; x < row->width; x += ROBUST_BATCH ) {
+		const int lanes = VIPS_MIN( ROBUST_BATCH, row->width - x );
+		const int offset = x * row->stride;
+
+		int o[ROBUST_BATCH];
+		v8sf maxl;
+		v8sf scale;
+		v8sf count;
+		v8sf sum[3];
+		v8sf ss;
+		v8sf btr[POLYKERNEL_MAX_COEFF];
+		v8sf fit[POLYKERNEL_MAX_COEFF];
+		v8sf coeff[POLYKERNEL_MAX_COEFF];
+		v8sf out[3 + POLYKERNEL_MAX_COEFF];
+		int round;
+
+		/* Lanes past the end of the row repeat the last pixel.
+		 */
+		for( l = 0; l < ROBUST_BATCH; l++ )
+			o[l] = VIPS_MIN( l, lanes - 1 ) * row->stride;
+
+		/* One pass over the lights for luminance, the plain fit, B^T R
+		 * and the unweighted colour sums.
+		 */
+		maxl = zero;
+		ss = zero;
+		for( c = 0; c < 3; c++ )
+			sum[c] = zero;
+		for( j = 0; j < m; j++ ) {
+			btr[j] = zero;
+			fit[j] = zero;
+		}
+
+		for( i = 0; i < n; i++ ) {
+			const float * restrict coeffT = M->coeffT + i * m;
+			const float * restrict b = M->basis + i * m;
+
+			v8sf rgb[3];
+			v8sf li;
+
+			ROBUST_LOAD( row->p[i] + offset, o, rgb );
+			li = rgb[0] * wr + rgb[1] * wg + rgb[2] * wb;
+			lum[i] = li;
+
+			maxl = robust_select( li > maxl, li, maxl );
+			ss += li * li;
+			for( c = 0; c < 3; c++ )
+				sum[c] += rgb[c] * li;
+			for( j = 0; j < m; j++ ) {
+				fit[j] += li * coeffT[j];
+				btr[j] += li * b[j];
+			}
+		}
+
+		scale = robust_select( maxl > zero, one / maxl, zero );
+		for( j = 0; j < m; j++ ) {
+			fit[j] *= scale;
+			coeff[j] = fit[j];
+		}
+
+		/* Drop shadows and highlights. 
+		 */
+		count = zero;
+		for( i = 0; i < n; i++ ) {
+			v8si in = (lum[i] >= robust_splat( M->shadow )) &
+				(lum[i] <= robust_splat( M->highlight ));
+
+			w[i] = robust_select( in, one, zero );
+			count += w[i];
+		}
+		if( threshold )
+			robust_solve( M, lum, w, btr, &scale, coeff, m );
+
+		/* Reweight from the residuals and refit.
+		 */
+		for( round = 0; round < M->rounds; round++ ) {
+			v8sf r2 = zero;
+			v8sf k;
+
+			for( i = 0; i < n; i++ ) {
+				const float * restrict b = M->basis + i * m;
+				v8sf r = lum[i] * scale;
+
+				for( j = 0; j < m; j++ )
+					r -= coeff[j] * b[j];
+				r2 += w[i] * r * r;
+
+				/* Park |r| in w until we have the Huber
+				 * threshold, -1 for lights we've dropped.
+				 */
+				w[i] = robust_select( w[i] > zero, 
+					robust_abs( r ), robust_splat( -1.0 ) );
+			}
+
+			/* The Huber threshold from the RMS residual.
+			 */
+			for( l = 0; l < ROBUST_BATCH; l++ ) 
+				k[l] = ROBUST_HUBER * 
+					sqrtf( count[l] > m ? 
+						r2[l] / (count[l] - m) : 0 );
+
+			for( i = 0; i < n; i++ ) {
+				v8sf r = w[i];
+
+				w[i] = robust_select( r > k, k / r, one );
+				w[i] = robust_select( r < zero, zero, w[i] );
+			}
+
+			robust_solve( M, lum, w, btr, &scale, coeff, m );
+		}
+
+		/* Too few lights left for a fit: use the plain one.
+		 */
+		for( j = 0; j < m; j++ )
+			coeff[j] = robust_select( count < robust_splat( m ), 
+				fit[j], coeff[j] );
+
+		/* The weighted average colour: take away the down-weighted 
+		 * part of each light, as for the normal equations.
+		 */
+		if( row->rgb ) 
+			for( i = 0; i < n; i++ ) {
+				v8sf drop = one - w[i];
+				v8sf rgb[3];
+				v8sf dl;
+
+				if( !robust_any( drop != zero ) )
+					continue;
+
+				ROBUST_LOAD( row->p[i] + offset, o, rgb );
+				dl = drop * lum[i];
+				for( c = 0; c < 3; c++ )
+					sum[c] -= rgb[c] * dl;
+				ss -= lum[i] * dl;
+			}
+
+		k = 0;
+		if( row->rgb ) {
+			v8sf f = robust_select( ss > zero, maxl / ss, zero );
+
+			for( c = 0; c < 3; c++ ) {
+				v8sf v = sum[c] * f;
+
+				v = robust_select( v > zero, v, zero );
+				out[k++] = robust_select( v < c255, v, c255 );
+			}
+		}
+		for( j = 0; j < m; j++ )
+			out[k++] = c255 * coeff[j];
+
+		/* And back to band-interleaved.
+		 */
+		for( l = 0; l < lanes; l++ ) {
+			float * restrict q = row->q + (x + l) * qstride;
+
+			for( k = 0; k < qstride; k++ )
+				q[k] = out[k][l];
+		}
+	}
+}
+
+ROBUST_INLINE void
+robust_row( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m == 6 )
+		robust_fit( M, row, 6 );
+	else if( M->m == 3 )
+		robust_fit( M, row, 3 );
+	else
+		robust_fit( M, row, M->m );
+}
+
+void
+polykernel_robust( const PolyMatrix *M, PolyRow *row )
+{
+	robust_row( M, row );
+}
+
+#ifdef POLYKERNEL_X86
+#define ROBUST_VARIANT( NAME, TARGET ) \
+__attribute__((target( TARGET ))) void \
+polykernel_robust_ ## NAME( const PolyMatrix *M, PolyRow *row ) \
+{ \
+	robust_row( M, row ); \
+}
+
+ROBUST_VARIANT( avx2, "avx2,fma" )
+ROBUST_VARIANT( avx512, "avx512f,avx512bw,avx2,fma" )
+#endif /*POLYKERNEL_X86*/
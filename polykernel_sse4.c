@@ -0,0 +1,199 @@
+/* SSE4.1 fitting kernel for compute_polys
+ *
+ * As polykernel_avx2.c, but 4 pixels at a time and without FMA, for older
+ * CPUs.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+#include "polykernel.h"
+
+#ifdef POLYKERNEL_X86
+
+#include <immintrin.h>
+
+#define SSE4_TARGET __attribute__((target( "sse4.1" )))
+#define SSE4_INLINE static inline __attribute__((always_inline)) SSE4_TARGET
+
+/* pshufb masks to pull R, G and B for 4 pixels out of 12 bytes.
+ */
+static const gint8 sse4_deinterleave[3][16]
+	__attribute__((aligned( 16 ))) = {
+	{  0,  3,  6,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{  1,  4,  7, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{  2,  5,  8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }
+};
+
+/* Load 4 pixels as three float vectors. There's no gather, so other
+ * strides are loaded a pixel at a time, 4 bytes per pixel, and the caller
+ * must leave a byte to spare after the last one.
+ */
+SSE4_INLINE void
+sse4_load_rgb( const VipsPel *p, int stride, __m128i mask[3], __m128 rgb[3] )
+{
+	__m128i v;
+	int c;
+
+	if( stride == 3 ) {
+		int i32;
+
+		memcpy( &i32, p + 8, 4 );
+		v = _mm_insert_epi32(
+			_mm_loadl_epi64( (const __m128i *) p ), i32, 2 );
+
+		for( c = 0; c < 3; c++ )
+			rgb[c] = _mm_cvtepi32_ps( _mm_cvtepu8_epi32(
+				_mm_shuffle_epi8( v, mask[c] ) ) );
+	}
+	else {
+		int i32[4];
+		__m128i ff = _mm_set1_epi32( 0xff );
+
+		for( c = 0; c < 4; c++ )
+			memcpy( &i32[c], p + c * stride, 4 );
+		v = _mm_loadu_si128( (const __m128i *) i32 );
+
+		for( c = 0; c < 3; c++ )
+			rgb[c] = _mm_cvtepi32_ps( _mm_and_si128(
+				_mm_srli_epi32( v, 8 * c ), ff ) );
+	}
+}
+
+SSE4_INLINE void
+sse4_fit( const PolyMatrix *M, PolyRow *row, const int m, const int n )
+{
+	const int qstride = (row->rgb ? 3 : 0) + m;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 c255 = _mm_set1_ps( 255.0 );
+	const __m128 wr = _mm_set1_ps( 0.2125 );
+	const __m128 wg = _mm_set1_ps( 0.7154 );
+	const __m128 wb = _mm_set1_ps( 0.0721 );
+	const int last = row->width - (row->stride == 3 ? 4 : 5);
+
+	__m128i mask[3];
+	int x, i, j, k, c;
+
+	for( c = 0; c < 3; c++ )
+		mask[c] = _mm_load_si128(
+			(const __m128i *) sse4_deinterleave[c] );
+
+	for( x = 0; x <= last; x += 4 ) {
+		const int offset = x * row->stride;
+		float * restrict q = row->q + x * qstride;
+
+		__m128 acc[POLYKERNEL_MAX_COEFF];
+		__m128 sum[3];
+		__m128 maxl;
+		__m128 ss;
+		float out[3 + POLYKERNEL_MAX_COEFF][4]
+			__attribute__((aligned( 16 )));
+		__m128 scale;
+
+		for( j = 0; j < m; j++ )
+			acc[j] = zero;
+		for( c = 0; c < 3; c++ )
+			sum[c] = zero;
+		maxl = zero;
+		ss = zero;
+
+		for( i = 0; i < n; i++ ) {
+			const float * restrict coeff = M->coeffT + i * m;
+
+			__m128 rgb[3];
+			__m128 lum;
+
+			sse4_load_rgb( row->p[i] + offset, row->stride,
+				mask, rgb );
+
+			lum = _mm_add_ps(
+				_mm_add_ps(
+					_mm_mul_ps( rgb[0], wr ),
+					_mm_mul_ps( rgb[1], wg ) ),
+				_mm_mul_ps( rgb[2], wb ) );
+			maxl = _mm_max_ps( maxl, lum );
+
+			if( row->rgb ) {
+				ss = _mm_add_ps( ss, _mm_mul_ps( lum, lum ) );
+				for( c = 0; c < 3; c++ )
+					sum[c] = _mm_add_ps( sum[c],
+						_mm_mul_ps( rgb[c], lum ) );
+			}
+
+			for( j = 0; j < m; j++ )
+				acc[j] = _mm_add_ps( acc[j], _mm_mul_ps( lum,
+					_mm_set1_ps( coeff[j] ) ) );
+		}
+
+		k = 0;
+		if( row->rgb ) {
+			__m128 f = _mm_and_ps(
+				_mm_cmpgt_ps( ss, zero ),
+				_mm_div_ps( maxl, ss ) );
+
+			for( c = 0; c < 3; c++ ) {
+				__m128 v = _mm_mul_ps( sum[c], f );
+
+				v = _mm_min_ps( _mm_max_ps( v, zero ), c255 );
+				_mm_store_ps( out[k++], v );
+			}
+		}
+
+		scale = _mm_and_ps(
+			_mm_cmpgt_ps( maxl, zero ),
+			_mm_div_ps( c255, maxl ) );
+		for( j = 0; j < m; j++ )
+			_mm_store_ps( out[k++], _mm_mul_ps( acc[j], scale ) );
+
+		for( i = 0; i < 4; i++ )
+			for( k = 0; k < qstride; k++ )
+				q[i * qstride + k] = out[k][i];
+	}
+
+	polykernel_scalar_tail( M, row, x );
+}
+
+SSE4_TARGET void
+polykernel_sse4( const PolyMatrix *M, PolyRow *row )
+{
+	if( M->m > POLYKERNEL_MAX_COEFF )
+		polykernel_scalar( M, row );
+	else
+		sse4_fit( M, row, M->m, M->n );
+}
+
+/* Versions of sse4_fit() with the matrix size fixed.
+ */
+#define SSE4_SIZE( M, N ) \
+static SSE4_TARGET void \
+sse4_fit_ ## M ## _ ## N( const PolyMatrix *matrix, PolyRow *row ) \
+{ \
+	sse4_fit( matrix, row, M, N ); \
+}
+
+POLYKERNEL_FOR_SIZES( SSE4_SIZE )
+
+#define SSE4_ENTRY( M, N ) { M, N, sse4_fit_ ## M ## _ ## N },
+
+static const PolyKernelSize sse4_sizes[] = {
+	POLYKERNEL_FOR_SIZES( SSE4_ENTRY )
+};
+
+PolyKernelFn
+polykernel_sse4_specialise( int m, int n )
+{
+	return( polykernel_find_size( sse4_sizes, 
+		VIPS_NUMBER( sse4_sizes ), m, n, polykernel_sse4 ) );
+}
+
+#endif /*POLYKERNEL_X86*/
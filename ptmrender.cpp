@@ -0,0 +1,289 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+#include <vips/vips.h>
+
+#include "readptm.h"
+#include "relight.h"
+
+// -grid N lights are spaced across this much of the unit disc in x and y,
+// so the corners are just inside it
+#define GRID_EXTENT (0.7)
+
+const char *ptmfile = NULL;
+const char *outfile = "relit.png";
+
+// -jobs: frames rendered at once, 0 for one per thread
+int jobs = 0;
+
+// a frame to render
+struct RenderJob
+{
+	int index;
+	double x, y, z;
+	char *fname;
+	double seconds;
+	bool failed;
+};
+
+std::vector<RenderJob> frames;
+
+void Usage(char *argv0)
+{
+	printf("%s usage:\n", argv0);
+
+	printf("  -i <path>/<file.ptm>\n");
+	printf("    The PTM to render, PTM_FORMAT_LRGB or RGB, or a basis\n");
+	printf("    format from ptmfit -basis\n\n");
+
+	printf("  -o <path>/<file.suffix>\n");
+	printf("    Output file name, with any save options, eg. out.jpg[Q=90]\n");
+	printf("    (Default: relit.png) ... with more than one light, frames\n");
+	printf("    are numbered, eg. relit_00.png, relit_01.png\n\n");
+
+	printf("  -light X Y\n");
+	printf("    Render lit from X, Y, with z towards the camera, as in an lp\n");
+	printf("    file; give -light more than once for more frames (Default:\n");
+	printf("    0 0, straight on)\n\n");
+
+	printf("  -grid N\n");
+	printf("    Render an N x N grid of lights across the dome\n\n");
+
+	printf("  -jobs N\n");
+	printf("    Render N frames at once (Default: one per thread)\n\n");
+}
+
+void AddLight(double x, double y)
+{
+	RenderJob job;
+
+	if (x * x + y * y > 1.0)
+	{
+		printf("Error: light %g, %g is outside the unit circle\n", x, y);
+		exit(-1);
+	}
+
+	job.index = frames.size();
+	job.x = x;
+	job.y = y;
+	job.z = sqrt(1.0 - x * x - y * y);
+	job.fname = NULL;
+	job.seconds = 0.0;
+	job.failed = false;
+
+	frames.push_back(job);
+}
+
+void Process_parameters(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if( strcmp( argv[i], "-i") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no PTM file given\n");
+				exit(-1);
+			}
+			ptmfile = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-o") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no output file given\n");
+				exit(-1);
+			}
+			outfile = argv[++i];
+		} else
+
+		if( strcmp( argv[i], "-light") == 0)
+		{
+			if( argc - i < 3 ) {
+				printf("-light needs X and Y\n");
+				exit(-1);
+			}
+			AddLight(atof( argv[i + 1] ), atof( argv[i + 2] ));
+			i += 2;
+		} else
+
+		if( strcmp( argv[i], "-grid") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no grid size given\n");
+				exit(-1);
+			}
+			int n = VIPS_MAX(1, atoi( argv[++i] ));
+
+			for (int y = 0; y < n; y++)
+				for (int x = 0; x < n; x++)
+					if (n == 1)
+						AddLight(0.0, 0.0);
+					else
+						AddLight(GRID_EXTENT *
+							(2.0 * x / (n - 1) - 1.0),
+							GRID_EXTENT *
+							(1.0 - 2.0 * y / (n - 1)));
+		} else
+
+		if( strcmp( argv[i], "-jobs") == 0)
+		{
+			if( argc - i < 2 ) {
+				printf("no job count given\n");
+				exit(-1);
+			}
+			jobs = atoi( argv[++i] );
+		} else
+
+		if( strcmp( argv[i], "-h") == 0 || strcmp( argv[i], "/?") == 0)
+		{
+			Usage(argv[0]);
+			exit(0);
+		} else
+
+		{
+			printf("Error in parameter list: %s\n", argv[i]);
+			Usage(argv[0]);
+			exit(0);
+		}
+	}
+
+	if (!ptmfile)
+	{
+		printf("Error: no PTM file, use -i\n");
+		Usage(argv[0]);
+		exit(-1);
+	}
+
+	if (frames.empty())
+		AddLight(0.0, 0.0);
+}
+
+// the file name for frame i: the output name, numbered before the suffix
+// if there's more than one frame ... save options in [] are kept
+char *FrameName(int i)
+{
+	if (frames.size() == 1)
+		return g_strdup(outfile);
+
+	const char *options = strchr(outfile, '[');
+	size_t length = options ? options - outfile : strlen(outfile);
+	const char *dot = g_strrstr_len(outfile, length, ".");
+
+	// a dot in a directory name isn't a suffix
+	if (dot &&
+		g_strstr_len(dot, outfile + length - dot, "/"))
+		dot = NULL;
+
+	size_t stem = dot ? dot - outfile : length;
+
+	char *before = g_strndup(outfile, stem);
+	char *name = g_strdup_printf("%s_%02d%s", before, i, outfile + stem);
+	g_free(before);
+
+	return name;
+}
+
+// render and save one frame ... this runs in the frame pool
+void RenderFrame(gpointer data, gpointer user_data)
+{
+	RenderJob *job = (RenderJob *) data;
+	ReadPtm *ptm = (ReadPtm *) user_data;
+	gint64 start = g_get_monotonic_time();
+	VipsImage *image;
+
+	if (relight(ptm, job->x, job->y, job->z, &image))
+		job->failed = true;
+	else
+	{
+		if (vips_image_write_to_file(image, job->fname, NULL))
+			job->failed = true;
+		g_object_unref(image);
+	}
+
+	job->seconds = (g_get_monotonic_time() - start) / 1000000.0;
+
+	printf("[%d/%d] %s %s, light %.2f %.2f in %.2fs\n",
+		job->index + 1, (int) frames.size(),
+		job->failed ? "FAILED" : "done",
+		job->fname, job->x, job->y, job->seconds);
+	fflush(stdout);
+
+	vips_thread_shutdown();
+}
+
+int
+main(int argc, char* argv[])
+{
+	if (VIPS_INIT(argv[0]))
+		{
+		vips_error_exit("unable to start VIPS");
+		return(-1);
+		}
+
+	Process_parameters(argc, argv);
+
+	ReadPtm *ptm;
+
+	if (!(ptm = readptm_open(ptmfile)))
+	{
+		fprintf(stderr, "%s", vips_error_buffer());
+		return(-1);
+	}
+
+	printf("%s: %s, %d x %d, %d coefficients a pixel\n",
+		ptmfile, ptm->format, ptm->width, ptm->height,
+		ptm->terms * ptm->channels + (ptm->channels == 1 ? 3 : 0));
+
+	for (size_t i = 0; i < frames.size(); i++)
+		frames[i].fname = FrameName(i);
+
+	// encoders are mostly serial, so render several frames at once and
+	// split the threads between them, as ptmfit -batch does
+	int threads = vips_concurrency_get();
+
+	if (jobs <= 0)
+		jobs = threads;
+	jobs = VIPS_CLIP(1, jobs, (int) frames.size());
+	vips_concurrency_set(VIPS_MAX(1, threads / jobs));
+
+	gint64 start = g_get_monotonic_time();
+	GThreadPool *pool = g_thread_pool_new(RenderFrame,
+		ptm, jobs, TRUE, NULL);
+
+	for (size_t i = 0; i < frames.size(); i++)
+		g_thread_pool_push(pool, &frames[i], NULL);
+
+	// wait for the queue to drain
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	double elapsed = (g_get_monotonic_time() - start) / 1000000.0;
+	int n_failed = 0;
+
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		if (frames[i].failed)
+			n_failed += 1;
+		g_free(frames[i].fname);
+	}
+
+	if (n_failed > 0)
+		fprintf(stderr, "%s", vips_error_buffer());
+
+	printf("%d of %d frames rendered in %.2fs, %.1f MP/s\n",
+		(int) frames.size() - n_failed, (int) frames.size(), elapsed,
+		(double) ptm->width * ptm->height *
+			(frames.size() - n_failed) /
+			(VIPS_MAX(elapsed, 1e-6) * 1e6));
+
+	readptm_close(ptm);
+
+	return n_failed > 0 ? -1 : 0;
+}
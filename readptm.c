@@ -0,0 +1,230 @@
+/* read the ptm files writeptm makes
+ *
+ * We map the file and point into it, so opening even a huge PTM costs
+ * nothing and pages come in as the renderer touches them. The header is
+ * PTM_1.2, the format, the width and height, then a scale and a bias for
+ * each coefficient, see write_header() in writeptm.c, and the pixels start
+ * on the line after the biases.
+ *
+ * We read PTM_FORMAT_LRGB and PTM_FORMAT_RGB, and PTM_FORMAT_<BASIS>_LRGB
+ * and _RGB for the bases in basis.c which don't make a standard PTM. The
+ * JPEG formats are compressed, so they can't be used in place, and we
+ * don't read them.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+#include "readptm.h"
+
+/* The most header we'll look through for the start of the pixels.
+ */
+#define READPTM_HEADER_MAX (4096)
+
+void
+readptm_close( ReadPtm *ptm )
+{
+	if( ptm->file )
+		g_mapped_file_unref( ptm->file );
+	g_free( ptm->filename );
+	g_free( ptm->format );
+
+	g_free( ptm );
+}
+
+/* Set the basis and channels from the format name.
+ */
+static int
+readptm_format( ReadPtm *ptm, const char *format )
+{
+	const char *type;
+	char *name;
+
+	if( g_str_has_prefix( format, "PTM_FORMAT_JPEG_" ) ) {
+		vips_error( "readptm", _( "\"%s\" is compressed, only raw "
+			"PTMs can be read" ), ptm->filename );
+		return( -1 );
+	}
+	if( !g_str_has_prefix( format, "PTM_FORMAT_" ) ) {
+		vips_error( "readptm", _( "\"%s\" is not a PTM format" ),
+			format );
+		return( -1 );
+	}
+	format += strlen( "PTM_FORMAT_" );
+
+	/* LRGB or RGB on its own is a standard PTM, otherwise there's a
+	 * basis name in front.
+	 */
+	if( (type = strrchr( format, '_' )) )
+		type += 1;
+	else
+		type = format;
+
+	if( strcmp( type, "LRGB" ) == 0 )
+		ptm->channels = 1;
+	else if( strcmp( type, "RGB" ) == 0 )
+		ptm->channels = 3;
+	else {
+		vips_error( "readptm", _( "unsupported format PTM_FORMAT_%s" ),
+			format );
+		return( -1 );
+	}
+
+	if( type == format ) {
+		ptm->basis = basis_get( QUADRATIC_BIVARIATE );
+		return( 0 );
+	}
+
+	name = g_strndup( format, type - 1 - format );
+	ptm->basis = basis_lookup( name );
+	g_free( name );
+	if( !ptm->basis ||
+		ptm->basis->ptm ) {
+		vips_error( "readptm", _( "unsupported format PTM_FORMAT_%s" ),
+			format );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Parse the header at the start of the map and point coeff and rgb at the
+ * pixels.
+ */
+static int
+readptm_header( ReadPtm *ptm )
+{
+	const char *data = g_mapped_file_get_contents( ptm->file );
+	size_t length = g_mapped_file_get_length( ptm->file );
+
+	char *header;
+	char version[64];
+	char format[256];
+	const char *p;
+	size_t start;
+	size_t pels;
+	int n;
+	int i;
+
+	/* An empty file maps to NULL.
+	 */
+	if( length == 0 ||
+		!data ) {
+		vips_error( "readptm",
+			_( "\"%s\" is not a PTM" ), ptm->filename );
+		return( -1 );
+	}
+
+	/* The map isn't null-terminated, so parse a copy.
+	 */
+	header = g_strndup( data, VIPS_MIN( length, READPTM_HEADER_MAX ) );
+	p = header;
+
+	if( sscanf( p, "%63s %255s %d %d%n",
+		version, format, &ptm->width, &ptm->height, &n ) != 4 ||
+		(strcmp( version, "PTM_1.2" ) != 0 &&
+		 strcmp( version, "PTM_1.1" ) != 0) ) {
+		vips_error( "readptm",
+			_( "\"%s\" is not a PTM" ), ptm->filename );
+		g_free( header );
+		return( -1 );
+	}
+	p += n;
+
+	if( readptm_format( ptm, format ) ) {
+		g_free( header );
+		return( -1 );
+	}
+	ptm->format = g_strdup( format );
+	ptm->terms = basis_slots( ptm->basis, ptm->slot );
+
+	for( i = 0; i < ptm->terms; i++ ) {
+		if( sscanf( p, "%lf%n", &ptm->scale[i], &n ) != 1 )
+			break;
+		p += n;
+	}
+	if( i == ptm->terms )
+		for( i = 0; i < ptm->terms; i++ ) {
+			if( sscanf( p, "%d%n", &ptm->bias[i], &n ) != 1 )
+				break;
+			p += n;
+		}
+
+	/* The pixels start after the end of the bias line.
+	 */
+	if( i != ptm->terms ||
+		!(p = strchr( p, '\n' )) ) {
+		vips_error( "readptm",
+			_( "bad scale and bias in \"%s\"" ), ptm->filename );
+		g_free( header );
+		return( -1 );
+	}
+	start = p + 1 - header;
+	g_free( header );
+
+	if( ptm->width <= 0 ||
+		ptm->height <= 0 ) {
+		vips_error( "readptm",
+			_( "bad image size in \"%s\"" ), ptm->filename );
+		return( -1 );
+	}
+
+	pels = (size_t) ptm->width * ptm->height;
+	if( start + pels * ptm->terms * ptm->channels +
+		(ptm->channels == 1 ? pels * 3 : 0) > length ) {
+		vips_error( "readptm",
+			_( "\"%s\" is truncated" ), ptm->filename );
+		return( -1 );
+	}
+
+	ptm->coeff = (const VipsPel *) data + start;
+	ptm->rgb = ptm->channels == 1 ?
+		ptm->coeff + pels * ptm->terms : NULL;
+
+#ifdef DEBUG
+	printf( "readptm_header: %s, %d x %d, %d terms, pixels at %zd\n",
+		ptm->format, ptm->width, ptm->height, ptm->terms, start );
+#endif /*DEBUG*/
+
+	return( 0 );
+}
+
+/* Map a PTM. Close with readptm_close(), after any images made from it
+ * have gone.
+ */
+ReadPtm *
+readptm_open( const char *filename )
+{
+	ReadPtm *ptm;
+	GError *error = NULL;
+
+	ptm = g_new0( ReadPtm, 1 );
+	ptm->filename = g_strdup( filename );
+
+	if( !(ptm->file = g_mapped_file_new( filename, FALSE, &error )) ) {
+		vips_error( "readptm",
+			_( "unable to map \"%s\"" ), filename );
+		if( error )
+			g_error_free( error );
+		readptm_close( ptm );
+		return( NULL );
+	}
+
+	if( readptm_header( ptm ) ) {
+		readptm_close( ptm );
+		return( NULL );
+	}
+
+	return( ptm );
+}
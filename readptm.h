@@ -0,0 +1,54 @@
+#ifndef READPTM_H
+#define READPTM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+#include "basis.h"
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+/* A PTM mapped into memory, see readptm_open().
+ */
+typedef struct _ReadPtm {
+	char *filename;
+	GMappedFile *file;
+
+	char *format;
+	int width;
+	int height;
+
+	/* The basis the coefficients evaluate with, and the number of
+	 * coefficient areas: 1 for LRGB, 3 for RGB.
+	 */
+	const Basis *basis;
+	int channels;
+
+	/* The coefficients for each pixel, the basis term each one is, -1
+	 * for one the basis doesn't have, and their scale and bias.
+	 */
+	int terms;
+	int slot[BASIS_MAX_TERMS];
+	double scale[BASIS_MAX_TERMS];
+	int bias[BASIS_MAX_TERMS];
+
+	/* The first coefficient area and the RGB area, bottom row first,
+	 * pointing into the map. rgb is NULL for an RGB PTM.
+	 */
+	const VipsPel *coeff;
+	const VipsPel *rgb;
+} ReadPtm;
+
+ReadPtm *readptm_open( const char *filename );
+void readptm_close( ReadPtm *ptm );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*READPTM_H*/
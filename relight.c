@@ -0,0 +1,196 @@
+/* render a mapped ptm under a light
+ *
+ * For a light direction, each coefficient's basis function is a constant,
+ * so with the scale and bias folded in, a pixel is a weighted sum of its
+ * coefficient bytes. For LRGB that's the luminance, and the pixel is its
+ * RGB times that, for RGB it's each channel directly.
+ *
+ * The coefficients are bytes interleaved by pixel, so loading them into
+ * float vectors is a byte at a time, and with gcc vector types that was
+ * slower than scalar code. Instead each term gets a 256-entry table of
+ * its contribution under this light, with scale and bias folded in, and 
+ * a pixel is a lookup and add per coefficient, with no conversions or
+ * multiplies. The tables are 1kB a term, so they stay in L1. On one core,
+ * a 6-term LRGB PTM renders at about 100 MP/s, against 45 - 90 MP/s for
+ * the vector versions we tried, and RGB at about 55 MP/s.
+ *
+ * relight() makes a lazy image over the map, so vips runs the kernel on
+ * every thread as the image is saved and nothing is copied beforehand.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "relight.h"
+
+/* A PTM and a light.
+ */
+typedef struct _Relight {
+	ReadPtm *ptm;
+
+	/* The value of a pixel is the sum of table[i][c] over its 
+	 * coefficient bytes c. For LRGB that's luminance, 0 to 1.
+	 */
+	float table[BASIS_MAX_TERMS][256];
+} Relight;
+
+static void
+relight_init( Relight *relight, ReadPtm *ptm, double x, double y, double z )
+{
+	double row[BASIS_MAX_TERMS];
+	int i, c;
+
+	relight->ptm = ptm;
+	ptm->basis->row( x, y, z, row );
+
+	/* Coefficients are quantised as c = a / scale + bias, so a is
+	 * scale * (c - bias). The fit is scaled to 0 - 255, so LRGB
+	 * luminance needs scaling back to 0 - 1.
+	 */
+	for( i = 0; i < ptm->terms; i++ ) {
+		double k = ptm->slot[i] < 0 ?
+			0.0 : ptm->scale[i] * row[ptm->slot[i]];
+
+		if( ptm->channels == 1 )
+			k /= 255.0;
+
+		for( c = 0; c < 256; c++ )
+			relight->table[i][c] = k * (c - ptm->bias[i]);
+	}
+
+#ifdef DEBUG
+	printf( "relight_init: light %g, %g, %g\n", x, y, z );
+#endif /*DEBUG*/
+}
+
+/* Round and clip to a byte.
+ */
+#define RELIGHT_PACK( V ) \
+	((V) > 0 ? ((V) < 255 ? (VipsPel) (V) : 255) : 0)
+
+/* Render width pixels from offset in the PTM, with terms a constant if we
+ * can.
+ */
+static inline void
+relight_row_m( const Relight *relight, size_t offset,
+	VipsPel * restrict q, int width, const int terms )
+{
+	ReadPtm *ptm = relight->ptm;
+	size_t area = (size_t) ptm->width * ptm->height * terms;
+	const VipsPel * restrict p = ptm->coeff + offset * terms;
+
+	int x, c, i;
+
+	if( ptm->channels == 1 ) {
+		const VipsPel * restrict rgb = ptm->rgb + offset * 3;
+
+		for( x = 0; x < width; x++ ) {
+			float lum;
+
+			lum = 0.0;
+			for( i = 0; i < terms; i++ )
+				lum += relight->table[i][p[i]];
+
+			for( c = 0; c < 3; c++ ) {
+				float v = rgb[c] * lum + 0.5;
+
+				q[c] = RELIGHT_PACK( v );
+			}
+
+			p += terms;
+			rgb += 3;
+			q += 3;
+		}
+	}
+	else 
+		for( x = 0; x < width; x++ ) {
+			for( c = 0; c < 3; c++ ) {
+				const VipsPel * restrict pc = p + c * area;
+
+				float v;
+
+				v = 0.5;
+				for( i = 0; i < terms; i++ )
+					v += relight->table[i][pc[i]];
+
+				q[c] = RELIGHT_PACK( v );
+			}
+
+			p += terms;
+			q += 3;
+		}
+}
+
+static void
+relight_row( const Relight *relight, size_t offset, VipsPel *q, int width )
+{
+	int terms = relight->ptm->terms;
+
+	if( terms == 6 )
+		relight_row_m( relight, offset, q, width, 6 );
+	else
+		relight_row_m( relight, offset, q, width, terms );
+}
+
+static int
+relight_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
+{
+	Relight *relight = (Relight *) a;
+	ReadPtm *ptm = relight->ptm;
+	VipsRect *r = &or->valid;
+
+	int y;
+
+	for( y = 0; y < r->height; y++ ) {
+		/* PTMs are bottom row first.
+		 */
+		size_t row = ptm->height - 1 - (r->top + y);
+
+		relight_row( relight, row * ptm->width + r->left,
+			VIPS_REGION_ADDR( or, r->left, r->top + y ),
+			r->width );
+	}
+
+	return( 0 );
+}
+
+/* Render @ptm lit from @x, @y, @z, a unit vector with z towards the
+ * camera, as a 3-band uchar sRGB image. @ptm must stay open until @out
+ * has gone.
+ */
+int
+relight( ReadPtm *ptm, double x, double y, double z, VipsImage **out )
+{
+	Relight *relight;
+
+	*out = vips_image_new();
+	vips_image_init_fields( *out,
+		ptm->width, ptm->height, 3,
+		VIPS_FORMAT_UCHAR, VIPS_CODING_NONE,
+		VIPS_INTERPRETATION_sRGB, 1.0, 1.0 );
+	if( vips_image_pipelinev( *out, VIPS_DEMAND_STYLE_THINSTRIP, NULL ) ||
+		!(relight = VIPS_NEW( VIPS_OBJECT( *out ), Relight )) ) {
+		VIPS_UNREF( *out );
+		return( -1 );
+	}
+	relight_init( relight, ptm, x, y, z );
+
+	if( vips_image_generate( *out,
+		NULL, relight_gen, NULL, relight, NULL ) ) {
+		VIPS_UNREF( *out );
+		return( -1 );
+	}
+
+	return( 0 );
+}
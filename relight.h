@@ -0,0 +1,18 @@
+#ifndef RELIGHT_H
+#define RELIGHT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+#include "readptm.h"
+
+int relight( ReadPtm *ptm, double x, double y, double z, VipsImage **out );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*RELIGHT_H*/
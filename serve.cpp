@@ -0,0 +1,609 @@
+// serve.cpp: run ptmfit as a local service
+//
+// Jobs are files in a spool directory, one per dataset, named NAME.job:
+//
+//	lp /data/set1/stack.lp
+//	out /data/out/set1.ptm
+//	basis 0
+//	crop 0 0 1000 1000
+//
+// basis and crop are optional, and basis is 0 or 1, as for -b, or a name,
+// as for -basis. Relative paths are relative to the spool
+// directory, and images load from the directory of the lp file.
+//
+// We poll the spool, rename new jobs to NAME.queued, then to NAME.running
+// when we start them, and to NAME.done or NAME.failed at the end, with
+// the timings appended. Jobs start in arrival order (modification time,
+// then name) when there's a free slot and their estimated footprint fits
+// in the memory budget, though a job always starts if nothing else is
+// running, so a big one can't stall the queue. The current state and
+// latency stats are in SPOOL/status, and creating SPOOL/stop makes us
+// finish the running jobs and exit.
+//
+// Because the process stays up, vips, the pseudo-inverse cache and the
+// stack caches stay warm between jobs.
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips8>
+
+#include "serve.h"
+
+// how often we look at the spool, in microseconds
+#define SERVE_POLL (500000)
+
+// rows of each input a fit has in flight per thread, for the footprint
+// estimate ... a rough guess at sequential read buffering
+#define SERVE_ROWS (64)
+
+struct ServeJob
+{
+	// the job name, ie. the spool file without the suffix
+	std::string name;
+
+	std::string lpfile;
+	std::string fname;
+	Basis_e basis;
+	int crop[4];
+
+	size_t footprint;
+
+	// from g_get_monotonic_time()
+	gint64 arrived;
+	gint64 started;
+	gint64 finished;
+
+	bool failed;
+
+	// why it failed, if we know
+	std::string error;
+};
+
+struct ServeState
+{
+	ServeConfig *config;
+
+	GMutex lock;
+
+	std::deque<ServeJob *> queue;
+	int running;
+	size_t memory;
+
+	int n_done;
+	int n_failed;
+
+	// latency, arrival to finish, in seconds
+	double latency_total;
+	double latency_max;
+	double latency_last;
+	double wait_total;
+};
+
+static std::string
+SpoolPath(ServeConfig *config, const std::string &name, const char *suffix)
+{
+	char *path = g_build_filename(config->spool,
+		(name + suffix).c_str(), NULL);
+	std::string result(path);
+
+	g_free(path);
+
+	return result;
+}
+
+// make relative paths in a job file relative to the spool
+static std::string
+SpoolRelative(ServeConfig *config, const char *path)
+{
+	if (g_path_is_absolute(path))
+		return std::string(path);
+
+	char *full = g_build_filename(config->spool, path, NULL);
+	std::string result(full);
+
+	g_free(full);
+
+	return result;
+}
+
+// guess the peak memory of a job: the coefficient cache, plus input
+// buffers for each thread and the strip buffers of any file caches
+static size_t
+EstimateFootprint(ServeConfig *config, ServeJob *job)
+{
+	FILE *fp;
+	int n;
+	char first[STRSIZE];
+
+	if (!(fp = fopen(job->lpfile.c_str(), "r")))
+		return 0;
+	if (fscanf(fp, "%i", &n) != 1 ||
+		fscanf(fp, "%255s", first) != 1)
+	{
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	char *dir = g_path_get_dirname(job->lpfile.c_str());
+	char *basename = g_path_get_basename(first);
+	char *filename = g_build_filename(dir, basename, NULL);
+	VipsImage *image = vips_image_new_from_file(filename, NULL);
+
+	g_free(dir);
+	g_free(basename);
+	g_free(filename);
+
+	// the job will fail to load its images anyway
+	if (!image)
+	{
+		vips_error_clear();
+		return 0;
+	}
+
+	size_t width = image->Xsize * (job->crop[2] / 1000.0);
+	size_t height = image->Ysize * (job->crop[3] / 1000.0);
+	int coldim = basis_get(job->basis)->terms;
+	// rgb has a full set of coefficients per channel, and no average colour
+	int bands = config->rgb ? 3 * coldim : 3 + coldim;
+	int threads = VIPS_MAX(1, config->threads / config->jobs);
+
+	// with -accumulate, only one group of inputs is open at once
+	int open = config->accumulate > 0 ?
+		VIPS_MIN(n, config->accumulate) : n;
+	size_t strip = (size_t) open * 3 * image->Xsize * SERVE_ROWS;
+	size_t footprint = strip * threads;
+
+	g_object_unref(image);
+
+	if (config->cache == CACHE_MEMORY)
+		footprint += width * height * bands * sizeof(float);
+	else if (config->cache == CACHE_SHORT)
+		footprint += width * height * bands * sizeof(short);
+	// a spill is written through two strip buffers and read back
+	// through a mapped window for each thread
+	else if (config->cache == CACHE_SPILL)
+		footprint += width * SERVE_ROWS * bands * sizeof(float) *
+			(threads + 2);
+	// building a stack cache writes the joined inputs through two strip
+	// buffers ... the fit then reads it mapped, a strip per thread,
+	// as it would the inputs
+	if (config->stack_cache)
+		footprint += 2 * strip;
+	if (config->accumulate > 0)
+		footprint += width * height * 2 * sizeof(float);
+	// a JPEG PTM is quantised to memory before it's encoded
+	if (config->jpeg > 0)
+		footprint += width * height * (config->rgb ? 18 : 9);
+
+	return footprint;
+}
+
+// read a job file, NULL if it's malformed
+static ServeJob *
+ReadJob(ServeConfig *config, const std::string &name, const char *filename)
+{
+	char *contents;
+
+	if (!g_file_get_contents(filename, &contents, NULL, NULL))
+		return NULL;
+
+	ServeJob *job = new ServeJob;
+	char **lines = g_strsplit(contents, "\n", -1);
+	bool bad = false;
+
+	job->name = name;
+	job->basis = QUADRATIC_BIVARIATE;
+	job->crop[0] = 0;
+	job->crop[1] = 0;
+	job->crop[2] = 1000;
+	job->crop[3] = 1000;
+	job->footprint = 0;
+	job->arrived = g_get_monotonic_time();
+	job->started = 0;
+	job->finished = 0;
+	job->failed = false;
+
+	for (int i = 0; lines[i]; i++)
+	{
+		char value[STRSIZE];
+		int basis;
+
+		if (sscanf(lines[i], "lp %255s", value) == 1)
+			job->lpfile = SpoolRelative(config, value);
+		else if (sscanf(lines[i], "out %255s", value) == 1)
+			job->fname = SpoolRelative(config, value);
+		else if (sscanf(lines[i], "basis %d", &basis) == 1)
+		{
+			// as for -b, anything else is a bad job file
+			if (basis == 0)
+				job->basis = QUADRATIC_BIVARIATE;
+			else if (basis == 1)
+				job->basis = QUADRATIC_UNIVARIATE;
+			else
+				bad = true;
+		}
+		else if (sscanf(lines[i], "basis %255s", value) == 1)
+		{
+			const Basis *named = basis_lookup(value);
+
+			// an unknown basis is a bad job file
+			if (!named)
+			{
+				vips_error_clear();
+				bad = true;
+			}
+			else
+				job->basis = named->basis;
+		}
+		else if (sscanf(lines[i], "crop %d %d %d %d",
+			&job->crop[0], &job->crop[1],
+			&job->crop[2], &job->crop[3]) == 4)
+			;
+	}
+
+	g_strfreev(lines);
+	g_free(contents);
+
+	if (bad ||
+		job->lpfile.empty() ||
+		job->fname.empty())
+	{
+		delete job;
+		return NULL;
+	}
+
+	job->footprint = EstimateFootprint(config, job);
+
+	return job;
+}
+
+// record the outcome of a job in its spool file and rename it
+static void
+FinishJob(ServeConfig *config, ServeJob *job)
+{
+	std::string running = SpoolPath(config, job->name, ".running");
+	std::string done = SpoolPath(config, job->name,
+		job->failed ? ".failed" : ".done");
+	FILE *fp;
+
+	if ((fp = fopen(running.c_str(), "a")))
+	{
+		fprintf(fp, "status %s\n", job->failed ? "failed" : "ok");
+		if (!job->error.empty())
+			fprintf(fp, "error %s\n", job->error.c_str());
+		fprintf(fp, "wait %.3f\n",
+			(job->started - job->arrived) / 1000000.0);
+		fprintf(fp, "run %.3f\n",
+			(job->finished - job->started) / 1000000.0);
+		fprintf(fp, "footprint %lu\n", (unsigned long) job->footprint);
+		fclose(fp);
+	}
+
+	g_rename(running.c_str(), done.c_str());
+}
+
+static void
+RunServeJob(gpointer data, gpointer user_data)
+{
+	ServeJob *job = (ServeJob *) data;
+	ServeState *state = (ServeState *) user_data;
+	ServeConfig *config = state->config;
+
+	{
+		LinearSystem lin(job->basis, config->cache,
+			job->crop[0], job->crop[1], job->crop[2], job->crop[3]);
+		char *dir = g_path_get_dirname(job->lpfile.c_str());
+		char *lpfile = g_strdup(job->lpfile.c_str());
+		char *fname = g_strdup(job->fname.c_str());
+
+		lin.SetFastQuant(config->fast_quant);
+		lin.SetStackCache(config->stack_cache);
+		lin.SetAccumulate(config->accumulate);
+		if (config->robust)
+			lin.SetRobust(config->shadow, config->highlight,
+				config->rounds);
+		lin.SetTile(config->tile);
+		lin.SetRGB(config->rgb);
+		// only the PTM bases have JPEG formats, so jobs with other
+		// bases get their own raw format
+		lin.SetJPEG(basis_get(job->basis)->ptm ? config->jpeg : 0);
+		lin.SetSpillDir(config->spill_dir);
+		lin.SetImageDir(dir);
+		lin.SetProgress(config->jobs == 1);
+
+		// a missing or broken image throws from vips ... fail this job
+		// and keep serving
+		try
+		{
+			job->failed = lin.FitPTM(lpfile) == -1 ||
+				lin.WriteFileVersion1_2(fname) == -1;
+		}
+		catch (vips::VError &e)
+		{
+			job->failed = true;
+			// one line in the status file
+			job->error = e.what();
+			std::replace(job->error.begin(), job->error.end(),
+				'\n', ' ');
+			vips_error_clear();
+		}
+
+		g_free(dir);
+		g_free(lpfile);
+		g_free(fname);
+	}
+
+	job->finished = g_get_monotonic_time();
+	FinishJob(config, job);
+
+	double latency = (job->finished - job->arrived) / 1000000.0;
+
+	g_mutex_lock(&state->lock);
+	state->running -= 1;
+	state->memory -= job->footprint;
+	if (job->failed)
+		state->n_failed += 1;
+	else
+		state->n_done += 1;
+	state->latency_total += latency;
+	state->latency_max = VIPS_MAX(state->latency_max, latency);
+	state->latency_last = latency;
+	state->wait_total += (job->started - job->arrived) / 1000000.0;
+	g_mutex_unlock(&state->lock);
+
+	printf("%s %s in %.2fs\n",
+		job->name.c_str(), job->failed ? "FAILED" : "done", latency);
+	fflush(stdout);
+
+	delete job;
+
+	vips_thread_shutdown();
+}
+
+// pick up new jobs from the spool, oldest first ... the directory is in
+// no particular order, so sort on modification time, then name
+static void
+ScanSpool(ServeState *state)
+{
+	ServeConfig *config = state->config;
+	GDir *dir;
+	const char *filename;
+	std::vector<std::pair<gint64, std::string> > found;
+
+	if (!(dir = g_dir_open(config->spool, 0, NULL)))
+		return;
+
+	while ((filename = g_dir_read_name(dir)))
+	{
+		if (!g_str_has_suffix(filename, ".job"))
+			continue;
+
+		std::string name(filename, strlen(filename) - 4);
+		GStatBuf buf;
+
+		if (g_stat(SpoolPath(config, name, ".job").c_str(), &buf))
+			continue;
+
+		found.push_back(std::make_pair((gint64) buf.st_mtime, name));
+	}
+
+	g_dir_close(dir);
+
+	std::sort(found.begin(), found.end());
+
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		const std::string &name = found[i].second;
+		std::string job_path = SpoolPath(config, name, ".job");
+		std::string queued_path = SpoolPath(config, name, ".queued");
+
+		if (g_rename(job_path.c_str(), queued_path.c_str()))
+			continue;
+
+		ServeJob *job = ReadJob(config, name, queued_path.c_str());
+
+		if (!job)
+		{
+			printf("%s: bad job file, needs lp and out lines and "
+				"a known basis\n",
+				name.c_str());
+			g_rename(queued_path.c_str(),
+				SpoolPath(config, name, ".failed").c_str());
+			continue;
+		}
+
+		g_mutex_lock(&state->lock);
+		state->queue.push_back(job);
+		g_mutex_unlock(&state->lock);
+	}
+}
+
+// start queued jobs while we have the cores and the memory
+static void
+AdmitJobs(ServeState *state, GThreadPool *pool)
+{
+	ServeConfig *config = state->config;
+
+	g_mutex_lock(&state->lock);
+
+	while (!state->queue.empty() &&
+		state->running < config->jobs)
+	{
+		ServeJob *job = state->queue.front();
+
+		if (state->running > 0 &&
+			state->memory + job->footprint > config->memory)
+			break;
+
+		state->queue.pop_front();
+		state->running += 1;
+		state->memory += job->footprint;
+		job->started = g_get_monotonic_time();
+
+		g_rename(SpoolPath(config, job->name, ".queued").c_str(),
+			SpoolPath(config, job->name, ".running").c_str());
+		g_thread_pool_push(pool, job, NULL);
+	}
+
+	g_mutex_unlock(&state->lock);
+}
+
+static void
+WriteStatus(ServeState *state)
+{
+	ServeConfig *config = state->config;
+	int n_finished;
+	char *status;
+
+	g_mutex_lock(&state->lock);
+	n_finished = state->n_done + state->n_failed;
+	status = g_strdup_printf(
+		"queued %d\n"
+		"running %d\n"
+		"done %d\n"
+		"failed %d\n"
+		"memory %lu of %lu MB\n"
+		"latency mean %.2f max %.2f last %.2f s\n"
+		"wait mean %.2f s\n",
+		(int) state->queue.size(),
+		state->running,
+		state->n_done,
+		state->n_failed,
+		(unsigned long) (state->memory >> 20),
+		(unsigned long) (config->memory >> 20),
+		n_finished ? state->latency_total / n_finished : 0.0,
+		state->latency_max,
+		state->latency_last,
+		n_finished ? state->wait_total / n_finished : 0.0);
+	g_mutex_unlock(&state->lock);
+
+	char *filename = g_build_filename(config->spool, "status", NULL);
+	g_file_set_contents(filename, status, -1, NULL);
+	g_free(filename);
+	g_free(status);
+}
+
+// jobs left queued or running by a previous service go back in the queue
+static void
+RecoverSpool(ServeConfig *config)
+{
+	GDir *dir;
+	const char *filename;
+
+	if (!(dir = g_dir_open(config->spool, 0, NULL)))
+		return;
+
+	while ((filename = g_dir_read_name(dir)))
+	{
+		const char *suffix = strrchr(filename, '.');
+
+		if (!suffix ||
+			(strcmp(suffix, ".queued") != 0 &&
+			 strcmp(suffix, ".running") != 0))
+			continue;
+
+		std::string name(filename, suffix - filename);
+		std::string from = SpoolPath(config, name, suffix);
+
+		g_rename(from.c_str(),
+			SpoolPath(config, name, ".job").c_str());
+	}
+
+	g_dir_close(dir);
+}
+
+int
+Serve(ServeConfig *config)
+{
+	if (!g_file_test(config->spool, G_FILE_TEST_IS_DIR))
+	{
+		printf("Error: spool directory %s not found\n", config->spool);
+		return -1;
+	}
+
+	if (config->threads <= 0)
+		config->threads = vips_concurrency_get();
+	if (config->jobs <= 0)
+		config->jobs = VIPS_MAX(1, config->threads / 4);
+	vips_concurrency_set(VIPS_MAX(1, config->threads / config->jobs));
+
+	ServeState state;
+
+	state.config = config;
+	g_mutex_init(&state.lock);
+	state.running = 0;
+	state.memory = 0;
+	state.n_done = 0;
+	state.n_failed = 0;
+	state.latency_total = 0.0;
+	state.latency_max = 0.0;
+	state.latency_last = 0.0;
+	state.wait_total = 0.0;
+
+	GThreadPool *pool = g_thread_pool_new(RunServeJob,
+		&state, config->jobs, TRUE, NULL);
+
+	printf("Serving %s: %d jobs at a time with %d threads each, "
+		"%lu MB memory budget\n",
+		config->spool, config->jobs,
+		VIPS_MAX(1, config->threads / config->jobs),
+		(unsigned long) (config->memory >> 20));
+	fflush(stdout);
+
+	RecoverSpool(config);
+
+	char *stop = g_build_filename(config->spool, "stop", NULL);
+
+	while (!g_file_test(stop, G_FILE_TEST_EXISTS))
+	{
+		ScanSpool(&state);
+		AdmitJobs(&state, pool);
+		WriteStatus(&state);
+
+		g_usleep(SERVE_POLL);
+	}
+
+	g_mutex_lock(&state.lock);
+	int running = state.running;
+	g_mutex_unlock(&state.lock);
+
+	printf("Stopping, waiting for %d running jobs\n", running);
+	fflush(stdout);
+
+	// wait for running jobs, then put anything still queued back for
+	// next time
+	g_thread_pool_free(pool, FALSE, TRUE);
+	for (size_t i = 0; i < state.queue.size(); i++)
+	{
+		ServeJob *job = state.queue[i];
+
+		g_rename(SpoolPath(config, job->name, ".queued").c_str(),
+			SpoolPath(config, job->name, ".job").c_str());
+		delete job;
+	}
+	state.queue.clear();
+	WriteStatus(&state);
+
+	g_unlink(stop);
+	g_free(stop);
+	g_mutex_clear(&state.lock);
+
+	return 0;
+}
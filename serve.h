@@ -0,0 +1,40 @@
+// serve.h: run ptmfit as a local service, see serve.cpp
+//
+//////////////////////////////////////////////////////////////////////
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+
+#include "LinearSystem.h"
+
+// the settings for every job the service runs ... basis, crop and files
+// come from each job
+struct ServeConfig
+{
+	const char *spool;
+
+	// fit at most jobs at once, with threads threads between them, and
+	// keep the estimated memory of running jobs under memory bytes
+	int jobs;
+	int threads;
+	size_t memory;
+
+	Cache_e cache;
+	bool fast_quant;
+	bool stack_cache;
+	int accumulate;
+	bool robust;
+	double shadow;
+	double highlight;
+	int rounds;
+	int tile;
+	bool rgb;
+	int jpeg;
+	const char *spill_dir;
+};
+
+int Serve(ServeConfig *config);
+
+#endif /*SERVE_H*/
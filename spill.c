@@ -0,0 +1,274 @@
+/* spill computed coefficients to a temp file, finding the range of each
+ * band as we go
+ *
+ * This lets us decode and fit the input stack just once: the float
+ * coefficients land in $TMPDIR, we get the min/max we need for scale and
+ * bias for free, and the PTM write then makes a single sequential read of
+ * the spill file.
+ *
+ * The spill can go to any directory, so put it on fast scratch (NVMe, 
+ * tmpfs). vips deletes it when the image is closed, and we delete it on 
+ * exit too, even if we fail or are killed by a signal.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vips/vips.h>
+
+#include "spill.h"
+
+/* Spill files we've made, deleted by spill_cleanup(). These are fixed 
+ * buffers so the signal handler can unlink them without allocating. Several
+ * fits can spill at once in -batch mode, so spill_lock guards the table.
+ *
+ * A slot is filled completely before spill_used publishes it, and is
+ * unpublished before it's reused, so the signal handler only ever sees 
+ * whole names. Slots are freed when the spill image closes, so a long
+ * -batch or -serve run never fills the table.
+ */
+#define MAX_SPILLS (16)
+#define MAX_SPILL_PATH (4096)
+static char spill_names[MAX_SPILLS][MAX_SPILL_PATH];
+static volatile sig_atomic_t spill_used[MAX_SPILLS];
+static GMutex spill_lock;
+
+static void
+spill_cleanup( void )
+{
+	int i;
+
+	for( i = 0; i < MAX_SPILLS; i++ ) 
+		if( spill_used[i] )
+			(void) unlink( spill_names[i] );
+}
+
+static void
+spill_signal( int sig )
+{
+	spill_cleanup();
+
+	signal( sig, SIG_DFL );
+	raise( sig );
+}
+
+/* Remember a spill file so we can delete it on exit. Return the slot, or 
+ * -1 if the table is full.
+ */
+static int
+spill_register( const char *filename )
+{
+	static gboolean installed = FALSE;
+
+	int i;
+
+	if( strlen( filename ) >= MAX_SPILL_PATH ) {
+		vips_error( "spill_coeffs", "%s", _( "spill path too long" ) );
+		return( -1 );
+	}
+
+	g_mutex_lock( &spill_lock );
+
+	for( i = 0; i < MAX_SPILLS; i++ )
+		if( !spill_used[i] )
+			break;
+	if( i == MAX_SPILLS ) {
+		g_mutex_unlock( &spill_lock );
+		vips_error( "spill_coeffs", "%s", _( "too many spill files" ) );
+		return( -1 );
+	}
+
+	if( !installed ) {
+		atexit( spill_cleanup );
+		signal( SIGINT, spill_signal );
+		signal( SIGTERM, spill_signal );
+#ifdef SIGHUP
+		signal( SIGHUP, spill_signal );
+#endif /*SIGHUP*/
+
+		installed = TRUE;
+	}
+
+	strcpy( spill_names[i], filename );
+	__sync_synchronize();
+	spill_used[i] = 1;
+
+	g_mutex_unlock( &spill_lock );
+
+	return( i );
+}
+
+static void
+spill_unregister( int slot )
+{
+	g_mutex_lock( &spill_lock );
+	spill_used[slot] = 0;
+	__sync_synchronize();
+	g_mutex_unlock( &spill_lock );
+}
+
+/* The spill image has closed. vips deletes the file as the image is 
+ * finalized, but delete it now so it's never untracked and still there.
+ */
+static void
+spill_postclose( VipsImage *image, gpointer user_data )
+{
+	int slot = GPOINTER_TO_INT( user_data );
+
+	(void) unlink( spill_names[slot] );
+	spill_unregister( slot );
+}
+
+/* Make a .v file to spill to in @dir, or $TMPDIR for NULL.
+ */
+static VipsImage *
+spill_new( const char *dir )
+{
+	static int serial = 0;
+
+	char *name;
+	char *filename;
+	int slot;
+	VipsImage *image;
+
+	name = g_strdup_printf( "ptmfit-spill-%d-%d.v", 
+		(int) getpid(), g_atomic_int_add( &serial, 1 ) );
+	filename = g_build_filename( dir ? dir : g_get_tmp_dir(), name, NULL );
+	g_free( name );
+
+	if( (slot = spill_register( filename )) < 0 ) {
+		g_free( filename );
+		return( NULL );
+	}
+	if( !(image = vips_image_new_from_file_mode( filename, "w" )) ) {
+		spill_unregister( slot );
+		g_free( filename );
+		return( NULL );
+	}
+	vips_image_set_delete_on_close( image, TRUE );
+	g_signal_connect( image, "postclose", 
+		G_CALLBACK( spill_postclose ), GINT_TO_POINTER( slot ) );
+	g_free( filename );
+
+	return( image );
+}
+
+/* What we track during a spill.
+ */
+typedef struct {
+	VipsImage *in;
+	VipsImage *out;
+
+	/* Range of each band, seen so far.
+	 */
+	double *min;
+	double *max;
+} Spill;
+
+static int
+spill_block( VipsRegion *region, VipsRect *area, void *a )
+{
+	Spill *spill = (Spill *) a;
+	int bands = spill->in->Bands;
+	double * restrict min = spill->min;
+	double * restrict max = spill->max;
+
+	int x, y, i;
+
+	for( y = 0; y < area->height; y++ ) {
+		VipsPel *line =
+			VIPS_REGION_ADDR( region, area->left, area->top + y );
+		float * restrict p = (float *) line;
+
+		for( x = 0; x < area->width; x++ ) {
+			for( i = 0; i < bands; i++ ) {
+				float v = p[i];
+
+				if( v < min[i] )
+					min[i] = v;
+				if( v > max[i] )
+					max[i] = v;
+			}
+
+			p += bands;
+		}
+
+		if( vips_image_write_line( spill->out, area->top + y, line ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Write @in to a temp file in @dir, or $TMPDIR for NULL, returning it as 
+ * @out, ready to be read back. @min and @max must have space for 
+ * @in->Bands doubles and are set to the range of each band.
+ */
+int
+spill_coeffs( VipsImage *in, const char *dir, 
+	VipsImage **out, double *min, double *max )
+{
+	Spill spill;
+	int i;
+
+	if( vips_check_format( "spill_coeffs", in, VIPS_FORMAT_FLOAT ) ||
+		vips_check_uncoded( "spill_coeffs", in ) )
+		return( -1 );
+
+	spill.in = in;
+	spill.min = min;
+	spill.max = max;
+	for( i = 0; i < in->Bands; i++ ) {
+		min[i] = FLT_MAX;
+		max[i] = -FLT_MAX;
+	}
+
+	if( !(spill.out = spill_new( dir )) )
+		return( -1 );
+	if( vips_image_pipelinev( spill.out,
+		VIPS_DEMAND_STYLE_THINSTRIP, in, NULL ) ) {
+		g_object_unref( spill.out );
+		return( -1 );
+	}
+
+	/* sink_disc gives us full-width strips in top-to-bottom order, so we
+	 * can append them with write_line.
+	 */
+	if( vips_sink_disc( in, spill_block, &spill ) ||
+		vips_image_pio_input( spill.out ) ) {
+		g_object_unref( spill.out );
+		return( -1 );
+	}
+
+#ifdef HAVE_POSIX_FADVISE
+	/* We'll read it back once, top to bottom, through an mmap of this 
+	 * fd, so ask for lots of readahead.
+	 */
+	if( spill.out->fd != -1 )
+		(void) posix_fadvise( spill.out->fd, 0, 0, 
+			POSIX_FADV_SEQUENTIAL );
+#endif /*HAVE_POSIX_FADVISE*/
+
+#ifdef DEBUG
+	printf( "spill_coeffs: spilled to \"%s\"\n", spill.out->filename );
+	for( i = 0; i < in->Bands; i++ )
+		printf( "band %d: min = %g, max = %g\n", i, min[i], max[i] );
+#endif /*DEBUG*/
+
+	*out = spill.out;
+
+	return( 0 );
+}
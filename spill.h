@@ -0,0 +1,21 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+int spill_coeffs( VipsImage *in, const char *dir, 
+	VipsImage **out, double *min, double *max );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*SPILL_H*/
@@ -0,0 +1,255 @@
+/* a pixel-major cache of the input light stack
+ *
+ * Fitting pulls a region from all N input images for every strip, so we 
+ * have N live decoders and N scattered reads, and we do it all again each
+ * time the stack is reloaded. Instead, we can decode the inputs once and
+ * bandjoin them into a single 3N-band uchar .v file in $TMPDIR, so each pixel
+ * holds the N RGB triples side by side. vips memory-maps .v files, so the
+ * fit then reads the stack with no decode and no copy.
+ *
+ * The file is uncropped and full size, and is named from the full paths of
+ * the inputs, so refits with a different basis, crop or quantisation pick it
+ * up again. The sizes and modification times of the inputs are hashed into
+ * a key in the file's metadata, and if an input has changed since, the key
+ * won't match and we replace the stale cache with a fresh one, so there's
+ * only ever one cache per set of inputs.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+#include "stackcache.h"
+
+/* The metadata item we keep the key in.
+ */
+#define STACK_CACHE_KEY "ptmfit-stack-key"
+
+/* The cache file for a stack of images. Free the result with g_free().
+ */
+char *
+stack_cache_filename( int n, char **filenames )
+{
+	GChecksum *checksum;
+	char *name;
+	char *filename;
+	int i;
+
+	checksum = g_checksum_new( G_CHECKSUM_SHA1 );
+
+	for( i = 0; i < n; i++ ) {
+		char *path;
+
+		/* Hash the full path, so the same name in another directory 
+		 * makes another cache.
+		 */
+		if( g_path_is_absolute( filenames[i] ) )
+			path = g_strdup( filenames[i] );
+		else {
+			char *cwd = g_get_current_dir();
+
+			path = g_build_filename( cwd, filenames[i], NULL );
+			g_free( cwd );
+		}
+		g_checksum_update( checksum, (guchar *) path, strlen( path ) + 1 );
+		g_free( path );
+	}
+
+	name = g_strdup_printf( "ptmfit-stack-%s.v", 
+		g_checksum_get_string( checksum ) );
+	filename = g_build_filename( g_get_tmp_dir(), name, NULL );
+	g_free( name );
+	g_checksum_free( checksum );
+
+	return( filename );
+}
+
+/* The sizes and modification times of the inputs, hashed. Free the result 
+ * with g_free().
+ */
+static char *
+stack_cache_key( int n, char **filenames )
+{
+	GChecksum *checksum;
+	char *key;
+	int i;
+
+	checksum = g_checksum_new( G_CHECKSUM_SHA1 );
+
+	for( i = 0; i < n; i++ ) {
+		GStatBuf st;
+		gint64 stamp[2];
+
+		stamp[0] = 0;
+		stamp[1] = 0;
+		if( !g_stat( filenames[i], &st ) ) {
+			stamp[0] = st.st_size;
+			stamp[1] = st.st_mtime;
+		}
+		g_checksum_update( checksum, (guchar *) stamp, sizeof( stamp ) );
+	}
+
+	key = g_strdup( g_checksum_get_string( checksum ) );
+	g_checksum_free( checksum );
+
+	return( key );
+}
+
+/* Open the cache in @filename, or NULL if it's missing or isn't a stack of
+ * @n images with @key.
+ */
+static VipsImage *
+stack_cache_open( const char *filename, int n, const char *key )
+{
+	VipsImage *image;
+	const char *found;
+
+	if( !g_file_test( filename, G_FILE_TEST_EXISTS ) ||
+		!(image = vips_image_new_from_file( filename, NULL )) ) {
+		vips_error_clear();
+		return( NULL );
+	}
+
+	if( image->Bands != 3 * n ||
+		image->BandFmt != VIPS_FORMAT_UCHAR ||
+		vips_image_get_string( image, STACK_CACHE_KEY, &found ) ||
+		strcmp( found, key ) != 0 ) {
+		vips_error_clear();
+		g_object_unref( image );
+		return( NULL );
+	}
+
+	return( image );
+}
+
+/* TRUE if there's an up to date cache for these images.
+ */
+gboolean
+stack_cache_fresh( int n, char **filenames )
+{
+	char *filename = stack_cache_filename( n, filenames );
+	char *key = stack_cache_key( n, filenames );
+	VipsImage *image;
+
+	image = stack_cache_open( filename, n, key );
+	g_free( filename );
+	g_free( key );
+	if( !image )
+		return( FALSE );
+	g_object_unref( image );
+
+	return( TRUE );
+}
+
+/* Decode the stack and write it to @filename. We write to a name with our
+ * pid in first and rename, so a crash or a second ptmfit can't see a 
+ * half-written cache.
+ */
+static int
+stack_cache_build( int n, char **filenames, 
+	const char *filename, const char *key )
+{
+	VipsImage *context = vips_image_new();
+	VipsImage **t = (VipsImage **) vips_object_local_array( 
+		VIPS_OBJECT( context ), n + 1 );
+
+	char *partial;
+	int i;
+
+	for( i = 0; i < n; i++ ) {
+		if( !(t[i] = vips_image_new_from_file( filenames[i], 
+			"access", VIPS_ACCESS_SEQUENTIAL,
+			NULL )) ||
+			vips_check_uncoded( "stack_cache", t[i] ) ||
+			vips_check_bands( "stack_cache", t[i], 3 ) ||
+			vips_check_format( "stack_cache", t[i], 
+				VIPS_FORMAT_UCHAR ) ||
+			vips_check_size_same( "stack_cache", t[0], t[i] ) ) {
+			g_object_unref( context );
+			return( -1 );
+		}
+	}
+
+	if( vips_bandjoin( t, &t[n], n, NULL ) ) {
+		g_object_unref( context );
+		return( -1 );
+	}
+	vips_image_set_string( t[n], STACK_CACHE_KEY, key );
+
+	partial = g_strdup_printf( "%.*s-%d.v", 
+		(int) strlen( filename ) - 2, filename, (int) getpid() );
+	if( vips_image_write_to_file( t[n], partial, NULL ) ) {
+		g_unlink( partial );
+		g_free( partial );
+		g_object_unref( context );
+		return( -1 );
+	}
+	g_object_unref( context );
+
+	if( g_rename( partial, filename ) ) {
+		vips_error_system( errno, "stack_cache", 
+			_( "unable to rename \"%s\"" ), partial );
+		g_unlink( partial );
+		g_free( partial );
+		return( -1 );
+	}
+	g_free( partial );
+
+	return( 0 );
+}
+
+/* Load the stack of @n images in @filenames as a single 3 * @n band image, 
+ * building the cache file first if we have to. A stale cache is replaced.
+ */
+int
+stack_cache_load( int n, char **filenames, VipsImage **out )
+{
+	char *filename;
+	char *key;
+
+	filename = stack_cache_filename( n, filenames );
+	key = stack_cache_key( n, filenames );
+
+	if( !(*out = stack_cache_open( filename, n, key )) ) {
+#ifdef DEBUG
+		printf( "stack_cache_load: building \"%s\"\n", filename );
+#endif /*DEBUG*/
+
+		/* The new cache is renamed over any stale one, but unlink
+		 * first anyway, so a failed build doesn't leave it behind.
+		 */
+		g_unlink( filename );
+
+		if( stack_cache_build( n, filenames, filename, key ) ) {
+			g_free( filename );
+			g_free( key );
+			return( -1 );
+		}
+
+		if( !(*out = stack_cache_open( filename, n, key )) ) {
+			vips_error( "stack_cache", 
+				"%s", _( "bad stack cache file" ) );
+			g_free( filename );
+			g_free( key );
+			return( -1 );
+		}
+	}
+	g_free( filename );
+	g_free( key );
+
+	return( 0 );
+}
@@ -0,0 +1,22 @@
+#ifndef STACKCACHE_H
+#define STACKCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+char *stack_cache_filename( int n, char **filenames );
+gboolean stack_cache_fresh( int n, char **filenames );
+int stack_cache_load( int n, char **filenames, VipsImage **out );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*STACKCACHE_H*/
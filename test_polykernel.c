@@ -0,0 +1,467 @@
+/* check every fitting kernel against polykernel_scalar
+ *
+ * Run by make check. We make a dome of lights and a row of synthetic
+ * pixels, each shaded by its own normal and colour, and fit the row with
+ * every kernel in the registry this CPU can run, then compare with the
+ * scalar reference:
+ *
+ * 	- the plain floating point kernels, specialised for the matrix size
+ * 	  if they can be, against polykernel_scalar()
+ * 	- the fixed-point kernels against polykernel_scalar_fixed(), which
+ * 	  they must match
+ * 	- the robust kernels with no rounds and no lights excluded, which
+ * 	  must give the least squares fit, against polykernel_scalar()
+ * 	- the RGB kernels against the pseudo-inverse applied in double, since
+ * 	  there's no scalar RGB kernel
+ *
+ * Rows are fitted both from separate images and from a stack image, see
+ * stackcache.c, with widths which leave a partial batch at the end.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#include "basis.h"
+#include "polykernel.h"
+
+/* Pixels in a test row.
+ */
+#define TEST_WIDTH (37)
+
+/* Floating point kernels must match the reference to this much, plus this
+ * much relative. Coefficients are scaled to 0 - 255.
+ */
+#define TEST_ABS (0.01)
+#define TEST_REL (1e-4)
+
+/* The robust kernels solve the normal equations in float, so they're a
+ * little further off.
+ */
+#define TEST_ROBUST_ABS (0.05)
+#define TEST_ROBUST_REL (1e-3)
+
+/* A fit to test: the dome and the pixels for a basis and a number of
+ * lights.
+ */
+typedef struct _Test {
+	const Basis *basis;
+	int m;
+	int n;
+
+	/* The pseudo-inverse, n wide and m high, and the basis, m wide and
+	 * n high, as matrix images.
+	 */
+	VipsImage *pinv;
+	VipsImage *B;
+
+	/* Each image as a separate row of TEST_WIDTH RGB pixels, and the same
+	 * pixels as a stack, 3n bands.
+	 */
+	VipsPel *images;
+	VipsPel *stack;
+} Test;
+
+static void
+test_free( Test *test )
+{
+	VIPS_UNREF( test->pinv );
+	VIPS_UNREF( test->B );
+	VIPS_FREE( test->images );
+	VIPS_FREE( test->stack );
+}
+
+/* Solve for the pseudo-inverse (B^T B)^-1 B^T with Gauss-Jordan.
+ */
+static int
+test_pinv( Test *test )
+{
+	int m = test->m;
+	int n = test->n;
+	double *a = VIPS_ARRAY( NULL, m * 2 * m, double );
+
+	int i, j, k;
+
+	if( !a )
+		return( -1 );
+
+	/* [ B^T B | I ].
+	 */
+	for( j = 0; j < m; j++ )
+		for( k = 0; k < m; k++ ) {
+			double sum;
+
+			sum = 0.0;
+			for( i = 0; i < n; i++ )
+				sum += *VIPS_MATRIX( test->B, j, i ) *
+					*VIPS_MATRIX( test->B, k, i );
+			a[j * 2 * m + k] = sum;
+			a[j * 2 * m + m + k] = j == k ? 1.0 : 0.0;
+		}
+
+	for( j = 0; j < m; j++ ) {
+		int pivot = j;
+		double d;
+
+		for( k = j + 1; k < m; k++ )
+			if( fabs( a[k * 2 * m + j] ) >
+				fabs( a[pivot * 2 * m + j] ) )
+				pivot = k;
+		if( fabs( a[pivot * 2 * m + j] ) < 1e-12 ) {
+			vips_error( "test_polykernel", "%s", "singular dome" );
+			g_free( a );
+			return( -1 );
+		}
+		for( k = 0; k < 2 * m; k++ ) {
+			double t = a[j * 2 * m + k];
+
+			a[j * 2 * m + k] = a[pivot * 2 * m + k];
+			a[pivot * 2 * m + k] = t;
+		}
+
+		d = a[j * 2 * m + j];
+		for( k = 0; k < 2 * m; k++ )
+			a[j * 2 * m + k] /= d;
+
+		for( i = 0; i < m; i++ )
+			if( i != j ) {
+				double f = a[i * 2 * m + j];
+
+				for( k = 0; k < 2 * m; k++ )
+					a[i * 2 * m + k] -=
+						f * a[j * 2 * m + k];
+			}
+	}
+
+	/* (B^T B)^-1 B^T.
+	 */
+	for( j = 0; j < m; j++ )
+		for( i = 0; i < n; i++ ) {
+			double sum;
+
+			sum = 0.0;
+			for( k = 0; k < m; k++ )
+				sum += a[j * 2 * m + m + k] *
+					*VIPS_MATRIX( test->B, k, i );
+			*VIPS_MATRIX( test->pinv, i, j ) = sum;
+		}
+
+	g_free( a );
+
+	return( 0 );
+}
+
+/* Lights on a spiral over the dome, from about 15 to 70 degrees up, and
+ * pixels lit by them.
+ */
+static int
+test_init( Test *test, Basis_e basis, int n, GRand *rand )
+{
+	double lights[3 * 128];
+	double row[BASIS_MAX_TERMS];
+
+	int i, j, x, c;
+
+	test->basis = basis_get( basis );
+	test->m = test->basis->terms;
+	test->n = n;
+	test->B = vips_image_new_matrix( test->m, n );
+	test->pinv = vips_image_new_matrix( n, test->m );
+	test->images = VIPS_ARRAY( NULL, n * TEST_WIDTH * 3, VipsPel );
+	test->stack = VIPS_ARRAY( NULL, n * TEST_WIDTH * 3, VipsPel );
+	if( !test->images ||
+		!test->stack )
+		return( -1 );
+
+	for( i = 0; i < n; i++ ) {
+		double r = 0.25 + 0.7 * (i + 0.5) / n;
+		double theta = i * 2.39996;
+
+		lights[3 * i] = r * cos( theta );
+		lights[3 * i + 1] = r * sin( theta );
+		lights[3 * i + 2] = sqrt( 1.0 - r * r );
+
+		test->basis->row( lights[3 * i], lights[3 * i + 1],
+			lights[3 * i + 2], row );
+		for( j = 0; j < test->m; j++ )
+			*VIPS_MATRIX( test->B, j, i ) = row[j];
+	}
+
+	if( test_pinv( test ) )
+		return( -1 );
+
+	for( x = 0; x < TEST_WIDTH; x++ ) {
+		double normal[3];
+		double colour[3];
+		double length;
+
+		normal[0] = g_rand_double_range( rand, -0.5, 0.5 );
+		normal[1] = g_rand_double_range( rand, -0.5, 0.5 );
+		normal[2] = 1.0;
+		length = sqrt( normal[0] * normal[0] +
+			normal[1] * normal[1] + 1.0 );
+		for( c = 0; c < 3; c++ ) {
+			normal[c] /= length;
+			colour[c] = g_rand_double_range( rand, 0.2, 1.0 );
+		}
+
+		for( i = 0; i < n; i++ ) {
+			double shade = VIPS_MAX( 0.0,
+				normal[0] * lights[3 * i] +
+				normal[1] * lights[3 * i + 1] +
+				normal[2] * lights[3 * i + 2] );
+
+			for( c = 0; c < 3; c++ ) {
+				double v = 255.0 * colour[c] *
+					(0.1 + 0.9 * shade) +
+					g_rand_double_range( rand, -4.0, 4.0 );
+				VipsPel p = VIPS_CLIP( 0, VIPS_RINT( v ), 255 );
+
+				test->images[(i * TEST_WIDTH + x) * 3 + c] = p;
+				test->stack[(x * n + i) * 3 + c] = p;
+			}
+		}
+	}
+
+	return( 0 );
+}
+
+/* Point a row at the first TEST_WIDTH - @skip pixels of the separate
+ * images, or of the stack.
+ */
+static void
+test_row( Test *test, PolyRow *row, VipsPel **p, gboolean stack, int skip,
+	float *q, gboolean rgb, double *R )
+{
+	int i;
+
+	for( i = 0; i < test->n; i++ )
+		p[i] = stack ?
+			test->stack + i * 3 :
+			test->images + i * TEST_WIDTH * 3;
+
+	row->p = p;
+	row->stride = stack ? test->n * 3 : 3;
+	row->width = TEST_WIDTH - skip;
+	row->q = q;
+	row->rgb = rgb;
+	row->R = R;
+}
+
+/* Compare @n floats, print a line and return FALSE if any are more than
+ * @tolerance plus @relative of the reference apart.
+ */
+static gboolean
+test_compare( const char *what, const float *q, const float *ref, int n,
+	double tolerance, double relative )
+{
+	int i;
+
+	for( i = 0; i < n; i++ )
+		if( fabs( q[i] - ref[i] ) >
+			tolerance + relative * fabs( ref[i] ) ) {
+			printf( "%s: FAILED, element %d is %.9g, "
+				"should be %.9g\n",
+				what, i, q[i], ref[i] );
+			return( FALSE );
+		}
+
+	return( TRUE );
+}
+
+/* Test one kernel from the registry on a fit. Return the number of
+ * failures.
+ */
+static int
+test_kernel( Test *test, PolyKernel *kernel )
+{
+	VipsImage *context = vips_image_new();
+	int m = test->m;
+	int n = test->n;
+	int size = TEST_WIDTH * 3 * m;
+
+	PolyMatrix M;
+	PolyMatrix robust;
+	PolyRow row;
+	VipsPel **p;
+	float *q;
+	float *ref;
+	double *R;
+	char what[256];
+	int failed;
+	int stack;
+	int skip;
+	int rgb;
+	int x, c, i, j;
+
+	failed = 0;
+	if( polymatrix_init( &M, VIPS_OBJECT( context ), test->pinv ) ||
+		polymatrix_init( &robust, VIPS_OBJECT( context ),
+			test->pinv ) ||
+		polymatrix_robust_init( &robust, VIPS_OBJECT( context ),
+			test->B, 0.0, 255.0, 0 ) ||
+		!(p = VIPS_ARRAY( VIPS_OBJECT( context ), n, VipsPel * )) ||
+		!(q = VIPS_ARRAY( VIPS_OBJECT( context ), size, float )) ||
+		!(ref = VIPS_ARRAY( VIPS_OBJECT( context ), size, float )) ||
+		!(R = VIPS_ARRAY( VIPS_OBJECT( context ),
+			polymatrix_scratch( &robust ), double )) ) {
+		printf( "%s\n", vips_error_buffer() );
+		g_object_unref( context );
+		return( 1 );
+	}
+
+	for( stack = 0; stack < 2; stack++ )
+		for( skip = 0; skip < 2; skip++ )
+			for( rgb = 0; rgb < 2; rgb++ ) {
+				int qstride = (rgb ? 3 : 0) + m;
+				int elements = (TEST_WIDTH - skip) * qstride;
+
+				vips_snprintf( what, 256,
+					"%s, %s, m = %d, n = %d, %s, "
+					"width %d%s",
+					kernel->name, test->basis->name, m, n,
+					stack ? "stack" : "images",
+					TEST_WIDTH - skip,
+					rgb ? ", with colour" : "" );
+
+				test_row( test, &row, p, stack, skip,
+					ref, rgb, R );
+				if( kernel->fixed )
+					polykernel_scalar_fixed( &M, &row );
+				else
+					polykernel_scalar( &M, &row );
+				test_row( test, &row, p, stack, skip,
+					q, rgb, R );
+				polykernel_specialise( kernel, &M )( &M, &row );
+				if( !test_compare( what, q, ref, elements,
+					TEST_ABS, TEST_REL ) )
+					failed += 1;
+
+				vips_snprintf( what, 256,
+					"%s robust, %s, m = %d, n = %d, %s, "
+					"width %d%s",
+					kernel->name, test->basis->name, m, n,
+					stack ? "stack" : "images",
+					TEST_WIDTH - skip,
+					rgb ? ", with colour" : "" );
+
+				test_row( test, &row, p, stack, skip,
+					ref, rgb, R );
+				polykernel_scalar( &M, &row );
+				test_row( test, &row, p, stack, skip,
+					q, rgb, R );
+				kernel->robust( &robust, &row );
+				if( !test_compare( what, q, ref, elements,
+					TEST_ROBUST_ABS, TEST_ROBUST_REL ) )
+					failed += 1;
+			}
+
+	/* Each sample of an RGB fit is a channel of a pixel through the
+	 * pseudo-inverse.
+	 */
+	for( stack = 0; stack < 2; stack++ )
+		for( skip = 0; skip < 2; skip++ ) {
+			int width = TEST_WIDTH - skip;
+
+			vips_snprintf( what, 256,
+				"%s rgb, %s, m = %d, n = %d, %s, width %d",
+				kernel->name, test->basis->name, m, n,
+				stack ? "stack" : "images", width );
+
+			test_row( test, &row, p, stack, skip, q, FALSE, R );
+			for( x = 0; x < width; x++ )
+				for( c = 0; c < 3; c++ )
+					for( j = 0; j < m; j++ ) {
+						double *coeff =
+							M.coeff + j * n;
+						int offset =
+							x * row.stride + c;
+						double sum;
+
+						sum = 0.0;
+						for( i = 0; i < n; i++ )
+							sum += coeff[i] *
+								p[i][offset];
+						ref[(x * 3 + c) * m + j] = sum;
+					}
+			kernel->rgb( &M, &row );
+			if( !test_compare( what, q, ref, width * 3 * m,
+				TEST_ABS, TEST_REL ) )
+				failed += 1;
+		}
+
+	g_object_unref( context );
+
+	return( failed );
+}
+
+int
+main( int argc, char **argv )
+{
+	/* Two sizes with specialised kernels, and two without.
+	 */
+	static const struct {
+		Basis_e basis;
+		int n;
+	} fits[] = {
+		{ QUADRATIC_UNIVARIATE, 24 },
+		{ QUADRATIC_BIVARIATE, 48 },
+		{ QUADRATIC_BIVARIATE, 37 },
+		{ CUBIC_BIVARIATE, 40 }
+	};
+
+	GRand *rand;
+	int failed;
+	int tested;
+	int i, k;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( "unable to start VIPS" );
+
+	rand = g_rand_new_with_seed( 42 );
+	failed = 0;
+	tested = 0;
+
+	for( i = 0; i < VIPS_NUMBER( fits ); i++ ) {
+		Test test = { 0 };
+
+		if( test_init( &test, fits[i].basis, fits[i].n, rand ) ) {
+			printf( "%s\n", vips_error_buffer() );
+			test_free( &test );
+			return( 1 );
+		}
+
+		for( k = 0; k < polykernel_n_kernels(); k++ ) {
+			const char *name = polykernel_nth_name( k );
+
+			if( polykernel_select( name ) ) {
+				vips_error_clear();
+				if( i == 0 )
+					printf( "%s: not supported on this "
+						"CPU, skipped\n", name );
+				continue;
+			}
+
+			failed += test_kernel( &test, polykernel_get() );
+			tested += 1;
+		}
+
+		test_free( &test );
+	}
+
+	g_rand_free( rand );
+
+	printf( "%d kernels and fits tested, %d comparisons failed\n",
+		tested, failed );
+
+	vips_shutdown();
+
+	return( failed > 0 ? 1 : 0 );
+}
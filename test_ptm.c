@@ -0,0 +1,462 @@
+/* write a PTM, map it and relight it
+ *
+ * Run by make check. We make a small image of coefficients, write it with
+ * writeptm() as LRGB and RGB, for a standard PTM, a basis with unused PTM
+ * coefficients and a basis with its own format, and again with
+ * writeptm_sequential(), which must make the same file. Then we map each
+ * file with readptm_open(), check the header, relight it from a few
+ * directions with relight(), and compare with the polynomials evaluated
+ * directly. The only difference should be quantisation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+#include "basis.h"
+#include "writeptm.h"
+#include "readptm.h"
+#include "relight.h"
+
+/* An odd size, so the writer has partial strips and tiles.
+ */
+#define TEST_WIDTH (67)
+#define TEST_HEIGHT (43)
+
+/* A PTM to test: its coefficients, and their scale and bias.
+ */
+typedef struct _Test {
+	const Basis *basis;
+	int channels;
+	int bands;
+
+	/* TEST_WIDTH x TEST_HEIGHT pixels of bands floats, as writeptm()
+	 * takes them, top row first.
+	 */
+	float *coeff;
+	VipsImage *image;
+
+	double scale[BASIS_MAX_TERMS];
+	int bias[BASIS_MAX_TERMS];
+} Test;
+
+static void
+test_free( Test *test )
+{
+	VIPS_UNREF( test->image );
+	VIPS_FREE( test->coeff );
+}
+
+static float *
+test_pixel( Test *test, int x, int y )
+{
+	return( test->coeff + ((size_t) y * TEST_WIDTH + x) * test->bands );
+}
+
+/* Coefficient @k of channel @c. LRGB is RGB then the terms, RGB is all the
+ * terms for each channel.
+ */
+static float *
+test_coeff( Test *test, int x, int y, int c, int k )
+{
+	float *p = test_pixel( test, x, y );
+
+	if( test->channels == 1 )
+		return( p + 3 + k );
+	else
+		return( p + c * test->basis->terms + k );
+}
+
+/* Random coefficients around a mid-grey surface. Term 0 is the constant
+ * for the polynomial bases.
+ */
+static int
+test_init( Test *test, Basis_e basis, int channels, GRand *rand )
+{
+	int terms;
+	int x, y, c, k;
+
+	test->basis = basis_get( basis );
+	test->channels = channels;
+	terms = test->basis->terms;
+	test->bands = channels == 1 ? 3 + terms : 3 * terms;
+	if( !(test->coeff = VIPS_ARRAY( NULL,
+		TEST_WIDTH * TEST_HEIGHT * test->bands, float )) )
+		return( -1 );
+
+	for( y = 0; y < TEST_HEIGHT; y++ )
+		for( x = 0; x < TEST_WIDTH; x++ ) {
+			float *p = test_pixel( test, x, y );
+
+			/* LRGB colour is written as bytes.
+			 */
+			if( channels == 1 )
+				for( c = 0; c < 3; c++ )
+					p[c] = g_rand_int_range( rand, 0, 256 );
+
+			for( c = 0; c < channels; c++ )
+				for( k = 0; k < terms; k++ ) {
+					float *q =
+						test_coeff( test, x, y, c, k );
+
+					if( k == 0 )
+						*q = g_rand_double_range( rand,
+							100.0, 180.0 );
+					else
+						*q = g_rand_double_range( rand,
+							-40.0, 40.0 );
+				}
+		}
+
+	/* Scale and bias to cover each term, with a step to spare so
+	 * nothing rounds out of range.
+	 */
+	for( k = 0; k < terms; k++ ) {
+		double min = G_MAXDOUBLE;
+		double max = -G_MAXDOUBLE;
+
+		for( y = 0; y < TEST_HEIGHT; y++ )
+			for( x = 0; x < TEST_WIDTH; x++ )
+				for( c = 0; c < channels; c++ ) {
+					float *q = test_coeff( test,
+						x, y, c, k );
+
+					min = VIPS_MIN( min, *q );
+					max = VIPS_MAX( max, *q );
+				}
+
+		test->scale[k] = (max - min) / 254.0;
+		test->bias[k] = VIPS_RINT( -min / test->scale[k] );
+	}
+
+	if( !(test->image = vips_image_new_from_memory( test->coeff,
+		(size_t) TEST_WIDTH * TEST_HEIGHT *
+			test->bands * sizeof( float ),
+		TEST_WIDTH, TEST_HEIGHT, test->bands, VIPS_FORMAT_FLOAT )) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Write the test PTM to a temporary file, with writeptm() or
+ * writeptm_sequential(). Free the filename with g_free().
+ */
+static char *
+test_write( Test *test, gboolean sequential )
+{
+	GError *error = NULL;
+	WritePtmInfo info;
+	char *filename;
+	int fd;
+	int result;
+
+	if( (fd = g_file_open_tmp( "test_ptm-XXXXXX.ptm",
+		&filename, &error )) == -1 ) {
+		vips_error( "test_ptm", "%s", error->message );
+		g_error_free( error );
+		return( NULL );
+	}
+
+	if( sequential ) {
+		VipsImage *flipped;
+
+		/* writeptm_sequential() takes the image bottom row first.
+		 */
+		if( vips_flip( test->image, &flipped,
+			VIPS_DIRECTION_VERTICAL, NULL ) )
+			result = -1;
+		else {
+			result = writeptm_sequential( flipped, fd, test->basis,
+				test->scale, test->bias, &info );
+			g_object_unref( flipped );
+		}
+		close( fd );
+	}
+	else {
+		close( fd );
+		result = writeptm( test->image, filename, test->basis,
+			test->scale, test->bias, &info );
+	}
+
+	if( result ||
+		info.clipped > 0 ) {
+		if( !result )
+			vips_error( "test_ptm", "%" G_GUINT64_FORMAT
+				" coefficients clipped", info.clipped );
+		g_unlink( filename );
+		g_free( filename );
+		return( NULL );
+	}
+
+	return( filename );
+}
+
+/* Relight @ptm from @lx, @ly and compare with the coefficients in @test.
+ */
+static gboolean
+test_relight( Test *test, ReadPtm *ptm, const char *what,
+	double lx, double ly )
+{
+	double lz = sqrt( 1.0 - lx * lx - ly * ly );
+	int terms = test->basis->terms;
+
+	double row[BASIS_MAX_TERMS];
+	double step;
+	VipsImage *image;
+	VipsPel *pixels;
+	size_t length;
+	int x, y, c, k;
+
+	test->basis->row( lx, ly, lz, row );
+
+	/* Each coefficient is within half a step of its value.
+	 */
+	step = 0.0;
+	for( k = 0; k < terms; k++ )
+		step += test->scale[k] / 2.0 * fabs( row[k] );
+
+	if( relight( ptm, lx, ly, lz, &image ) )
+		return( FALSE );
+	if( !(pixels = vips_image_write_to_memory( image, &length )) ) {
+		g_object_unref( image );
+		return( FALSE );
+	}
+	g_object_unref( image );
+
+	for( y = 0; y < TEST_HEIGHT; y++ )
+		for( x = 0; x < TEST_WIDTH; x++ ) {
+			float *p = test_pixel( test, x, y );
+			VipsPel *q = pixels + 3 * (y * TEST_WIDTH + x);
+
+			for( c = 0; c < 3; c++ ) {
+				int channel = test->channels == 1 ? 0 : c;
+				double error = step;
+				double v;
+
+				v = 0.0;
+				for( k = 0; k < terms; k++ )
+					v += row[k] *
+						*test_coeff( test, x, y,
+							channel, k );
+
+				/* LRGB is the colour times the luminance,
+				 * 0 - 1.
+				 */
+				if( test->channels == 1 ) {
+					v *= p[c] / 255.0;
+					error *= p[c] / 255.0;
+				}
+				v = VIPS_CLIP( 0.0, v, 255.0 );
+
+				if( fabs( q[c] - v ) > error + 1.0 ) {
+					printf( "%s: FAILED, light %g, %g, "
+						"pixel %d, %d band %d is %d, "
+						"should be %g\n",
+						what, lx, ly, x, y, c,
+						q[c], v );
+					g_free( pixels );
+					return( FALSE );
+				}
+			}
+		}
+
+	g_free( pixels );
+
+	return( TRUE );
+}
+
+/* Map @filename, check the header and relight it. Return TRUE if it's all
+ * within quantisation of the coefficients.
+ */
+static gboolean
+test_read( Test *test, const char *what, const char *filename )
+{
+	static const double lights[][2] = {
+		{ 0.0, 0.0 },
+		{ 0.5, 0.0 },
+		{ -0.3, 0.6 },
+		{ 0.4, -0.7 }
+	};
+
+	const Basis *basis;
+	ReadPtm *ptm;
+	char *format;
+	int slot[BASIS_MAX_TERMS];
+	int n_slots;
+	int i;
+
+	if( !(ptm = readptm_open( filename )) ) {
+		printf( "%s: FAILED, %s", what, vips_error_buffer() );
+		vips_error_clear();
+		return( FALSE );
+	}
+
+	/* A basis written as a standard PTM reads back as a standard PTM,
+	 * with the coefficients it doesn't use zero.
+	 */
+	format = basis_format( test->basis, test->channels );
+	n_slots = basis_slots( test->basis, slot );
+	basis = test->basis->ptm ?
+		basis_get( QUADRATIC_BIVARIATE ) : test->basis;
+	if( strcmp( ptm->format, format ) != 0 ||
+		ptm->width != TEST_WIDTH ||
+		ptm->height != TEST_HEIGHT ||
+		ptm->basis != basis ||
+		ptm->channels != test->channels ||
+		ptm->terms != n_slots ) {
+		printf( "%s: FAILED, read back as %s, %d x %d, %d terms\n",
+			what, ptm->format, ptm->width, ptm->height,
+			ptm->terms );
+		g_free( format );
+		readptm_close( ptm );
+		return( FALSE );
+	}
+	g_free( format );
+
+	/* Scales are written with %f. Unused coefficients have a scale of 1
+	 * and no bias.
+	 */
+	for( i = 0; i < n_slots; i++ ) {
+		double scale = slot[i] < 0 ? 1.0 : test->scale[slot[i]];
+		int bias = slot[i] < 0 ? 0 : test->bias[slot[i]];
+
+		if( fabs( ptm->scale[i] - scale ) > 1e-6 ||
+			ptm->bias[i] != bias ) {
+			printf( "%s: FAILED, bad scale and bias for "
+				"coefficient %d\n", what, i );
+			readptm_close( ptm );
+			return( FALSE );
+		}
+	}
+
+	for( i = 0; i < VIPS_NUMBER( lights ); i++ )
+		if( !test_relight( test, ptm, what,
+			lights[i][0], lights[i][1] ) ) {
+			if( vips_error_buffer()[0] ) {
+				printf( "%s: FAILED, %s",
+					what, vips_error_buffer() );
+				vips_error_clear();
+			}
+			readptm_close( ptm );
+			return( FALSE );
+		}
+
+	readptm_close( ptm );
+
+	return( TRUE );
+}
+
+/* Write and read a PTM, and check the sequential writer makes the same
+ * file. Return the number of failures.
+ */
+static int
+test_ptm( Test *test )
+{
+	char what[256];
+	char *filename;
+	char *sequential;
+	char *a = NULL;
+	char *b = NULL;
+	gsize a_length;
+	gsize b_length;
+	int failed;
+
+	vips_snprintf( what, 256, "%s, %s", test->basis->name,
+		test->channels == 1 ? "LRGB" : "RGB" );
+
+	if( !(filename = test_write( test, FALSE )) ) {
+		printf( "%s: FAILED, %s", what, vips_error_buffer() );
+		vips_error_clear();
+		return( 1 );
+	}
+	if( !(sequential = test_write( test, TRUE )) ) {
+		printf( "%s, sequential: FAILED, %s",
+			what, vips_error_buffer() );
+		vips_error_clear();
+		g_unlink( filename );
+		g_free( filename );
+		return( 1 );
+	}
+
+	failed = 0;
+	if( !test_read( test, what, filename ) )
+		failed += 1;
+
+	if( !g_file_get_contents( filename, &a, &a_length, NULL ) ||
+		!g_file_get_contents( sequential, &b, &b_length, NULL ) ||
+		a_length != b_length ||
+		memcmp( a, b, a_length ) != 0 ) {
+		printf( "%s: FAILED, writeptm_sequential() made a different "
+			"file\n", what );
+		failed += 1;
+	}
+	g_free( a );
+	g_free( b );
+
+	g_unlink( filename );
+	g_unlink( sequential );
+	g_free( filename );
+	g_free( sequential );
+
+	return( failed );
+}
+
+int
+main( int argc, char **argv )
+{
+	/* A standard PTM, one with some PTM coefficients zero, and one with
+	 * its own format.
+	 */
+	static const Basis_e bases[] = {
+		QUADRATIC_BIVARIATE,
+		QUADRATIC_UNIVARIATE,
+		CUBIC_BIVARIATE
+	};
+
+	GRand *rand;
+	int failed;
+	int tested;
+	int i, channels;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( "unable to start VIPS" );
+
+	rand = g_rand_new_with_seed( 42 );
+	failed = 0;
+	tested = 0;
+
+	for( i = 0; i < VIPS_NUMBER( bases ); i++ )
+		for( channels = 1; channels <= 3; channels += 2 ) {
+			Test test = { 0 };
+
+			if( test_init( &test, bases[i], channels, rand ) ) {
+				printf( "%s\n", vips_error_buffer() );
+				test_free( &test );
+				return( 1 );
+			}
+
+			failed += test_ptm( &test );
+			tested += 1;
+
+			test_free( &test );
+		}
+
+	g_rand_free( rand );
+
+	printf( "%d PTMs written and read, %d checks failed\n",
+		tested, failed );
+
+	vips_shutdown();
+
+	return( failed > 0 ? 1 : 0 );
+}
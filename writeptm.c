@@ -1,4 +1,41 @@
 /* write ptm file format
+ *
+ * PTM files are stored bottom row first, with all the coefficients and then
+ * all the RGB. Full-width strips of the image land as one contiguous run of
+ * rows in each area, in reverse order, so we quantise a strip into a buffer
+ * for each area in file order and write each with a single call, rather
+ * than a seek and write per scanline.
+ *
+ * With pwrite() we pre-size the file and let every worker quantise and
+ * write its own tiles at their final offsets with vips_sink(), so the write
+ * scales with the number of cores. Without, vips_sink_disc() gives us the
+ * strips top to bottom on one thread and we seek and write.
+ *
+ * writeptm_sequential() never seeks, so it can write to a pipe. The caller
+ * passes the image already flipped, so strips arrive in file order and the
+ * coefficients can be appended as they come. The RGB area follows all the
+ * coefficients, so we hold it in memory (3 bytes a pixel, a third of the 
+ * size of the PTM) and append it at the end.
+ *
+ * PTM_FORMAT_RGB has no RGB area, but a coefficient area for each of R, G 
+ * and B, one after the other, all sharing one scale and bias. The input is
+ * then 18 bands, R's 6 coefficients, then G's, then B's, and a sequential
+ * write holds the G and B areas in memory.
+ *
+ * The coefficients are in the order of the basis, see basis.c. Bases which
+ * make a standard PTM give the band for each of a0 - a5, and we fill any 
+ * they don't have with zero. Other bases are written in the same layout 
+ * with a format of PTM_FORMAT_<BASIS>_LRGB or _RGB, eg. 
+ * PTM_FORMAT_HSH3_LRGB, with a scale, a bias and a byte per pixel for each
+ * term, in basis order.
+ *
+ * writeptm_jpeg() makes PTM_FORMAT_JPEG_LRGB or PTM_FORMAT_JPEG_RGB, where
+ * each coefficient plane and each of R, G and B is a separate greyscale
+ * JPEG. We quantise the whole pixel area into memory in file order with
+ * the same workers as a raw write, one pass over the coefficients, then 
+ * encode the planes on a pool of threads, since each JPEG encode is 
+ * serial. Planes are bottom row first, like the raw areas. We never seek,
+ * so this can write to a pipe too.
  */
 
 /*
@@ -11,11 +48,36 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
 
 #include <vips/vips.h>
 
 #include "writeptm.h"
 
+/* Strip buffers and counts for one thread.
+ */
+typedef struct {
+	/* A strip of each area, in file order, and the number of pixels they
+	 * can hold.
+	 */
+	VipsPel *coeff_buf;
+	VipsPel *rgb_buf;
+	size_t buf_pels;
+
+	/* Number of coefficients we've had to clip.
+	 */
+	guint64 clipped;
+
+	/* Syscalls and bytes for the pixel data.
+	 */
+	guint64 writes;
+	guint64 seeks;
+	guint64 bytes;
+} WriteBuffer;
+
 /* What we track during a PTM write.
  */
 typedef struct {
@@ -24,8 +86,44 @@ typedef struct {
 	double *scale;
 	int *bias;
 
-	VipsPel *line;
+	/* The basis, the coefficients for each pixel in the file, and the
+	 * band each one comes from, -1 for zero.
+	 */
+	const Basis *basis;
+	int terms;
+	int slot[BASIS_MAX_TERMS];
+
+	/* 1 for PTM_FORMAT_LRGB, 3 for PTM_FORMAT_RGB, see writeptm_check().
+	 */
+	int channels;
+
 	FILE *fp;
+	int fd;
+
+	/* in is flipped and we are just appending to fd, see 
+	 * writeptm_sequential().
+	 */
+	gboolean sequential;
+
+	/* The areas after the first coefficient area for a sequential write:
+	 * RGB, or the G and B coefficients.
+	 */
+	VipsPel *rgb_side;
+
+	/* Quantise to here, rather than writing to fd, see write_jpeg().
+	 */
+	VipsPel *memory;
+
+	/* For a JPEG write: the quality, the pixel area uncompressed, and 
+	 * how long the encode took.
+	 */
+	int quality;
+	guint64 raw_bytes;
+	double encode_seconds;
+
+	/* Totals, merged from all threads.
+	 */
+	WriteBuffer total;
 
 	/* We have to write the file backwards, since PTM files have the origin
 	 * at byte 0 and (almost) all other file formats have the top left
@@ -36,18 +134,52 @@ typedef struct {
 	long rgb_start;
 } Write;
 
+static void
+write_buffer_free( WriteBuffer *buffer )
+{
+	VIPS_FREE( buffer->coeff_buf );
+	VIPS_FREE( buffer->rgb_buf );
+	buffer->buf_pels = 0;
+}
+
+/* Make sure the strip buffers can hold @pels pixels of all the 
+ * coefficient areas.
+ */
+static int
+write_buffer_size( Write *write, WriteBuffer *buffer, size_t pels )
+{
+	if( pels > buffer->buf_pels ) {
+		write_buffer_free( buffer );
+
+		if( !(buffer->coeff_buf = VIPS_ARRAY( NULL,
+				pels * write->terms * write->channels, 
+				VipsPel )) ||
+			!(buffer->rgb_buf = VIPS_ARRAY( NULL,
+				pels * 3, VipsPel )) )
+			return( -1 );
+		buffer->buf_pels = pels;
+	}
+
+	return( 0 );
+}
+
 static void
 write_destroy( Write *write )
 {
 	VIPS_FREEF( fclose, write->fp );
 	VIPS_FREE( write->name );
-	VIPS_FREE( write->line );
+	VIPS_FREE( write->rgb_side );
+	VIPS_FREE( write->memory );
+	write_buffer_free( &write->total );
 
 	vips_free( write );
 }
 
+/* Write to @name, or to @fd if @name is NULL. We don't close @fd.
+ */
 static Write *
-write_new( VipsImage *in, const char *name, double *scale, int *bias )
+write_new( VipsImage *in, const char *name, int fd, 
+	const Basis *basis, double *scale, int *bias )
 {
 	Write *write;
 
@@ -55,193 +187,822 @@ write_new( VipsImage *in, const char *name, double *scale, int *bias )
 		return( NULL );
 
 	write->in = in;
-	write->name = vips_strdup( NULL, name );
+	write->name = vips_strdup( NULL, name ? name : "fd" );
 	write->scale = scale;
 	write->bias = bias;
-	write->line = VIPS_ARRAY( NULL, in->Xsize * 6, VipsPel );
+	write->basis = basis;
+	write->terms = basis_slots( basis, write->slot );
 	write->fp = NULL;
-
-        if( !(write->fp = fopen( name, "wb" )) ) {
+	write->fd = fd;
+	write->channels = 1;
+	write->sequential = FALSE;
+	write->rgb_side = NULL;
+	write->memory = NULL;
+	write->quality = 0;
+	write->raw_bytes = 0;
+	write->encode_seconds = 0.0;
+	memset( &write->total, 0, sizeof( WriteBuffer ) );
+
+	if( name &&
+		!(write->fp = fopen( name, "wb" )) ) {
 		write_destroy( write );
 		vips_error( "writeptm", 
 			"unable to open \"%s\" for writing", name);
 		return( NULL );
 	}
-	if( !write->name || !write->line ) {
+	if( !write->name ) {
 		write_destroy( write );
 		return( NULL );
 	}
-	
-        return( write );
+
+	return( write );
 }
 
+/* Write @length bytes at @offset, usually with a single call, or append
+ * them for an @offset of -1. This can run in many threads at once with 
+ * pwrite(). The Write is wr here, since write is write().
+ */
 static int
-write_coeff_block( Write *write, VipsRegion *region, VipsRect *area )
+write_at( Write *wr, WriteBuffer *buffer,
+	const VipsPel *buf, size_t length, off_t offset )
+{
+	if( wr->memory &&
+		offset >= 0 ) {
+		memcpy( wr->memory + offset, buf, length );
+		return( 0 );
+	}
+
+#ifndef HAVE_PWRITE
+	if( offset >= 0 ) {
+		buffer->seeks += 1;
+		if( lseek( wr->fd, offset, SEEK_SET ) == (off_t) -1 ) {
+			vips_error_system( errno, "writeptm",
+				"%s", _( "unable to seek" ) );
+			return( -1 );
+		}
+	}
+#endif /*!HAVE_PWRITE*/
+
+	while( length > 0 ) {
+		ssize_t n;
+
+		buffer->writes += 1;
+#ifdef HAVE_PWRITE
+		if( offset >= 0 )
+			n = pwrite( wr->fd, buf, length, offset );
+		else
+#endif /*HAVE_PWRITE*/
+			n = write( wr->fd, buf, length );
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+
+			vips_error_system( errno, "writeptm", 
+				"%s", _( "write error ... disc full?" ) );
+			return( -1 );
+		}
+
+		buf += n;
+		length -= n;
+		if( offset >= 0 )
+			offset += n;
+		buffer->bytes += n;
+	}
+
+	return( 0 );
+}
+
+/* The row in the strip buffer for row @y of an area. Files are bottom row
+ * first, unless the image has been flipped for us.
+ */
+#define BUFFER_ROW( WRITE, AREA, Y ) \
+	((WRITE)->sequential ? (Y) : (AREA)->height - 1 - (Y))
+
+/* Quantise an area of coefficients into the strip buffer in file order,
+ * one strip after another for an RGB PTM.
+ */
+static void
+write_coeff_block( Write *write, WriteBuffer *buffer,
+	VipsRegion *region, VipsRect *area )
 {
 	double * restrict scale = write->scale;
 	int * restrict bias = write->bias;
+	int * restrict slot = write->slot;
+	int terms = write->terms;
+	int bands = write->in->Bands;
+	size_t pels = (size_t) area->width * area->height;
+
+	guint64 clipped;
+	int x, y, i, c;
+
+	clipped = 0;
+	for( c = 0; c < write->channels; c++ ) {
+		for( y = 0; y < area->height; y++ ) {
+			float * restrict p;
+			VipsPel * restrict q;
+
+			/* LRGB is RGB then the coefficients, RGB is all 
+			 * the coefficients for each channel.
+			 */
+			p = (float * restrict) VIPS_REGION_ADDR( region, 
+				area->left, area->top + y );
+			p += write->channels == 3 ? 
+				write->basis->terms * c : 3;
+			q = buffer->coeff_buf + c * pels * terms +
+				(size_t) BUFFER_ROW( write, area, y ) * 
+					area->width * terms;
+
+			for( x = 0; x < area->width; x++ ) {
+				for( i = 0; i < terms; i++ ) {
+					int b = slot[i];
+					float v;
+
+					if( b < 0 ) {
+						q[i] = 0;
+						continue;
+					}
+
+					v = p[b] / scale[b] + bias[b] + 0.5;
+
+					/* scale and bias can be an 
+					 * estimate, see -fast-quant, so we 
+					 * must clip.
+					 */
+					if( v < 0 ) {
+						v = 0;
+						clipped += 1;
+					}
+					else if( v >= 256 ) {
+						v = 255;
+						clipped += 1;
+					}
+
+					q[i] = (VipsPel) v;
+				}
+
+				p += bands;
+				q += terms;
+			}
+		}
+	}
 
+	buffer->clipped += clipped;
+}
+
+static void
+write_rgb_block( Write *write, WriteBuffer *buffer,
+	VipsRegion *region, VipsRect *area )
+{
 	int x, y, i;
 
 	for( y = 0; y < area->height; y++ ) {
 		float * restrict p;
 		VipsPel * restrict q;
-		long offset;
 
 		p = (float * restrict) 
-			VIPS_REGION_ADDR( region, 0, area->top + y );
-		q = write->line;
+			VIPS_REGION_ADDR( region, area->left, area->top + y );
+		q = buffer->rgb_buf +
+			(size_t) BUFFER_ROW( write, area, y ) * area->width * 3;
 
 		for( x = 0; x < area->width; x++ ) {
-			for( i = 5; i >= 0; i-- ) {
-				float v = p[i + 3];
-				VipsPel ch;
+			for( i = 0; i < 3; i++ ) 
+				q[i] = (VipsPel) (p[i] + 0.5);
 
-				ch = (VipsPel) (v / scale[i] + bias[i] + 0.5);
+			p += write->in->Bands;
+			q += 3;
+		}
+	}
+}
 
-				q[5 - i] = ch;
-			}
+/* Quantise and write an area. Full-width areas are a single write for each
+ * of coeff and RGB, anything narrower needs a write per row.
+ */
+static int
+write_area( Write *write, WriteBuffer *buffer,
+	VipsRegion *region, VipsRect *area )
+{
+	size_t width = write->in->Xsize;
+	size_t pels = (size_t) area->width * area->height;
+	int terms = write->terms;
+	size_t plane = width * write->in->Ysize * terms;
 
-			p += 9;
-			q += 6;
-		}
+	/* The row in the file of the last row in the area.
+	 */
+	size_t row = write->in->Ysize - area->top - area->height;
 
-		offset = write->coeff_start;
-		offset += (write->in->Ysize - 1 - (area->top + y)) * 
-			area->width * 6;
-		fseek( write->fp, offset, SEEK_SET ); 
+	int y, c;
 
-		if( !fwrite( write->line, area->width * 6, 1, write->fp ) ) {
-			vips_error( "writeptm", 
-				"%s", _( "write error ... disc full?" ) );
-			return( -1 );
-		}
+	if( write_buffer_size( write, buffer, pels ) )
+		return( -1 );
+
+	write_coeff_block( write, buffer, region, area );
+	if( write->channels == 1 )
+		write_rgb_block( write, buffer, region, area );
 
 #ifdef DEBUG
-		printf( "written coeff scanline %d to %zd ",
-			area->top + y, offset );
-		for( i = 0; i < 5; i++ )
-			printf( "%d ", write->line[i] );
-		printf( "\n" ); 
+	printf( "writing area at %d x %d, %d x %d, to file row %zu\n",
+		area->left, area->top, area->width, area->height, row );
 #endif /*DEBUG*/
+
+	for( c = 0; c < write->channels; c++ ) {
+		VipsPel *coeff_buf = buffer->coeff_buf + c * pels * terms;
+		long coeff_start = write->coeff_start + c * plane;
+
+		if( area->width == write->in->Xsize ) {
+			if( write_at( write, buffer, coeff_buf,
+				width * area->height * terms,
+				coeff_start + row * width * terms ) )
+				return( -1 );
+		}
+		else
+			for( y = 0; y < area->height; y++ ) {
+				size_t offset = (row + y) * width + area->left;
+
+				if( write_at( write, buffer,
+					coeff_buf + (size_t) y * 
+						area->width * terms,
+					(size_t) area->width * terms,
+					coeff_start + offset * terms ) )
+					return( -1 );
+			}
+	}
+
+	if( write->channels == 1 ) {
+		if( area->width == write->in->Xsize ) {
+			if( write_at( write, buffer, buffer->rgb_buf,
+				width * area->height * 3,
+				write->rgb_start + row * width * 3 ) )
+				return( -1 );
+		}
+		else
+			for( y = 0; y < area->height; y++ ) {
+				size_t offset = (row + y) * width + area->left;
+
+				if( write_at( write, buffer,
+					buffer->rgb_buf +
+						(size_t) y * area->width * 3,
+					(size_t) area->width * 3,
+					write->rgb_start + offset * 3 ) )
+					return( -1 );
+			}
 	}
 
 	return( 0 );
 }
 
+#ifdef HAVE_PWRITE
+/* Merge a thread's counts into the total and free it. vips_sink runs stop
+ * functions one at a time, so we don't need a lock.
+ */
 static int
-write_rgb_block( Write *write, VipsRegion *region, VipsRect *area )
+write_stop( void *vseq, void *a, void *b )
 {
-	int x, y, i;
-
-	for( y = 0; y < area->height; y++ ) {
-		float * restrict p;
-		VipsPel * restrict q;
-		long offset;
+	WriteBuffer *buffer = (WriteBuffer *) vseq;
+	Write *write = (Write *) a;
 
-		p = (float * restrict) 
-			VIPS_REGION_ADDR( region, 0, area->top + y );
-		q = write->line;
+	write->total.clipped += buffer->clipped;
+	write->total.writes += buffer->writes;
+	write->total.seeks += buffer->seeks;
+	write->total.bytes += buffer->bytes;
 
-		for( x = 0; x < area->width; x++ ) {
-			for( i = 0; i < 3; i++ ) {
-				float v = p[i];
-				VipsPel ch;
+	write_buffer_free( buffer );
+	g_free( buffer );
 
-				ch = (VipsPel) (v + 0.5);
+	return( 0 );
+}
 
-				q[i] = ch;
-			}
+static void *
+write_start( VipsImage *in, void *a, void *b )
+{
+	return( (void *) g_new0( WriteBuffer, 1 ) );
+}
 
-			p += 9;
-			q += 3;
-		}
+static int
+write_scan( VipsRegion *region,
+	void *vseq, void *a, void *b, gboolean *stop )
+{
+	WriteBuffer *buffer = (WriteBuffer *) vseq;
+	Write *write = (Write *) a;
 
-		offset = write->rgb_start;
-		offset += (write->in->Ysize - 1 - (area->top + y)) * 
-			area->width * 3;
-		fseek( write->fp, offset, SEEK_SET ); 
+	return( write_area( write, buffer, region, &region->valid ) );
+}
+#else /*!HAVE_PWRITE*/
+static int
+write_block( VipsRegion *region, VipsRect *area, void *a )
+{
+	Write *write = (Write *) a;
 
-		if( !fwrite( write->line, area->width * 3, 1, write->fp ) ) {
-			vips_error( "writeptm", 
-				"%s", _( "write error ... disc full?" ) );
-			return( -1 );
-		}
+	return( write_area( write, &write->total, region, area ) );
+}
+#endif /*HAVE_PWRITE*/
 
-		/*
-		printf( "written rgb scanline %d to %zd ",
-			area->top + y, offset );
-		for( i = 0; i < 5; i++ )
-			printf( "%d ", write->line[i] );
-		printf( "\n" ); 
-		 */
-	}
+/* The bytes of the side buffer for a sequential write: the RGB area, or
+ * the G and B coefficient areas.
+ */
+static size_t
+write_side_length( Write *write )
+{
+	size_t pels = (size_t) write->in->Xsize * write->in->Ysize;
 
-	return( 0 );
+	return( write->channels == 1 ? pels * 3 : pels * write->terms * 2 );
 }
 
+/* Append strips from a flipped image: the first coefficient area goes 
+ * straight out, the rest goes to the side buffer.
+ */
 static int
-write_block( VipsRegion *region, VipsRect *area, void *a )
+write_sequential_block( VipsRegion *region, VipsRect *area, void *a )
 {
 	Write *write = (Write *) a;
+	WriteBuffer *buffer = &write->total;
+	size_t pels = (size_t) area->width * area->height;
+	size_t start = (size_t) area->top * area->width;
+	int terms = write->terms;
 
-	if( write_coeff_block( write, region, area ) ||
-		write_rgb_block( write, region, area ) )
-		return( -1 ); 
+	int c;
 
-	return( 0 );
+	if( write_buffer_size( write, buffer, pels ) )
+		return( -1 );
+
+	write_coeff_block( write, buffer, region, area );
+	if( write->channels == 1 ) {
+		write_rgb_block( write, buffer, region, area );
+		memcpy( write->rgb_side + start * 3, 
+			buffer->rgb_buf, pels * 3 );
+	}
+	else {
+		size_t plane = 
+			(size_t) write->in->Xsize * write->in->Ysize * terms;
+
+		for( c = 1; c < write->channels; c++ ) 
+			memcpy( write->rgb_side + (c - 1) * plane + 
+					start * terms, 
+				buffer->coeff_buf + c * pels * terms, 
+				pels * terms );
+	}
+
+	return( write_at( write, buffer, 
+		buffer->coeff_buf, pels * terms, -1 ) );
 }
 
-static int
-write_ptm( Write *write )
+/* Make the PTM header. Free with g_free().
+ */
+static char *
+write_header( Write *write )
 {
 	VipsImage *in = write->in;
 
+	char buf[4096];
+	VipsBuf header = VIPS_BUF_STATIC( buf );
+	char *format;
 	int i;
 
-	fprintf( write->fp, "PTM_1.2\n" );
-	fprintf( write->fp, "%s\n", "PTM_FORMAT_LRGB" );
+	if( write->quality > 0 )
+		format = g_strdup_printf( "PTM_FORMAT_JPEG_%s", 
+			write->channels == 1 ? "LRGB" : "RGB" );
+	else
+		format = basis_format( write->basis, write->channels );
+	vips_buf_appendf( &header, "PTM_1.2\n" );
+	vips_buf_appendf( &header, "%s\n", format );
+	g_free( format );
+
+	vips_buf_appendf( &header, "%i\n", in->Xsize );
+	vips_buf_appendf( &header, "%i\n", in->Ysize );
+
+	/* Coefficients we fill with zero get a scale of 1 and no bias.
+	 */
+	for( i = 0; i < write->terms; i++ )
+		vips_buf_appendf( &header, "%f ", write->slot[i] < 0 ? 
+			1.0 : write->scale[write->slot[i]] );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < write->terms; i++ )
+		vips_buf_appendf( &header, "%i ", write->slot[i] < 0 ? 
+			0 : write->bias[write->slot[i]] );
+	vips_buf_appendf( &header, "\n" );
+
+	return( g_strdup( vips_buf_all( &header ) ) );
+}
+
+static int
+write_ptm_sequential( Write *write )
+{
+	char *header;
+
+	if( !(write->rgb_side = VIPS_ARRAY( NULL, 
+		write_side_length( write ), VipsPel )) )
+		return( -1 );
+
+	header = write_header( write );
+	if( write_at( write, &write->total, 
+		(VipsPel *) header, strlen( header ), -1 ) ) {
+		g_free( header );
+		return( -1 );
+	}
+	g_free( header );
+
+	/* The header isn't pixel data.
+	 */
+	write->total.writes = 0;
+	write->total.bytes = 0;
+
+	if( vips_sink_disc( write->in, write_sequential_block, write ) ||
+		write_at( write, &write->total, write->rgb_side, 
+			write_side_length( write ), -1 ) )
+		return( -1 );
 
-	fprintf( write->fp, "%i\n", in->Xsize );
-	fprintf( write->fp, "%i\n", in->Ysize );
+	return( 0 );
+}
 
-	for( i = 0; i <= 5; i++ )
-		fprintf( write->fp, "%f ", write->scale[5 - i] );
-	fprintf( write->fp, "\n" );
+static int
+write_ptm( Write *write )
+{
+	char *header;
 
-	for( i = 0; i <= 5; i++ )
-		fprintf( write->fp, "%i ", write->bias[5 - i] );
-	fprintf( write->fp, "\n" );
+	header = write_header( write );
+	fputs( header, write->fp );
+	g_free( header );
 
-	/* Set up file layout. The coeff area is 6 bytes per pixel.
+	/* Set up file layout. Each coeff area is a byte per term per pixel, 
+	 * and there's one for each channel.
 	 */
 	write->coeff_start = ftell( write->fp ); 
 	write->rgb_start = write->coeff_start + 
-		((size_t) write->in->Xsize) * write->in->Ysize * 6;
+		((size_t) write->in->Xsize) * write->in->Ysize * write->terms * 
+			write->channels;
+
+	/* The pixels go straight to the fd, so flush the header first.
+	 */
+	if( fflush( write->fp ) ) {
+		vips_error_system( errno, "writeptm", 
+			"%s", _( "write error ... disc full?" ) );
+		return( -1 );
+	}
+	write->fd = fileno( write->fp );
 
+#ifdef HAVE_PWRITE
+	/* Set the final size now, so out-of-order writes from the workers
+	 * never have to extend the file.
+	 */
+	if( ftruncate( write->fd, write->rgb_start + (write->channels == 1 ?
+		((size_t) write->in->Xsize) * write->in->Ysize * 3 : 0) ) ) {
+		vips_error_system( errno, "writeptm",
+			"%s", _( "unable to size file ... disc full?" ) );
+		return( -1 );
+	}
+
+	if( vips_sink( write->in,
+		write_start, write_scan, write_stop, write, NULL ) )
+		return( -1 );
+#else /*!HAVE_PWRITE*/
 	if( vips_sink_disc( write->in, write_block, write ) )
 		return( -1 );
+#endif /*HAVE_PWRITE*/
 
 	return( 0 );
 }
 
-int
-writeptm( VipsImage *in, const char *filename, double *scale, int *bias )
+/* One plane of a JPEG PTM, and the JPEG we made from it.
+ */
+typedef struct {
+	VipsImage *image;
+	void *buf;
+	size_t length;
+	int result;
+} WritePlane;
+
+static void
+write_planes_free( WritePlane *planes, int n_planes )
 {
-	Write *write;
+	int i;
+
+	for( i = 0; i < n_planes; i++ ) {
+		VIPS_UNREF( planes[i].image );
+		VIPS_FREE( planes[i].buf );
+	}
+	g_free( planes );
+}
+
+/* Run in the encode pool.
+ */
+static void
+write_plane_encode( gpointer data, gpointer user_data )
+{
+	WritePlane *plane = (WritePlane *) data;
+	Write *write = (Write *) user_data;
+
+	plane->result = vips_jpegsave_buffer( plane->image, 
+		&plane->buf, &plane->length,
+		"Q", write->quality,
+		NULL );
+
+	vips_thread_shutdown();
+}
+
+/* Wrap each plane of the quantised pixel area in write->memory as a one
+ * band image: the coefficients in file order, then R, G and B for LRGB.
+ */
+static int
+write_planes_new( Write *write, WritePlane *planes, int n_planes )
+{
+	size_t pels = (size_t) write->in->Xsize * write->in->Ysize;
+	int coeff_planes = write->terms * write->channels;
+
+	int i;
+
+	for( i = 0; i < n_planes; i++ ) {
+		VipsPel *area;
+		int bands;
+		int band;
+		VipsImage *t;
+
+		if( i < coeff_planes ) {
+			area = write->memory + 
+				(size_t) (i / write->terms) * pels * write->terms;
+			bands = write->terms;
+			band = i % write->terms;
+		}
+		else {
+			area = write->memory + write->rgb_start;
+			bands = 3;
+			band = i - coeff_planes;
+		}
+
+		if( !(t = vips_image_new_from_memory( area, pels * bands,
+			write->in->Xsize, write->in->Ysize, bands, 
+			VIPS_FORMAT_UCHAR )) )
+			return( -1 );
+		if( vips_extract_band( t, &planes[i].image, band, NULL ) ) {
+			g_object_unref( t );
+			return( -1 );
+		}
+		g_object_unref( t );
+	}
+
+	return( 0 );
+}
+
+/* The lines after the scale and bias for a JPEG PTM: the quality, then for
+ * each plane a transform, a motion vector, the decode order, a reference
+ * plane, the JPEG size and the side information size. Our planes are all 
+ * plain JPEGs, in order. Free with g_free().
+ */
+static char *
+write_jpeg_header( Write *write, WritePlane *planes, int n_planes )
+{
+	char buf[4096];
+	VipsBuf header = VIPS_BUF_STATIC( buf );
+	int i;
+
+	vips_buf_appendf( &header, "%i\n", write->quality );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "0 " );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "0 0 " );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "%i ", i );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "-1 " );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "%zu ", planes[i].length );
+	vips_buf_appendf( &header, "\n" );
+
+	for( i = 0; i < n_planes; i++ )
+		vips_buf_appendf( &header, "0 " );
+	vips_buf_appendf( &header, "\n" );
+
+	return( g_strdup( vips_buf_all( &header ) ) );
+}
+
+static int
+write_jpeg_planes( Write *write, WritePlane *planes, int n_planes )
+{
+	GThreadPool *pool;
+	int workers;
+	gint64 start;
+	char *header;
+	char *jpeg_header;
+	int i;
+
+	/* The pixel area in file order, quantised on every thread.
+	 */
+	write->coeff_start = 0;
+	write->rgb_start = write->raw_bytes - 
+		(write->channels == 1 ? 
+			(size_t) write->in->Xsize * write->in->Ysize * 3 : 0);
+	if( !(write->memory = VIPS_ARRAY( NULL, write->raw_bytes, VipsPel )) )
+		return( -1 );
+#ifdef HAVE_PWRITE
+	if( vips_sink( write->in,
+		write_start, write_scan, write_stop, write, NULL ) )
+		return( -1 );
+#else /*!HAVE_PWRITE*/
+	if( vips_sink_disc( write->in, write_block, write ) )
+		return( -1 );
+#endif /*HAVE_PWRITE*/
+
+	if( write_planes_new( write, planes, n_planes ) )
+		return( -1 );
 
-	if( vips_check_format( "writeptm", in, VIPS_FORMAT_FLOAT ) || 
-		vips_check_bands( "writeptm", in, 9 ) || 
+	/* Planes are independent, so encode them all at once, no more at a
+	 * time than our thread count. libjpeg encodes serially, and each
+	 * save's own pipeline only reads a band from memory, so the pool is
+	 * where the parallelism is.
+	 *
+	 * Don't change vips concurrency here: it's global, and under -batch
+	 * and -serve other jobs are writing at the same time.
+	 */
+	start = g_get_monotonic_time();
+	workers = VIPS_CLIP( 1, vips_concurrency_get(), n_planes );
+	pool = g_thread_pool_new( write_plane_encode, write,
+		workers, FALSE, NULL );
+	for( i = 0; i < n_planes; i++ )
+		g_thread_pool_push( pool, &planes[i], NULL );
+	g_thread_pool_free( pool, FALSE, TRUE );
+	write->encode_seconds = 
+		(g_get_monotonic_time() - start) / 1000000.0;
+
+	for( i = 0; i < n_planes; i++ )
+		if( planes[i].result )
+			return( -1 );
+
+	header = write_header( write );
+	jpeg_header = write_jpeg_header( write, planes, n_planes );
+	if( write_at( write, &write->total, 
+		(VipsPel *) header, strlen( header ), -1 ) ||
+		write_at( write, &write->total, 
+			(VipsPel *) jpeg_header, strlen( jpeg_header ), -1 ) ) {
+		g_free( header );
+		g_free( jpeg_header );
+		return( -1 );
+	}
+	g_free( header );
+	g_free( jpeg_header );
+
+	/* The header isn't pixel data.
+	 */
+	write->total.writes = 0;
+	write->total.bytes = 0;
+
+	for( i = 0; i < n_planes; i++ )
+		if( write_at( write, &write->total, 
+			planes[i].buf, planes[i].length, -1 ) )
+			return( -1 );
+
+	return( 0 );
+}
+
+static int
+write_jpeg( Write *write )
+{
+	int n_planes = write->terms * write->channels + 
+		(write->channels == 1 ? 3 : 0);
+
+	WritePlane *planes;
+	int result;
+
+	write->raw_bytes = 
+		(guint64) write->in->Xsize * write->in->Ysize * n_planes;
+
+	planes = g_new0( WritePlane, n_planes );
+	result = write_jpeg_planes( write, planes, n_planes );
+	write_planes_free( planes, n_planes );
+
+	return( result );
+}
+
+static void
+write_info( Write *write, WritePtmInfo *info )
+{
+	if( info ) {
+		info->clipped = write->total.clipped;
+		info->writes = write->total.writes;
+		info->seeks = write->total.seeks;
+		info->bytes = write->total.bytes;
+		info->raw_bytes = write->quality > 0 ? 
+			write->raw_bytes : write->total.bytes;
+		info->encode_seconds = write->encode_seconds;
+	}
+}
+
+/* RGB then a coefficient for each term of @basis makes PTM_FORMAT_LRGB,
+ * all the terms for each of R, G and B makes PTM_FORMAT_RGB. Set 
+ * @channels to the number of coefficient areas.
+ */
+static int
+writeptm_check( VipsImage *in, const Basis *basis, int *channels )
+{
+	if( vips_check_format( "writeptm", in, VIPS_FORMAT_FLOAT ) ||
 		vips_check_uncoded( "writeptm", in ) )
 		return( -1 );
 
-	if( !(write = write_new( in, filename, scale, bias )) )
+	if( in->Bands == 3 + basis->terms )
+		*channels = 1;
+	else if( in->Bands == 3 * basis->terms )
+		*channels = 3;
+	else {
+		vips_error( "writeptm", _( "image must have %d or %d bands "
+			"for basis %s" ), 3 + basis->terms, 3 * basis->terms,
+			basis->name );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* @scale and @bias have an entry for each term of @basis. @info can be 
+ * NULL.
+ */
+int
+writeptm( VipsImage *in, const char *filename, const Basis *basis,
+	double *scale, int *bias, WritePtmInfo *info )
+{
+	Write *write;
+	int channels;
+
+	if( writeptm_check( in, basis, &channels ) ||
+		!(write = write_new( in, filename, -1, basis, scale, bias )) )
 		return( -1 );
+	write->channels = channels;
 
 	if( write_ptm( write ) ) {
 		write_destroy( write );
 		return( -1 );
 	}
+	write_info( write, info );
+	write_destroy( write );
+
+	return( 0 );
+}
+
+/* Write a PTM to @fd strictly by appending, so @fd can be a pipe. @in must
+ * be upside down, ie. bottom row first, and must be cheap to read from, 
+ * since we hold the RGB area in memory while we write the coefficients.
+ * @fd is not closed. @info can be NULL.
+ */
+int
+writeptm_sequential( VipsImage *in, int fd, const Basis *basis,
+	double *scale, int *bias, WritePtmInfo *info )
+{
+	Write *write;
+	int channels;
+
+	if( writeptm_check( in, basis, &channels ) ||
+		!(write = write_new( in, NULL, fd, basis, scale, bias )) )
+		return( -1 );
+	write->channels = channels;
+	write->sequential = TRUE;
+
+	if( write_ptm_sequential( write ) ) {
+		write_destroy( write );
+		return( -1 );
+	}
+	write_info( write, info );
+	write_destroy( write );
+
+	return( 0 );
+}
+
+/* Write PTM_FORMAT_JPEG_LRGB or PTM_FORMAT_JPEG_RGB to @fd at JPEG 
+ * @quality, strictly by appending, so @fd can be a pipe. We hold the 
+ * quantised PTM in memory while we encode, the size of a raw PTM. Only
+ * bases which make a standard PTM have a JPEG format. @fd is not closed. 
+ * @info can be NULL.
+ */
+int
+writeptm_jpeg( VipsImage *in, int fd, const Basis *basis,
+	double *scale, int *bias, int quality, WritePtmInfo *info )
+{
+	Write *write;
+	int channels;
+
+	if( writeptm_check( in, basis, &channels ) )
+		return( -1 );
+	if( !basis->ptm ) {
+		vips_error( "writeptm", _( "basis %s can't be written as a "
+			"JPEG PTM" ), basis->name );
+		return( -1 );
+	}
+
+	if( !(write = write_new( in, NULL, fd, basis, scale, bias )) )
+		return( -1 );
+	write->channels = channels;
+	write->quality = VIPS_CLIP( 1, quality, 100 );
+
+	if( write_jpeg( write ) ) {
+		write_destroy( write );
+		return( -1 );
+	}
+	write_info( write, info );
 	write_destroy( write );
 
 	return( 0 );
@@ -7,11 +7,39 @@ extern "C" {
 
 #include <vips/vips.h>
 
+#include "basis.h"
+
 /* Keep i18n stuff happy.
  */
 #define _(S) (S)
 
-int writeptm( VipsImage *in, const char *filename, double *scale, int *bias );
+/* What we found during a write.
+ */
+typedef struct _WritePtmInfo {
+	/* Coefficients which fell outside the range scale and bias can 
+	 * represent and were clipped.
+	 */
+	guint64 clipped;
+
+	/* write() and lseek() calls for the pixel data, and the bytes written.
+	 */
+	guint64 writes;
+	guint64 seeks;
+	guint64 bytes;
+
+	/* The pixel data before compression, the same as bytes unless 
+	 * it's a JPEG PTM, and the time spent encoding it.
+	 */
+	guint64 raw_bytes;
+	double encode_seconds;
+} WritePtmInfo;
+
+int writeptm( VipsImage *in, const char *filename, const Basis *basis,
+	double *scale, int *bias, WritePtmInfo *info );
+int writeptm_sequential( VipsImage *in, int fd, const Basis *basis,
+	double *scale, int *bias, WritePtmInfo *info );
+int writeptm_jpeg( VipsImage *in, int fd, const Basis *basis,
+	double *scale, int *bias, int quality, WritePtmInfo *info );
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,709 @@
+/* write coefficients as tiled pyramids for web viewers
+ *
+ * Web viewers want each coefficient plane as an 8-bit image, cut into tiles
+ * at several resolutions, rather than a PTM. We make that from the float
+ * coefficients in a single top-to-bottom pass, so there's no need to read
+ * the PTM back.
+ *
+ * Planes are grouped in threes, so each tile is an ordinary 3-band image:
+ * for PTM_FORMAT_LRGB the RGB, then a0 - a2, then a3 - a5. RGB fits have
+ * each channel's coefficients in turn, and groups are padded with zero
+ * planes. Planes are quantised with the same scale and bias as the PTM.
+ *
+ * The layout is
+ *
+ * 	DIR/manifest.json
+ * 	DIR/LEVEL/GROUP/X_Y.png
+ *
+ * with level 0 full size, each level after that half the size of the one
+ * before, down to the first one that fits in a single tile.
+ * manifest.json gives the format, size, tiling, scale and bias, the size
+ * of each level and the planes in each group. It's written last, so if
+ * it's there the pyramid is complete.
+ *
+ * Each level keeps a strip of tile_size rows, already quantised, and cuts
+ * it into tiles when it fills. Smaller levels are made by averaging pairs
+ * of float rows as they arrive, so they are shrunk before quantisation,
+ * and memory is tile_size rows of each level, however tall the image is.
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <vips/vips.h>
+
+#include "writepyramid.h"
+
+/* A plane of the output: the input band it comes from, -1 for a plane of
+ * zeros, how to quantise it, and its name in the manifest.
+ */
+typedef struct {
+	int band;
+	double scale;
+	int bias;
+	char name[16];
+} PyramidPlane;
+
+/* One resolution.
+ */
+typedef struct _PyramidLevel {
+	struct _Pyramid *pyramid;
+	int level;
+	int width;
+	int height;
+
+	/* Tiles across and down.
+	 */
+	int columns;
+	int rows;
+
+	/* Up to tile_size quantised rows, n_planes bytes a pixel, starting
+	 * at row top.
+	 */
+	VipsPel *strip;
+	int top;
+	int n;
+
+	/* A float row waiting for the next one, so we can average them into
+	 * shrunk, a row of the next level.
+	 */
+	float *pending;
+	gboolean has_pending;
+	float *shrunk;
+} PyramidLevel;
+
+typedef struct _Pyramid {
+	VipsImage *in;
+	char *dirname;
+	const Basis *basis;
+	int tile_size;
+
+	/* The file suffix, eg. ".jpg", and any save options, eg. "[Q=90]".
+	 */
+	char *suffix;
+	char *options;
+
+	/* 1 for LRGB, 3 for RGB.
+	 */
+	int channels;
+
+	/* The coefficients for each channel, in the order we write them,
+	 * see basis_slots().
+	 */
+	int n_slots;
+	int slot[BASIS_MAX_TERMS];
+
+	/* Padded to a multiple of 3.
+	 */
+	int n_planes;
+	PyramidPlane *planes;
+
+	int n_levels;
+	PyramidLevel *levels;
+
+	/* A tile being written.
+	 */
+	VipsPel *tile;
+
+	guint64 tiles;
+	guint64 clipped;
+} Pyramid;
+
+static void
+pyramid_free( Pyramid *pyramid )
+{
+	int i;
+
+	if( pyramid->levels )
+		for( i = 0; i < pyramid->n_levels; i++ ) {
+			PyramidLevel *level = &pyramid->levels[i];
+
+			VIPS_FREE( level->strip );
+			VIPS_FREE( level->pending );
+			VIPS_FREE( level->shrunk );
+		}
+	VIPS_FREE( pyramid->levels );
+	VIPS_FREE( pyramid->planes );
+	VIPS_FREE( pyramid->tile );
+	VIPS_FREE( pyramid->dirname );
+	VIPS_FREE( pyramid->suffix );
+	VIPS_FREE( pyramid->options );
+	vips_free( pyramid );
+}
+
+static void
+pyramid_plane( PyramidPlane *plane, int band, double scale, int bias,
+	const char *name )
+{
+	plane->band = band;
+	plane->scale = scale;
+	plane->bias = bias;
+	vips_strncpy( plane->name, name, sizeof( plane->name ) );
+}
+
+/* Set up the planes. Like writeptm, the bands are RGB then the
+ * coefficients for LRGB, or all the coefficients for each channel for RGB.
+ */
+static int
+pyramid_build_planes( Pyramid *pyramid, double *scale, int *bias )
+{
+	VipsImage *in = pyramid->in;
+	int terms = pyramid->basis->terms;
+
+	int i, c, n;
+
+	if( in->Bands == 3 + terms )
+		pyramid->channels = 1;
+	else if( in->Bands == 3 * terms )
+		pyramid->channels = 3;
+	else {
+		vips_error( "writepyramid", _( "image must have %d or %d bands "
+			"for basis %s" ), 3 + terms, 3 * terms,
+			pyramid->basis->name );
+		return( -1 );
+	}
+
+	pyramid->n_slots = basis_slots( pyramid->basis, pyramid->slot );
+	n = pyramid->channels * pyramid->n_slots +
+		(pyramid->channels == 1 ? 3 : 0);
+	pyramid->n_planes = VIPS_ROUND_UP( n, 3 );
+	if( !(pyramid->planes = VIPS_ARRAY( NULL,
+		pyramid->n_planes, PyramidPlane )) )
+		return( -1 );
+
+	n = 0;
+	if( pyramid->channels == 1 ) {
+		pyramid_plane( &pyramid->planes[n++], 0, 1.0, 0, "r" );
+		pyramid_plane( &pyramid->planes[n++], 1, 1.0, 0, "g" );
+		pyramid_plane( &pyramid->planes[n++], 2, 1.0, 0, "b" );
+	}
+
+	for( c = 0; c < pyramid->channels; c++ )
+		for( i = 0; i < pyramid->n_slots; i++ ) {
+			int s = pyramid->slot[i];
+			char name[16];
+
+			if( pyramid->channels == 1 )
+				vips_snprintf( name, 16, "a%d", i );
+			else
+				vips_snprintf( name, 16, 
+					"%c.a%d", "rgb"[c], i );
+
+			if( s < 0 )
+				pyramid_plane( &pyramid->planes[n++],
+					-1, 1.0, 0, name );
+			else
+				pyramid_plane( &pyramid->planes[n++],
+					pyramid->channels == 1 ?
+						3 + s : c * terms + s,
+					scale[s], bias[s], name );
+		}
+
+	while( n < pyramid->n_planes )
+		pyramid_plane( &pyramid->planes[n++], -1, 1.0, 0, "" );
+
+	return( 0 );
+}
+
+/* Size the levels, allocate the buffers and make the directories.
+ */
+static int
+pyramid_build_levels( Pyramid *pyramid )
+{
+	int tile_size = pyramid->tile_size;
+	int bands = pyramid->in->Bands;
+
+	int width, height;
+	int i, g;
+
+	width = pyramid->in->Xsize;
+	height = pyramid->in->Ysize;
+	pyramid->n_levels = 1;
+	while( VIPS_MAX( width, height ) > tile_size ) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		pyramid->n_levels += 1;
+	}
+
+	if( !(pyramid->levels = VIPS_ARRAY( NULL,
+		pyramid->n_levels, PyramidLevel )) )
+		return( -1 );
+	memset( pyramid->levels, 0,
+		pyramid->n_levels * sizeof( PyramidLevel ) );
+
+	width = pyramid->in->Xsize;
+	height = pyramid->in->Ysize;
+	for( i = 0; i < pyramid->n_levels; i++ ) {
+		PyramidLevel *level = &pyramid->levels[i];
+
+		level->pyramid = pyramid;
+		level->level = i;
+		level->width = width;
+		level->height = height;
+		level->columns = VIPS_ROUND_UP( width, tile_size ) / tile_size;
+		level->rows = VIPS_ROUND_UP( height, tile_size ) / tile_size;
+		level->top = 0;
+		level->n = 0;
+		level->has_pending = FALSE;
+
+		if( !(level->strip = VIPS_ARRAY( NULL,
+			(size_t) tile_size * width * pyramid->n_planes,
+			VipsPel )) )
+			return( -1 );
+
+		if( i < pyramid->n_levels - 1 &&
+			(!(level->pending = VIPS_ARRAY( NULL,
+				(size_t) width * bands, float )) ||
+			 !(level->shrunk = VIPS_ARRAY( NULL,
+				(size_t) (width + 1) / 2 * bands, float ))) )
+			return( -1 );
+
+		for( g = 0; g < pyramid->n_planes / 3; g++ ) {
+			char level_name[16];
+			char group_name[16];
+			char *dirname;
+
+			vips_snprintf( level_name, 16, "%d", i );
+			vips_snprintf( group_name, 16, "%d", g );
+			dirname = g_build_filename( pyramid->dirname,
+				level_name, group_name, NULL );
+			if( g_mkdir_with_parents( dirname, 0777 ) ) {
+				vips_error_system( errno, "writepyramid",
+					_( "unable to make \"%s\"" ), dirname );
+				g_free( dirname );
+				return( -1 );
+			}
+			g_free( dirname );
+		}
+
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	if( !(pyramid->tile = VIPS_ARRAY( NULL,
+		(size_t) tile_size * tile_size * 3, VipsPel )) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static Pyramid *
+pyramid_new( VipsImage *in, const char *dirname, const Basis *basis,
+	double *scale, int *bias, const char *suffix, int tile_size )
+{
+	Pyramid *pyramid;
+	const char *options;
+
+	if( !(pyramid = VIPS_NEW( NULL, Pyramid )) )
+		return( NULL );
+	memset( pyramid, 0, sizeof( Pyramid ) );
+
+	pyramid->in = in;
+	pyramid->dirname = vips_strdup( NULL, dirname );
+	pyramid->basis = basis;
+	pyramid->tile_size = tile_size;
+
+	/* Split ".jpg[Q=90]" into suffix and save options.
+	 */
+	if( (options = strchr( suffix, '[' )) ) {
+		pyramid->suffix = g_strndup( suffix, options - suffix );
+		pyramid->options = g_strdup( options );
+	}
+	else {
+		pyramid->suffix = g_strdup( suffix );
+		pyramid->options = g_strdup( "" );
+	}
+
+	if( !pyramid->dirname ||
+		pyramid_build_planes( pyramid, scale, bias ) ||
+		pyramid_build_levels( pyramid ) ) {
+		pyramid_free( pyramid );
+		return( NULL );
+	}
+
+	return( pyramid );
+}
+
+/* Quantise a float row into the strip.
+ */
+static void
+pyramid_quantise( PyramidLevel *level, const float *row )
+{
+	Pyramid *pyramid = level->pyramid;
+	int bands = pyramid->in->Bands;
+	int n_planes = pyramid->n_planes;
+	VipsPel * restrict q = level->strip +
+		(size_t) level->n * level->width * n_planes;
+
+	guint64 clipped;
+	int x, i;
+
+	clipped = 0;
+	for( x = 0; x < level->width; x++ ) {
+		for( i = 0; i < n_planes; i++ ) {
+			PyramidPlane *plane = &pyramid->planes[i];
+			float v;
+
+			if( plane->band < 0 ) {
+				q[i] = 0;
+				continue;
+			}
+
+			v = row[plane->band] / plane->scale + plane->bias + 0.5;
+			if( v < 0 ) {
+				v = 0;
+				clipped += 1;
+			}
+			else if( v >= 256 ) {
+				v = 255;
+				clipped += 1;
+			}
+
+			q[i] = (VipsPel) v;
+		}
+
+		row += bands;
+		q += n_planes;
+	}
+
+	pyramid->clipped += clipped;
+}
+
+static int
+pyramid_write_tile( PyramidLevel *level, int group, int tx, int ty,
+	int width, int height )
+{
+	Pyramid *pyramid = level->pyramid;
+
+	char level_name[16];
+	char group_name[16];
+	char name[256];
+	char *filename;
+	VipsImage *image;
+	int result;
+
+	vips_snprintf( level_name, 16, "%d", level->level );
+	vips_snprintf( group_name, 16, "%d", group );
+	vips_snprintf( name, 256, "%d_%d%s%s",
+		tx, ty, pyramid->suffix, pyramid->options );
+	filename = g_build_filename( pyramid->dirname,
+		level_name, group_name, name, NULL );
+
+#ifdef DEBUG
+	printf( "writing %s, %d x %d\n", filename, width, height );
+#endif /*DEBUG*/
+
+	if( !(image = vips_image_new_from_memory( pyramid->tile,
+		(size_t) width * height * 3,
+		width, height, 3, VIPS_FORMAT_UCHAR )) ) {
+		g_free( filename );
+		return( -1 );
+	}
+	result = vips_image_write_to_file( image, filename, NULL );
+	g_object_unref( image );
+	g_free( filename );
+	pyramid->tiles += 1;
+
+	return( result );
+}
+
+/* Cut the strip into tiles for each group of planes.
+ */
+static int
+pyramid_flush( PyramidLevel *level )
+{
+	Pyramid *pyramid = level->pyramid;
+	int tile_size = pyramid->tile_size;
+	int n_planes = pyramid->n_planes;
+	int ty = level->top / tile_size;
+
+	int g, tx, x, y;
+
+	for( g = 0; g < n_planes / 3; g++ )
+		for( tx = 0; tx < level->columns; tx++ ) {
+			int left = tx * tile_size;
+			int width = VIPS_MIN( tile_size, level->width - left );
+			VipsPel * restrict q = pyramid->tile;
+
+			for( y = 0; y < level->n; y++ ) {
+				VipsPel * restrict p = level->strip +
+					((size_t) y * level->width + left) *
+						n_planes +
+					g * 3;
+
+				for( x = 0; x < width; x++ ) {
+					q[0] = p[0];
+					q[1] = p[1];
+					q[2] = p[2];
+
+					p += n_planes;
+					q += 3;
+				}
+			}
+
+			if( pyramid_write_tile( level, g, tx, ty,
+				width, level->n ) )
+				return( -1 );
+		}
+
+	level->top += level->n;
+	level->n = 0;
+
+	return( 0 );
+}
+
+/* Average two rows into one of half the width, repeating the last column
+ * if the width is odd.
+ */
+static void
+pyramid_shrink( PyramidLevel *level, const float *a, const float *b )
+{
+	int bands = level->pyramid->in->Bands;
+	int width = level->width;
+	float * restrict q = level->shrunk;
+
+	int x, k;
+
+	for( x = 0; x < (width + 1) / 2; x++ ) {
+		const float *a0 = a + 2 * x * bands;
+		const float *b0 = b + 2 * x * bands;
+		int step = 2 * x + 1 < width ? bands : 0;
+
+		for( k = 0; k < bands; k++ )
+			q[k] = 0.25f * (a0[k] + a0[k + step] +
+				b0[k] + b0[k + step]);
+
+		q += bands;
+	}
+}
+
+static int pyramid_add( PyramidLevel *level, const float *row );
+
+/* Pass a row on to the next level, in pairs. An odd last row is paired with
+ * itself.
+ */
+static int
+pyramid_add_next( PyramidLevel *level, const float *row, gboolean last )
+{
+	int bands = level->pyramid->in->Bands;
+
+	if( !level->has_pending ) {
+		if( !last ) {
+			memcpy( level->pending, row,
+				(size_t) level->width * bands * 
+					sizeof( float ) );
+			level->has_pending = TRUE;
+			return( 0 );
+		}
+
+		pyramid_shrink( level, row, row );
+	}
+	else {
+		pyramid_shrink( level, level->pending, row );
+		level->has_pending = FALSE;
+	}
+
+	return( pyramid_add( level + 1, level->shrunk ) );
+}
+
+static int
+pyramid_add( PyramidLevel *level, const float *row )
+{
+	Pyramid *pyramid = level->pyramid;
+	gboolean last = level->top + level->n == level->height - 1;
+
+	pyramid_quantise( level, row );
+	level->n += 1;
+	if( (level->n == pyramid->tile_size || last) &&
+		pyramid_flush( level ) )
+		return( -1 );
+
+	if( level->level < pyramid->n_levels - 1 &&
+		pyramid_add_next( level, row, last ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static int
+pyramid_block( VipsRegion *region, VipsRect *area, void *a )
+{
+	Pyramid *pyramid = (Pyramid *) a;
+
+	int y;
+
+	for( y = 0; y < area->height; y++ ) {
+		float *p = (float *)
+			VIPS_REGION_ADDR( region, area->left, area->top + y );
+
+		if( pyramid_add( &pyramid->levels[0], p ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Write @str as a JSON string, quoted and escaped. The suffix comes from
+ * the command line, so it could have anything in it.
+ */
+static void
+pyramid_json_string( FILE *fp, const char *str )
+{
+	const unsigned char *p;
+
+	fputc( '"', fp );
+	for( p = (const unsigned char *) str; *p; p++ )
+		if( *p == '"' ||
+			*p == '\\' )
+			fprintf( fp, "\\%c", *p );
+		else if( *p < 0x20 )
+			fprintf( fp, "\\u%04x", *p );
+		else
+			fputc( *p, fp );
+	fputc( '"', fp );
+}
+
+static int
+pyramid_write_manifest( Pyramid *pyramid )
+{
+	char *filename;
+	char *format;
+	FILE *fp;
+	int i, j;
+
+	filename = g_build_filename( pyramid->dirname, "manifest.json", NULL );
+	if( !(fp = fopen( filename, "w" )) ) {
+		vips_error_system( errno, "writepyramid",
+			_( "unable to open \"%s\" for writing" ), filename );
+		g_free( filename );
+		return( -1 );
+	}
+
+	format = basis_format( pyramid->basis, pyramid->channels );
+	fprintf( fp, "{\n" );
+	fprintf( fp, "  \"format\": " );
+	pyramid_json_string( fp, format );
+	fprintf( fp, ",\n" );
+	fprintf( fp, "  \"basis\": " );
+	pyramid_json_string( fp, pyramid->basis->name );
+	fprintf( fp, ",\n" );
+	fprintf( fp, "  \"width\": %d,\n", pyramid->in->Xsize );
+	fprintf( fp, "  \"height\": %d,\n", pyramid->in->Ysize );
+	fprintf( fp, "  \"tile_size\": %d,\n", pyramid->tile_size );
+	fprintf( fp, "  \"suffix\": " );
+	pyramid_json_string( fp, pyramid->suffix );
+	fprintf( fp, ",\n" );
+	g_free( format );
+
+	/* The scale and bias for each coefficient, shared by the channels
+	 * of an RGB fit.
+	 */
+	fprintf( fp, "  \"scale\": [" );
+	for( i = 0; i < pyramid->n_slots; i++ ) {
+		PyramidPlane *plane =
+			&pyramid->planes[i + (pyramid->channels == 1 ? 3 : 0)];
+
+		fprintf( fp, "%s%g", i > 0 ? ", " : "", plane->scale );
+	}
+	fprintf( fp, "],\n" );
+	fprintf( fp, "  \"bias\": [" );
+	for( i = 0; i < pyramid->n_slots; i++ ) {
+		PyramidPlane *plane =
+			&pyramid->planes[i + (pyramid->channels == 1 ? 3 : 0)];
+
+		fprintf( fp, "%s%d", i > 0 ? ", " : "", plane->bias );
+	}
+	fprintf( fp, "],\n" );
+
+	fprintf( fp, "  \"levels\": [\n" );
+	for( i = 0; i < pyramid->n_levels; i++ ) {
+		PyramidLevel *level = &pyramid->levels[i];
+
+		fprintf( fp, "    { \"width\": %d, \"height\": %d, "
+			"\"columns\": %d, \"rows\": %d }%s\n",
+			level->width, level->height,
+			level->columns, level->rows,
+			i < pyramid->n_levels - 1 ? "," : "" );
+	}
+	fprintf( fp, "  ],\n" );
+
+	/* The planes in each group, null for padding.
+	 */
+	fprintf( fp, "  \"groups\": [\n" );
+	for( i = 0; i < pyramid->n_planes / 3; i++ ) {
+		fprintf( fp, "    [" );
+		for( j = 0; j < 3; j++ ) {
+			PyramidPlane *plane = &pyramid->planes[i * 3 + j];
+
+			if( j > 0 )
+				fprintf( fp, ", " );
+			if( plane->name[0] )
+				pyramid_json_string( fp, plane->name );
+			else
+				fprintf( fp, "null" );
+		}
+		fprintf( fp, "]%s\n", 
+			i < pyramid->n_planes / 3 - 1 ? "," : "" );
+	}
+	fprintf( fp, "  ]\n" );
+	fprintf( fp, "}\n" );
+
+	if( fclose( fp ) ) {
+		vips_error_system( errno, "writepyramid",
+			"%s", _( "write error ... disc full?" ) );
+		g_free( filename );
+		return( -1 );
+	}
+	g_free( filename );
+
+	return( 0 );
+}
+
+/* Write @in, float coefficients as for writeptm(), to a tile pyramid in
+ * @dirname. @suffix is the tile format, with any save options, eg.
+ * ".jpg[Q=90]". @info can be NULL.
+ */
+int
+writepyramid( VipsImage *in, const char *dirname, const Basis *basis,
+	double *scale, int *bias,
+	const char *suffix, int tile_size, WritePyramidInfo *info )
+{
+	Pyramid *pyramid;
+
+	if( vips_check_format( "writepyramid", in, VIPS_FORMAT_FLOAT ) ||
+		vips_check_uncoded( "writepyramid", in ) )
+		return( -1 );
+	if( tile_size < 1 ) {
+		vips_error( "writepyramid", "%s", _( "bad tile size" ) );
+		return( -1 );
+	}
+
+	if( !(pyramid = pyramid_new( in, dirname, basis,
+		scale, bias, suffix, tile_size )) )
+		return( -1 );
+
+	if( vips_sink_disc( in, pyramid_block, pyramid ) ||
+		pyramid_write_manifest( pyramid ) ) {
+		pyramid_free( pyramid );
+		return( -1 );
+	}
+
+	if( info ) {
+		info->levels = pyramid->n_levels;
+		info->tiles = pyramid->tiles;
+		info->clipped = pyramid->clipped;
+	}
+	pyramid_free( pyramid );
+
+	return( 0 );
+}
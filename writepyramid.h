@@ -0,0 +1,36 @@
+#ifndef WRITEPYRAMID_H
+#define WRITEPYRAMID_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#include <vips/vips.h>
+
+#include "basis.h"
+
+/* Keep i18n stuff happy.
+ */
+#define _(S) (S)
+
+/* What we made during a pyramid write.
+ */
+typedef struct _WritePyramidInfo {
+	int levels;
+	guint64 tiles;
+
+	/* Coefficients which fell outside the range scale and bias can
+	 * represent and were clipped.
+	 */
+	guint64 clipped;
+} WritePyramidInfo;
+
+int writepyramid( VipsImage *in, const char *dirname, const Basis *basis,
+	double *scale, int *bias,
+	const char *suffix, int tile_size, WritePyramidInfo *info );
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*WRITEPYRAMID_H*/